@@ -52,6 +52,20 @@
 /* Does this system have libbsd strl*** functions implementation */
 #define HAVE_LIBBSD 1
 
+/* Define to 1 if you have the <linux/io_uring.h> header file. */
+#if defined(__linux__) && defined(__has_include)
+#   if __has_include(<linux/io_uring.h>)
+#       define HAVE_LINUX_IO_URING_H 1
+#   endif
+#endif
+
+/* Define to 1 if you have the <linux/openat2.h> header file. */
+#if defined(__linux__) && defined(__has_include)
+#   if __has_include(<linux/openat2.h>)
+#       define HAVE_LINUX_OPENAT2_H 1
+#   endif
+#endif
+
 /* Define to 1 if you have the <memory.h> header file. */
 #define HAVE_MEMORY_H 1
 
@@ -15,6 +15,7 @@
 #import "netbiosNS.h"
 #import "netbiosQuery.h"
 #import "netbiosSession.h"
+#import "netbiosUring.h"
 #import "netbiosUtils.h"
 
 #endif /* netbiosHeader_h */
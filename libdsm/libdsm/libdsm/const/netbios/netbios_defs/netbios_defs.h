@@ -23,10 +23,19 @@
 #define NETBIOS_PORT_DIRECT   445 // TCP
 #define NETBIOS_PORT_DIRECT_SECONDARY 139 // TCP
 
+// Delay before the connection to the next port is raced with the previous
+// one, in milliseconds (see netbios_session_connect())
+#define NETBIOS_CONNECT_STAGGER       250
+
 #define NETBIOS_NAME_LENGTH   15
 
 #define NETBIOS_NAME_FLAG_GROUP (1 << 15)
 
+// Largest session message payload: 17 bits with the NetBIOS session framing,
+// 24 bits with the DirectTCP one (the whole 'flags' byte extends the length)
+#define NETBIOS_SESSION_MAX_PAYLOAD   0x1ffff
+#define NETBIOS_DIRECT_MAX_PAYLOAD    0xffffff
+
 // http://ubiqx.org/cifs/rfc-draft/rfc1001.html#s17.2
 #define NETBIOS_WILDCARD      { 32, 'C', 'K', 'A', 'A', 'A', 'A', 'A', 'A',    \
 'A', 'A', 'A', 'A', 'A', 'A', 'A', 'A', 'A', 'A', 'A', 'A', 'A', 'A', 'A', \
@@ -13,17 +13,22 @@
 #import "smb_defs.h"
 #import "smb_types.h"
 
+#import "smbBench.h"
 #import "smbBuffer.h"
 #import "smbDir.h"
 #import "smbFd.h"
 #import "smbFile.h"
+#import "smbIoctl.h"
+#import "smbLoopback.h"
 #import "smbMessage.h"
+#import "smbMockServer.h"
 #import "smbNTLM.h"
 #import "smbSession.h"
 #import "smbSessionMsg.h"
 #import "smbShare.h"
 #import "smbSpnego.h"
 #import "smbStat.h"
+#import "smbTransfer.h"
 #import "smbTransport.h"
 #import "smbUtils.h"
 
@@ -10,13 +10,51 @@
 #define smb_defs_h
 
 #define SMB_DEFAULT_BUFSIZE     (8192)
+/// Maximum number of READ_ANDX/WRITE_ANDX kept in flight on one file
+#define SMB_IO_PIPELINE_DEPTH   (16)
+/// Maximum payload of a single READ_ANDX request
+#define SMB_IO_READ_MAX         (0xffff)
+/// Maximum payload of a single WRITE_ANDX request, the whole SMB message
+/// shall not exceed the maximum size of the netbios data payload
+#define SMB_IO_WRITE_MAX        (0xffff - sizeof(smb_packet) - sizeof(smb_write_req))
+/// Upper bound of a READ_ANDX/WRITE_ANDX payload when the server supports
+/// CAP_LARGE_READX/CAP_LARGE_WRITEX
+#define SMB_IO_LARGE_MAX        (0x100000)
+/// Maximum data read by smb_fetch_small(), the answer of the chained CLOSE
+/// has to start within the first 64KB of the message
+#define SMB_FETCH_SMALL_MAX     (0xffff - sizeof(smb_packet) - sizeof(smb_create_resp) \
+                                 - sizeof(smb_read_resp) - 16)
+/// Default size of each buffer of smb_download_to_fd()/smb_upload_from_fd()
+#define SMB_TRANSFER_BUFFER_SIZE    (4 * 1024 * 1024)
+/// Maximum number of buffers of a transfer (3: triple buffering)
+#define SMB_TRANSFER_BUFFERS_MAX    (3)
+/// Alignment of the transfer buffers, sizes and offsets required by O_DIRECT
+#define SMB_TRANSFER_ALIGN          (4096)
+/// Granularity of the zero detection of sparse uploads
+#define SMB_TRANSFER_ZERO_BLOCK     (64 * 1024)
+/// Data moved between two checkpoints of a resumable transfer
+#define SMB_TRANSFER_CHECKPOINT_INTERVAL (64 * 1024 * 1024)
+/// Unit of work of striped transfers, the ranges handed to each session
+#define SMB_TRANSFER_STRIPE_SIZE    (32 * 1024 * 1024)
+/// Maximum number of sessions of a striped transfer
+#define SMB_TRANSFER_STREAMS_MAX    (16)
+/// Defaults of smb_bench_run(): size of the file written then read, size of
+/// each smb_fwrite()/smb_fread(), number of smb_find()/smb_fstat() calls and
+/// number of files in the directory smb_find() lists
+#define SMB_BENCH_FILE_SIZE         (64 * 1024 * 1024)
+#define SMB_BENCH_IO_SIZE           (64 * 1024)
+#define SMB_BENCH_COUNT             (1000)
+#define SMB_BENCH_FIND_ENTRIES      (100)
 
 enum
 {
     /// SMB with Direct-TCP connection (OSX supports only this)
     SMB_TRANSPORT_TCP           = 1,
     /// SMB with Netbios over TCP (older mechanism)
-    SMB_TRANSPORT_NBT           = 2
+    SMB_TRANSPORT_NBT           = 2,
+    /// SMB with Direct-TCP connection, I/O through io_uring (Linux). Works as
+    /// SMB_TRANSPORT_TCP where io_uring is not available.
+    SMB_TRANSPORT_URING         = 3
 };
 
 //-----------------------------------------------------------------------------/
@@ -51,6 +89,10 @@ enum
 enum smb_session_supports_what
 {
     SMB_SESSION_XSEC            = 0,
+    /// READ_ANDX can return more than 64KB
+    SMB_SESSION_LARGE_READX     = 1,
+    /// WRITE_ANDX can carry more than 64KB
+    SMB_SESSION_LARGE_WRITEX    = 2,
 };
 
 //-----------------------------------------------------------------------------/
@@ -118,10 +160,14 @@ enum smb_session_supports_what
 #define NT_STATUS_INVALID_SMB               0x00010002
 #define NT_STATUS_SMB_BAD_TID               0x00050002
 #define NT_STATUS_SMB_BAD_UID               0x005b0002
+#define NT_STATUS_BUFFER_OVERFLOW           0x80000005
 #define NT_STATUS_NOT_IMPLEMENTED           0xc0000002
+#define NT_STATUS_INVALID_HANDLE            0xc0000008
+#define NT_STATUS_INVALID_PARAMETER         0xc000000d
 #define NT_STATUS_INVALID_DEVICE_REQUEST    0xc0000010
 #define NT_STATUS_NO_SUCH_DEVICE            0xc000000e
 #define NT_STATUS_NO_SUCH_FILE              0xc000000f
+#define NT_STATUS_END_OF_FILE               0xc0000011
 #define NT_STATUS_MORE_PROCESSING_REQUIRED  0xc0000016
 #define NT_STATUS_INVALID_LOCK_SEQUENCE     0xc000001e
 #define NT_STATUS_INVALID_VIEW_SIZE         0xc000001f
@@ -155,6 +201,8 @@ enum smb_session_supports_what
 #define DSM_ERROR_NT        (-2) /* see smb_session_get_nt_status */
 #define DSM_ERROR_NETWORK   (-3)
 #define DSM_ERROR_CHARSET   (-4)
+#define DSM_ERROR_CANCELED  (-5) /* stopped by a callback */
+#define DSM_ERROR_TIMEOUT   (-6) /* see smb_session_set_timeouts */
 
 
 
@@ -183,6 +231,8 @@ NULL                          \
 // SMB Operations/Commands
 //-----------------------------------------------------------------------------/
 #define SMB_CMD_CLOSE           0x04
+#define SMB_CMD_FLUSH           0x05
+#define SMB_CMD_LOCKING         0x24 // Locking AndX, also carries oplock breaks
 #define SMD_CMD_TRANS           0x25
 #define SMB_CMD_TRANS2          0x32
 #define SMB_CMD_TREE_DISCONNECT 0x71
@@ -197,6 +247,7 @@ NULL                          \
 #define SMB_CMD_RMDIR           0x01
 #define SMB_CMD_RMFILE          0x06
 #define SMB_CMD_MOVE            0x07 // Move or rename
+#define SMB_CMD_NT_TRANSACT     0xa0
 
 //-----------------------------------------------------------------------------/
 // SMB FLAGS2 values
@@ -210,8 +261,29 @@ NULL                          \
 #define SMB_TR2_FIND_FIRST        0x0001
 #define SMB_TR2_FIND_NEXT         0x0002
 #define SMB_TR2_QUERY_PATH        0x0005
+#define SMB_TR2_SET_FILE_INFO     0x0008
 #define SMB_TR2_CREATE_DIRECTORY  0x000d
 
+//-----------------------------------------------------------------------------/
+// SMB NT_TRANSACT SubCommands and IOCTL/FSCTL codes
+//-----------------------------------------------------------------------------/
+#define SMB_NT_TRANSACT_IOCTL                   0x0002
+
+#define SMB_FSCTL_SRV_REQUEST_RESUME_KEY        0x00140078
+#define SMB_FSCTL_SRV_COPYCHUNK                 0x001440f2
+#define SMB_FSCTL_SET_SPARSE                    0x000900c4
+#define SMB_FSCTL_SET_ZERO_DATA                 0x000980c8
+#define SMB_FSCTL_QUERY_ALLOCATED_RANGES        0x000940cf
+
+/// Size of the key identifying the source file of a server-side copy
+#define SMB_COPYCHUNK_KEY_SIZE      (24)
+/// Number of chunks sent in one SRV_COPYCHUNK request
+#define SMB_COPYCHUNK_MAX_CHUNKS    (16)
+/// Maximum size of one chunk
+#define SMB_COPYCHUNK_MAX_SIZE      (0x100000)
+/// Number of ranges asked by one QUERY_ALLOCATED_RANGES request
+#define SMB_ALLOC_RANGES_MAX        (64)
+
 
 //-----------------------------------------------------------------------------/
 // SMB TRANS2 FIND interest values
@@ -234,6 +306,12 @@ NULL                          \
 #define SMB_FIND2_QUERY_FILE_STREAM_INFO      0x0109
 #define SMB_FIND2_QUERY_FILE_COMPRESSION_INFO 0x010B
 
+//-----------------------------------------------------------------------------/
+// SMB TRANS2 SET_FILE_INFORMATION interest values
+//-----------------------------------------------------------------------------/
+#define SMB_SET_FILE_ALLOCATION_INFO          0x0103
+#define SMB_SET_FILE_END_OF_FILE_INFO         0x0104
+
 //-----------------------------------------------------------------------------/
 // SMB CMD CREATE Impersonation level values
 //-----------------------------------------------------------------------------/
@@ -276,6 +354,8 @@ NULL                          \
 #define SMB_CAPS_NTSMB          (1 << 4)
 #define SMB_CAPS_RPC            (1 << 5)
 #define SMB_CAPS_NTFIND         (1 << 9)
+#define SMB_CAPS_LARGE_READX    (1 << 14)
+#define SMB_CAPS_LARGE_WRITEX   (1 << 15)
 #define SMB_CAPS_XSEC           (1 << 31)
 
 // File creation/open flags
@@ -294,39 +374,55 @@ NULL                          \
 #define SMB_ATTR_DIR            (1 << 4)
 #define SMB_ATTR_ARCHIVE        (1 << 5)  // Modified since last archive (!?)
 
+// Oplock levels, as granted by a Create AndX response
+#define SMB_OPLOCK_NONE         0
+#define SMB_OPLOCK_EXCLUSIVE    1
+#define SMB_OPLOCK_BATCH        2
+#define SMB_OPLOCK_LEVEL_II     3
+
+// Locking AndX type of lock flags
+#define SMB_LOCK_SHARED         (1 << 0)
+#define SMB_LOCK_OPLOCK_RELEASE (1 << 1)
+#define SMB_LOCK_CHANGE_TYPE    (1 << 2)
+#define SMB_LOCK_CANCEL         (1 << 3)
+#define SMB_LOCK_LARGE_FILES    (1 << 4)
+
+// Multiplex id of the requests sent by the server on its own (oplock breaks)
+#define SMB_MID_UNSOLICITED     0xffff
+
 // Share access flags
 #define SMB_SHARE_READ          (1 << 0)
 #define SMB_SHARE_WRITE         (1 << 1)
 #define SMB_SHARE_DELETE        (1 << 2)
 
-// Create disposition flags
+// Create disposition values (not flags, only one can be used)
 #define SMB_DISPOSITION_FILE_SUPERSEDE      0
-#define SMB_DISPOSITION_FILE_OPEN           (1 << 0)
-#define SMB_DISPOSITION_FILE_CREATE         (1 << 1)
-#define SMB_DISPOSITION_FILE_OPEN_IF        (1 << 2)
-#define SMB_DISPOSITION_FILE_OVERWRITE      (1 << 3)
-#define SMB_DISPOSITION_FILE_OVERWRITE_IF   (1 << 4)
+#define SMB_DISPOSITION_FILE_OPEN           1
+#define SMB_DISPOSITION_FILE_CREATE         2
+#define SMB_DISPOSITION_FILE_OPEN_IF        3
+#define SMB_DISPOSITION_FILE_OVERWRITE      4
+#define SMB_DISPOSITION_FILE_OVERWRITE_IF   5
 
 // Create options flags
 #define SMB_CREATEOPT_DIRECTORY_FILE             (1 << 0)
 #define SMB_CREATEOPT_WRITE_THROUGH              (1 << 1)
 #define SMB_CREATEOPT_SEQUENTIAL_ONLY            (1 << 2)
 #define SMB_CREATEOPT_NO_INTERMEDIATE_BUFFERING  (1 << 3)
-#define SMB_CREATEOPT_SYNCHRONOUS_IO_ALERT       (1 << 3)
-#define SMB_CREATEOPT_SYNCHRONOUS_IO_NONALERTIF  (1 << 4)
-#define SMB_CREATEOPT_NON_DIRECTORY_FILE         (1 << 5)
-#define SMB_CREATEOPT_CREATE_TREE_CONNECTION     (1 << 6)
-#define SMB_CREATEOPT_COMPLETE_IF_OPLOCKED       (1 << 7)
-#define SMB_CREATEOPT_NO_EA_KNOWLEDGE            (1 << 8)
-#define SMB_CREATEOPT_OPEN_FOR_RECOVERY          (1 << 9)
-#define SMB_CREATEOPT_RANDOM_ACCESS              (1 << 10)
-#define SMB_CREATEOPT_DELETE_ON_CLOSE            (1 << 11)
-#define SMB_CREATEOPT_OPEN_BY_FILE_ID            (1 << 12)
-#define SMB_CREATEOPT_OPEN_FOR_BACKUP_INTENT     (1 << 13)
-#define SMB_CREATEOPT_NO_COMPRESSION             (1 << 14)
-#define SMB_CREATEOPT_RESERVE_OPFILTER           (1 << 15)
-#define SMB_CREATEOPT_OPEN_NO_RECALL             (1 << 16)
-#define SMB_CREATEOPT_OPEN_FOR_FREE_SPACE_QUERY  (1 << 17)
+#define SMB_CREATEOPT_SYNCHRONOUS_IO_ALERT       (1 << 4)
+#define SMB_CREATEOPT_SYNCHRONOUS_IO_NONALERTIF  (1 << 5)
+#define SMB_CREATEOPT_NON_DIRECTORY_FILE         (1 << 6)
+#define SMB_CREATEOPT_CREATE_TREE_CONNECTION     (1 << 7)
+#define SMB_CREATEOPT_COMPLETE_IF_OPLOCKED       (1 << 8)
+#define SMB_CREATEOPT_NO_EA_KNOWLEDGE            (1 << 9)
+#define SMB_CREATEOPT_OPEN_FOR_RECOVERY          (1 << 10)
+#define SMB_CREATEOPT_RANDOM_ACCESS              (1 << 11)
+#define SMB_CREATEOPT_DELETE_ON_CLOSE            (1 << 12)
+#define SMB_CREATEOPT_OPEN_BY_FILE_ID            (1 << 13)
+#define SMB_CREATEOPT_OPEN_FOR_BACKUP_INTENT     (1 << 14)
+#define SMB_CREATEOPT_NO_COMPRESSION             (1 << 15)
+#define SMB_CREATEOPT_RESERVE_OPFILTER           (1 << 20)
+#define SMB_CREATEOPT_OPEN_NO_RECALL             (1 << 22)
+#define SMB_CREATEOPT_OPEN_FOR_FREE_SPACE_QUERY  (1 << 23)
 
 // Security flags
 #define SMB_SECURITY_NO_TRACKING            0
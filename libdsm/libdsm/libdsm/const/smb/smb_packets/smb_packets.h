@@ -67,7 +67,8 @@ SMB_PACKED_START typedef struct {
 uint8_t         wct;            /* +-17 :) */                                   \
 uint16_t        dialect_index;                                                  \
 uint8_t         security_mode;  /* Share/User. Plaintext/Challenge */           \
-uint32_t        diplodocus;                                                     \
+uint16_t        max_mpx;        /* Max pending requests the server accepts */   \
+uint16_t        max_vcs;                                                        \
 uint32_t        max_bufsize;    /* Max buffer size requested by server. */      \
 uint32_t        max_rawbuffer;  /* Max raw buffer size requested by serv. */    \
 uint32_t        session_key;    /* 'MUST' be returned to server */              \
@@ -225,6 +226,30 @@ SMB_PACKED_START typedef struct {
     uint16_t        bct;                // 0
 } SMB_PACKED_END   smb_close_req;
 
+/*!Flush File
+ */
+SMB_PACKED_START typedef struct {
+    uint8_t         wct;                // 1
+    uint16_t        fid;                // 0xffff flushes all the files of the session
+    uint16_t        bct;                // 0
+} SMB_PACKED_END   smb_flush_req;
+
+/*!Locking AndX
+ * Only used for oplocks: the server breaks an oplock with this request
+ * (no locks, OPLOCK_RELEASE set) and the client acknowledges it the same way.
+ */
+SMB_PACKED_START typedef struct {
+    uint8_t         wct;                // 8
+    SMB_ANDX_MEMBERS
+    uint16_t        fid;
+    uint8_t         type_of_lock;
+    uint8_t         oplock_level;       // 0 -> none, 1 -> level II
+    uint32_t        timeout;
+    uint16_t        num_unlocks;
+    uint16_t        num_locks;
+    uint16_t        bct;                // 0
+} SMB_PACKED_END   smb_locking_req;
+
 /*!Read File
  */
 SMB_PACKED_START typedef struct
@@ -235,7 +260,7 @@ SMB_PACKED_START typedef struct
     uint32_t        offset;
     uint16_t        max_count;
     uint16_t        min_count;
-    uint32_t        max_count_high;     // Continuation of max_count field
+    uint32_t        max_count_high;     // Continuation of max_count field (CAP_LARGE_READX)
     uint16_t        remaining;
     uint32_t        offset_high;        // Continuation of offset field'
     uint16_t        bct;                // 0
@@ -267,7 +292,7 @@ SMB_PACKED_START typedef struct {
     uint32_t        timeout;
     uint16_t        write_mode;
     uint16_t        remaining;
-    uint16_t        reserved;
+    uint16_t        data_len_high;      // Continuation of data_len (CAP_LARGE_WRITEX)
     uint16_t        data_len;
     uint16_t        data_offset;
     uint32_t        offset_high;        // Continuation of offset field'
@@ -283,7 +308,8 @@ SMB_PACKED_START typedef struct {
     
     uint16_t        data_len;
     uint16_t        available;
-    uint32_t        reserved;
+    uint16_t        data_len_high;      // Continuation of data_len (CAP_LARGE_WRITEX)
+    uint16_t        reserved;
     uint16_t        bct;
 } SMB_PACKED_END   smb_write_resp;
 
@@ -422,6 +448,14 @@ SMB_PACKED_START typedef struct {
     uint8_t       path[];
 } SMB_PACKED_END   smb_tr2_query;
 
+/*! -> Trans2|SetFileInformation
+ */
+SMB_PACKED_START typedef struct {
+    uint16_t      fid;
+    uint16_t      interest;
+    uint16_t      reserved;
+} SMB_PACKED_END   smb_tr2_set_file_info;
+
 /*!<- Trans2
  */
 
@@ -504,6 +538,87 @@ SMB_PACKED_START typedef struct {
     uint8_t       name[];
 } SMB_PACKED_END   smb_tr2_path_info;
 
+/*!-> NT Transact|IOCTL
+ */
+SMB_PACKED_START typedef struct {
+    uint8_t       wct;                // 19 + setup_count = 23
+    uint8_t       max_setup_count;
+    uint16_t      reserved;
+    uint32_t      total_param_count;
+    uint32_t      total_data_count;
+    uint32_t      max_param_count;
+    uint32_t      max_data_count;
+    uint32_t      param_count;
+    uint32_t      param_offset;
+    uint32_t      data_count;
+    uint32_t      data_offset;
+    uint8_t       setup_count;        // 4
+    uint16_t      cmd;                // SMB_NT_TRANSACT_IOCTL
+    uint32_t      function;           // FSCTL code
+    uint16_t      fid;
+    uint8_t       is_fsctl;
+    uint8_t       is_flags;
+    uint16_t      bct;
+    uint8_t       payload[];
+} SMB_PACKED_END   smb_nt_trans_ioctl_req;
+
+/*!<- NT Transact
+ */
+SMB_PACKED_START typedef struct {
+    uint8_t       wct;                // 18 + setup_count
+    uint8_t       reserved[3];
+    uint32_t      total_param_count;
+    uint32_t      total_data_count;
+    uint32_t      param_count;
+    uint32_t      param_offset;
+    uint32_t      param_displacement;
+    uint32_t      data_count;
+    uint32_t      data_offset;
+    uint32_t      data_displacement;
+    uint8_t       setup_count;
+    uint8_t       payload[];          // setup words, bct and data
+} SMB_PACKED_END   smb_nt_trans_resp;
+
+/*!-> FSCTL_SRV_COPYCHUNK chunk
+ */
+SMB_PACKED_START typedef struct {
+    uint64_t      src_offset;
+    uint64_t      dst_offset;
+    uint32_t      length;
+    uint32_t      reserved;
+} SMB_PACKED_END   smb_copychunk;
+
+/*!-> FSCTL_SRV_COPYCHUNK input
+ */
+SMB_PACKED_START typedef struct {
+    uint8_t       key[24];            // From FSCTL_SRV_REQUEST_RESUME_KEY
+    uint32_t      chunk_count;
+    uint32_t      reserved;
+    smb_copychunk chunks[];
+} SMB_PACKED_END   smb_copychunk_req;
+
+/*!<- FSCTL_SRV_COPYCHUNK output
+ */
+SMB_PACKED_START typedef struct {
+    uint32_t      chunks_written;
+    uint32_t      chunk_bytes_written;
+    uint32_t      total_bytes_written;
+} SMB_PACKED_END   smb_copychunk_resp;
+
+/*!<-> FSCTL_QUERY_ALLOCATED_RANGES input and output entries
+ */
+SMB_PACKED_START typedef struct {
+    uint64_t      offset;
+    uint64_t      length;
+} SMB_PACKED_END   smb_file_range;
+
+/*!-> FSCTL_SET_ZERO_DATA input
+ */
+SMB_PACKED_START typedef struct {
+    uint64_t      offset;
+    uint64_t      beyond_final_zero;  // First byte not zeroed
+} SMB_PACKED_END   smb_zero_data;
+
 /*!-> Example
  */
 SMB_PACKED_START typedef struct {
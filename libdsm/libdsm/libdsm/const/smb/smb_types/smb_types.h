@@ -13,11 +13,14 @@
 #import <stdint.h>
 #import <stddef.h>
 #import <stdbool.h>
+#import <pthread.h>
+#import <time.h>
 
 #import "libtasn1.h"
 
 #if !defined _WIN32
 #   import<netinet/ip.h>
+#   import<sys/uio.h>
 #else
 #   import<winsock2.h>
 #endif
@@ -84,6 +87,127 @@ typedef smb_file *smb_stat_list;
  */
 typedef smb_file *smb_stat;
 
+/**
+ * @brief Options of smb_fopen_ex(), see smb_fopen_opts_init() for defaults
+ */
+typedef struct
+{
+    uint32_t            disposition;    // SMB_DISPOSITION_FILE_*
+    uint32_t            create_opts;    // SMB_CREATEOPT_*, like SEQUENTIAL_ONLY or RANDOM_ACCESS
+    uint32_t            share_access;   // SMB_SHARE_*
+    uint64_t            alloc_size;     // Initial allocation of a created/overwritten file
+    bool                write_through;  // Server must write to disk before answering
+    uint32_t            oplock;         // SMB_CREATE_OPLOCK, optionally | SMB_CREATE_BATCH_OPLOCK
+} smb_fopen_opts;
+
+/**
+ * @brief Progress of a transfer, given to smb_transfer_callbacks
+ */
+typedef struct
+{
+    uint64_t            done;           // Bytes at the destination, from the start of the file
+    uint64_t            total;          // Size of the file, 0 if unknown
+    double              rate;           // Recent throughput, in bytes per second
+    double              eta;            // Estimated seconds left, negative if unknown
+} smb_transfer_progress;
+
+typedef struct
+{
+    // Opaque pointer that will be passed to callbacks
+    void *p_opaque;
+    
+    // Called each time a buffer reached the destination, return false to stop the transfer
+    bool (*pf_on_progress)(void *p_opaque, const smb_transfer_progress *progress);
+} smb_transfer_callbacks;
+
+/**
+ * @brief Options of smb_download_to_fd() and smb_upload_from_fd(), see smb_transfer_opts_init() for defaults
+ */
+typedef struct
+{
+    off_t               offset;         // Start of the range, the same in both files
+    uint64_t            length;         // Size of the range, 0 for up to the end of the source
+    size_t              buffer_size;    // Size of each buffer
+    size_t              buffers;        // 2 (double) or 3 (triple buffering)
+    bool                preallocate;    // Reserve the destination space first
+    bool                direct;         // Bypass the local page cache (O_DIRECT/F_NOCACHE)
+    bool                sparse;         // Skip the holes of sparse sources
+    const smb_transfer_callbacks *callbacks; // Progress reports, can be NULL
+} smb_transfer_opts;
+
+/**
+ * @brief The server, credentials and share the sessions of a striped transfer (or of smb_bench_run_remote()) log into
+ */
+typedef struct
+{
+    const char          *hostname;      // The netbios name of the server
+    uint32_t            ip;             // Its ip, in network byte order
+    int                 transport;      // SMB_TRANSPORT_TCP, SMB_TRANSPORT_NBT or SMB_TRANSPORT_URING
+    const char          *domain;
+    const char          *login;
+    const char          *password;
+    const char          *share;         // The share the file is in
+} smb_stripe_target;
+
+/**
+ * @brief Options of smb_bench_run(), see smb_bench_opts_init() for defaults
+ */
+typedef struct
+{
+    uint64_t            file_size;      // Size of the file written then read
+    size_t              io_size;        // Size of each smb_fwrite()/smb_fread()
+    unsigned            count;          // Number of smb_find() and of smb_fstat() calls
+    unsigned            find_entries;   // Number of files in the directory smb_find() lists
+} smb_bench_opts;
+
+/**
+ * @brief Measure of one of the operations of smb_bench_run()
+ */
+typedef struct
+{
+    uint64_t            ops;            // Number of calls
+    uint64_t            bytes;          // Data they moved, 0 for smb_find() and smb_fstat()
+    double              seconds;        // Time they took
+} smb_bench_result;
+
+/**
+ * @brief Measures of smb_bench_run(), one per operation
+ */
+typedef struct
+{
+    smb_bench_result    fwrite;
+    smb_bench_result    fread;
+    smb_bench_result    find;
+    smb_bench_result    fstat;
+} smb_bench_results;
+
+/**
+ * @internal
+ * @brief Read-ahead state of an open file, disabled while 'max' is 0
+ */
+typedef struct
+{
+    uint8_t             *buf;           // Prefetched data, 'max' bytes long
+    size_t              max;            // Largest window allowed
+    size_t              window;         // Current window, 0 after random reads
+    off_t               offset;         // File offset of buf[0]
+    size_t              len;            // Number of valid bytes in buf
+    off_t               next;           // Where a sequential read would start
+} smb_readahead;
+
+/**
+ * @internal
+ * @brief Write-behind state of an open file, disabled while 'max' is 0
+ */
+typedef struct
+{
+    uint8_t             *buf;           // Data accepted but not sent yet
+    size_t              max;            // Size of buf
+    off_t               offset;         // File offset of buf[0]
+    size_t              len;            // Number of bytes waiting in buf
+    int                 error;          // Deferred error of a previous flush
+} smb_writebehind;
+
 /**
  * @internal
  * @struct smb_file
@@ -105,6 +229,15 @@ struct smb_file
     uint32_t            attr;
     off_t               offset;          // Current position pointer
     int                 is_dir;         // 0 -> file, 1 -> directory
+    bool                write_through;  // WRITE_ANDX are sent in write-through mode
+    uint8_t             oplock;         // SMB_OPLOCK_* held on the file
+    bool                oplock_break;   // A break waits for the write-behind to be flushed
+    uint8_t             oplock_break_to; // SMB_OPLOCK_* the pending break lowers to
+    smb_readahead       ra;             // Read-ahead window, see smb_file_set_readahead()
+    smb_writebehind     wb;             // Write-behind buffer, see smb_file_set_writebehind()
+    char                *path;          // Handle cache key, with tid and mode
+    uint32_t            mode;           // SMB_MOD_* the file was opened with
+    time_t              closed;         // When it went to the handle cache
 };
 
 typedef struct smb_share smb_share;
@@ -122,13 +255,21 @@ typedef struct smb_transport smb_transport;
 struct smb_transport
 {
     void              *session;
+    size_t            max_frame;        // Largest payload a frame can carry
     void              *(*new)(size_t buf_size);
     int               (*connect)(uint32_t ip, void *s, const char *name);
     void              (*destroy)(void *s);
     void              (*pkt_init)(void *s);
     int               (*pkt_append)(void *s, void *data, size_t size);
     int               (*send)(void *s);
+    int               (*sendv)(void *s, const struct iovec *iov, int iovcnt);
     ssize_t           (*recv)(void *s, void **data);
+    ssize_t           (*recv_head)(void *s, size_t head_size, void **data);
+    ssize_t           (*recv_body)(void *s, void *dst, size_t size, void **data);
+    void              (*set_timeouts)(void *s, unsigned connect_ms,
+                                      unsigned send_ms, unsigned recv_ms);
+    int               (*timed_out)(void *s);
+    int               (*flush)(void *s);    // Sends what sendv() may have kept
 };
 
 typedef struct smb_srv_info smb_srv_info;
@@ -138,6 +279,9 @@ struct smb_srv_info
     uint16_t            dialect;        // The selected dialect
     uint16_t            security_mode;  // Security mode
     uint16_t            uid;            // uid attributed by the server.
+    uint16_t            max_mpx;        // Max outstanding requests allowed by the server
+    uint32_t            max_read;       // Max payload of a READ_ANDX
+    uint32_t            max_write;      // Max payload of a WRITE_ANDX
     uint32_t            session_key;    // The session key sent by the server on protocol negotiate
     uint32_t            caps;           // Server caps replyed during negotiate
     uint64_t            challenge;      // For challenge response security
@@ -164,6 +308,18 @@ struct smb_session
     
     smb_share           *shares;          // shares->files | Map fd <-> smb_file
     uint32_t            nt_status;
+    uint16_t            mid;              // Last multiplex id sent
+    pthread_mutex_t     io_lock;          // Serializes exchanges of concurrent callers
+    size_t              oplock_breaks;    // Number of files with a pending oplock break
+    bool                deferred_close;   // smb_fclose() doesn't wait for the answer
+    size_t              closes_pending;   // Number of CLOSE answers not received yet
+    smb_file            *cached;          // Closed files kept open, most recent first
+    size_t              cached_count;
+    size_t              cache_max;        // Handle cache size, 0 when disabled
+    unsigned            cache_idle;       // Seconds a handle stays cached, 0 for ever
+    unsigned            connect_timeout;  // Network deadlines in ms, 0 for none
+    unsigned            send_timeout;
+    unsigned            recv_timeout;
 };
 
 typedef struct smb_message smb_message;
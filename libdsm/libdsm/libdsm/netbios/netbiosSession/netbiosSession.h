@@ -12,6 +12,7 @@
 
 #if !defined _WIN32
 #   import <netinet/in.h>
+#   import <sys/uio.h>
 #else
 #   import <winsock2.h>
 #endif
@@ -22,6 +23,15 @@
 #define NETBIOS_SESSION_ERROR       -1
 #define NETBIOS_SESSION_REFUSED     -2
 
+// Maximum number of buffers given to netbios_session_packet_sendv()
+#define NETBIOS_SESSION_MAX_IOV     8
+// Number of ports raced by netbios_session_connect()
+#define NETBIOS_SESSION_MAX_PORTS   2
+// Size of the buffer of what is received ahead of the current frame
+#define NETBIOS_SESSION_RBUF_SIZE   (64 * 1024)
+// Reads from that size on go straight to their destination with io_uring
+#define NETBIOS_SESSION_URING_DIRECT (16 * 1024)
+
 typedef struct netbios_session_s {
     // The address of the remote peer;
     struct sockaddr_in          remote_addr;
@@ -29,12 +39,32 @@ typedef struct netbios_session_s {
     int                         socket;
     // The current sessions state; See macro before (eg. NETBIOS_SESSION_ERROR)
     int                         state;
+    // DirectTCP framing, the length of a message is 24 bits instead of 17
+    bool                        direct_tcp;
     // What is the size of the allocated payload;
     size_t                      packet_payload_size;
     // Where is the write cursor relative to the beginning of the payload
     size_t                      packet_cursor;
+    // How many bytes of the last received packet payload are in 'packet'
+    size_t                      packet_received;
+    // How many bytes of the last received packet are still in the socket
+    size_t                      packet_pending;
     // Our allocated packet, this is where the magic happen (both send and recv :)
     netbios_session_packet      *packet;
+    // What a receive got past the bytes asked for (the next frames, often),
+    // read from 'rbuf_start' to 'rbuf_end' before the socket is used again
+    uint8_t                     *rbuf;
+    size_t                      rbuf_start;
+    size_t                      rbuf_end;
+    // Deadlines of a connect, of sending a message and of receiving one (or
+    // a part of one), in milliseconds. 0 waits for ever.
+    unsigned                    connect_timeout;
+    unsigned                    send_timeout;
+    unsigned                    recv_timeout;
+    // A deadline passed, the stream is out of sync and the session unusable
+    bool                        timed_out;
+    // Set when the I/O goes through an io_uring, see netbios_session_use_uring()
+    struct netbios_uring_s      *uring;
 } netbios_session;
 
 @interface netbiosSession : NSObject
@@ -45,11 +75,51 @@ netbios_session *netbios_session_new(size_t buf_size);
 void netbios_session_destroy(netbios_session *);
 
 #pragma mark - netbiosSessionConnect
+/*!Connect to the SMB service of a host
+ * Port 445 (DirectTCP) and port 139 are raced: the connection to 139 starts #NETBIOS_CONNECT_STAGGER ms after the one to 445 (at once if 445 failed), and the first one established is kept. A filtered port doesn't delay the other one by a whole connect timeout.
+ * If 445 wins, the session uses DirectTCP framing. If 139 wins, DirectTCP framing is used if 'direct_tcp' is set, otherwise a NetBIOS session is requested for 'name' first.
+ *\returns 1 once connected, 0 on error (see netbios_session_timed_out()) or if the NetBIOS session was refused
+ */
 int netbios_session_connect(uint32_t ip,
                                           netbios_session *s,
                                           const char *name,
                                           int direct_tcp);
 
+#pragma mark - netbiosSessionSetTimeouts
+/*!Set the deadlines of the network operations of a session
+ * The socket is nonblocking, each operation polls it until it completes or its deadline passes. After a send or receive timeout, the stream is out of sync: every operation fails until the session is destroyed.
+ *\param connect_ms Deadline of the connection to each port, in milliseconds (0 for the system one)
+ *\param send_ms Deadline of the sending of a message, in milliseconds (0 for none)
+ *\param recv_ms Deadline of the receiving of a message, or of the part of it asked at once, in milliseconds (0 for none)
+ */
+void netbios_session_set_timeouts(netbios_session *s, unsigned connect_ms,
+                                  unsigned send_ms, unsigned recv_ms);
+
+#pragma mark - netbiosSessionTimedOut
+/*!Tell if the last failure of the session was a deadline
+ *\returns 1 if an operation timed out, 0 otherwise
+ */
+int netbios_session_timed_out(netbios_session *s);
+
+#pragma mark - netbiosSessionUseUring
+/*!Do the I/O of a connected session through an io_uring (Linux only)
+ * The messages sent are gathered and go out with the next receive, all in a single io_uring_enter() call. The small receives land in the receive buffer, which is registered with the ring.
+ * Since a message may not be sent before the next receive, netbios_session_flush() must be called when none follows.
+ *\returns 1 if the io_uring is used, 0 if it isn't available, in which case the session keeps working with the socket calls
+ */
+int netbios_session_use_uring(netbios_session *s);
+
+#pragma mark - netbiosSessionFlush
+/*!Send the messages that are still gathered (see netbios_session_use_uring())
+ *\returns 1 on success, 0 on error
+ */
+int netbios_session_flush(netbios_session *s);
+
+#pragma mark - netbiosSessionMaxPayload
+/*!Largest SMB message that can be carried by a single frame of this session
+ */
+size_t netbios_session_max_payload(netbios_session *s);
+
 #pragma mark - netbiosSessionPacketInit
 void netbios_session_packet_init(netbios_session *s);
 
@@ -60,7 +130,32 @@ int netbios_session_packet_append(netbios_session *s,
 #pragma mark - netbiosSessionPacketSend
 int netbios_session_packet_send(netbios_session *s);
 
+#pragma mark - netbiosSessionPacketSendv
+/*!Send a session message made of several buffers, without copying them into the session packet.
+ * The NetBIOS header is built from the total size, then everything is sent with sendmsg(). Partial sends are resumed until the whole message is out.
+ *\param iovcnt Number of buffers, at most NETBIOS_SESSION_MAX_IOV
+ *\returns The number of bytes sent or 0 on error
+ */
+int netbios_session_packet_sendv(netbios_session *s, const struct iovec *iov,
+                                 int iovcnt);
+
 #pragma mark - netbiosSessionPacketRecv
 ssize_t netbios_session_packet_recv(netbios_session *s, void **data);
+
+#pragma mark - netbiosSessionPacketRecvHead
+/*!Receive the next packet, but only its first 'head_size' bytes.
+ * The rest of the packet stays in the socket until it is fetched with netbios_session_packet_recv_body() (it is skipped otherwise when receiving the next packet).
+ *\returns The full payload size of the packet or -1 on error
+ */
+ssize_t netbios_session_packet_recv_head(netbios_session *s, size_t head_size,
+                                         void **data);
+
+#pragma mark - netbiosSessionPacketRecvBody
+/*!Receive up to 'size' more bytes of the current packet.
+ * If 'dst' is NULL, data is appended to the session buffer after the head (and 'data' updated since the buffer may move), otherwise it is received directly into 'dst'.
+ *\returns The number of bytes received or -1 on error
+ */
+ssize_t netbios_session_packet_recv_body(netbios_session *s, void *dst,
+                                         size_t size, void **data);
 @end
 #endif
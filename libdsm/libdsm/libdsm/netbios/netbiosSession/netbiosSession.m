@@ -11,6 +11,7 @@
 #import "smb_defs.h"
 #import "compat.h"
 #import "netbiosHeader.h"
+#import "netbiosUring.h"
 
 #import <assert.h>
 #import <stdio.h>
@@ -26,8 +27,14 @@
 #ifdef HAVE_SYS_SOCKET_H
 #   import <sys/socket.h>
 #endif
+#import <sys/uio.h>
+#import <fcntl.h>
+#import <poll.h>
+#import <time.h>
 #   import <errno.h>
 
+static int session_buffer_realloc(netbios_session *s, size_t new_size);
+
 @implementation netbiosSession
 #pragma mark - netbiosSessionNew
 netbios_session *netbios_session_new(size_t buf_size) {
@@ -42,7 +49,10 @@ netbios_session *netbios_session_new(size_t buf_size) {
     session->packet_payload_size = buf_size;
     packet_size = sizeof(netbios_session_packet) + session->packet_payload_size;
     session->packet = (netbios_session_packet *)malloc(packet_size);
-    if (!session->packet) {
+    session->rbuf   = (uint8_t *)malloc(NETBIOS_SESSION_RBUF_SIZE);
+    if (!session->packet || !session->rbuf) {
+        free(session->packet);
+        free(session->rbuf);
         free(session);
         return NULL;
     }
@@ -57,61 +67,229 @@ void netbios_session_destroy(netbios_session * s) {
         return;
     }
     
+    if (s->uring != NULL) {
+        netbios_session_flush(s);
+        netbios_uring_destroy(s->uring);
+    }
     if (s->socket != -1) {
         closesocket(s->socket);
     }
     
     free(s->packet);
+    free(s->rbuf);
     free(s);
 }
 
-static int open_socket_and_connect(netbios_session *s) {
-    if ((s->socket = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        goto error;
+// Milliseconds since 'start'
+static long netbios_session_elapsed(const struct timespec *start) {
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000
+           + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+// Waits until the socket is ready for 'events', at most 'timeout' ms after
+// 'start' (for ever if 0). Returns 1 when it is ready (or in error, which
+// the next call reports), 0 once the deadline passed, -1 on error.
+static int netbios_session_wait(netbios_session *s, short events,
+                                unsigned timeout, const struct timespec *start) {
+    struct pollfd pfd;
+    long elapsed;
+    int res, wait = -1;
+    
+    for (;;) {
+        if (timeout > 0) {
+            elapsed = netbios_session_elapsed(start);
+            if (elapsed >= (long)timeout) {
+                s->timed_out = true;
+                return 0;
+            }
+            wait = (int)(timeout - elapsed);
+        }
+        
+        pfd.fd      = s->socket;
+        pfd.events  = events;
+        pfd.revents = 0;
+        res = poll(&pfd, 1, wait);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        if (res != 0) {
+            return res > 0 ? 1 : -1;
+        }
+    }
+}
+
+// Starts a nonblocking connection to 'addr'. Returns the socket, or -1 if the
+// connection failed at once. '*done' tells if it is already established.
+static int netbios_session_connect_start(const struct sockaddr_in *addr,
+                                         bool *done) {
+    int sock, flags;
+    
+    *done = false;
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        return -1;
     }
     
-    if (connect(s->socket, (struct sockaddr *)&s->remote_addr, sizeof(s->remote_addr)) <0) {
-        goto error;
+    // Nonblocking, so no operation waits longer than its deadline
+    if ((flags = fcntl(sock, F_GETFL, 0)) < 0
+        || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0) {
+        closesocket(sock);
+        return -1;
     }
     
-    return DSM_SUCCESS;
+    if (connect(sock, (const struct sockaddr *)addr, sizeof(*addr)) == 0) {
+        *done = true;
+    } else if (errno != EINPROGRESS) {
+        //bdsm_perror("netbios_session_new, open_socket: ");
+        closesocket(sock);
+        return -1;
+    }
     
-error:
-    //bdsm_perror("netbios_session_new, open_socket: ");
-    return DSM_ERROR_NETWORK;
+    return sock;
+}
+
+// Races the connections to the 'nb_ports' ports of 'ip': each one is started
+// NETBIOS_CONNECT_STAGGER ms after the previous one (at once if all the
+// previous ones failed) and has 'connect_timeout' ms to be established. The
+// first one established is kept in 's', the others are closed.
+// Returns the index of the winning port, or -1 if none could be connected.
+static int netbios_session_race(netbios_session *s, uint32_t ip,
+                                const uint16_t *ports, unsigned nb_ports) {
+    struct sockaddr_in  addr[NETBIOS_SESSION_MAX_PORTS];
+    struct pollfd       pfd[NETBIOS_SESSION_MAX_PORTS];
+    long                started[NETBIOS_SESSION_MAX_PORTS];
+    struct timespec     start;
+    unsigned            next = 0, pending, timeouts = 0, i;
+    long                now, left, wait;
+    int                 winner = -1, res, err;
+    socklen_t           len;
+    bool                done, expired;
+    
+    assert(nb_ports > 0 && nb_ports <= NETBIOS_SESSION_MAX_PORTS);
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (winner < 0) {
+        now = netbios_session_elapsed(&start);
+        pending = 0;
+        for (i = 0; i < next; ++i) {
+            pending += pfd[i].fd >= 0;
+        }
+        
+        // Start the next port when its turn comes, or when nothing is left
+        if (next < nb_ports
+            && (pending == 0 || now >= started[next - 1] + NETBIOS_CONNECT_STAGGER)) {
+            memset(&addr[next], 0, sizeof(addr[next]));
+            addr[next].sin_family       = AF_INET;
+            addr[next].sin_port         = ports[next];
+            addr[next].sin_addr.s_addr  = ip;
+            started[next]       = now;
+            pfd[next].fd        = netbios_session_connect_start(&addr[next], &done);
+            pfd[next].events    = POLLOUT;
+            pfd[next].revents   = 0;
+            if (pfd[next].fd >= 0 && done) {
+                winner = next;
+            }
+            next++;
+            continue;
+        }
+        if (pending == 0) {
+            break;
+        }
+        
+        // Give up the ports past their deadline, poll the others until the
+        // nearest deadline or the start of the next port
+        wait    = -1;
+        expired = false;
+        for (i = 0; i < next; ++i) {
+            if (pfd[i].fd < 0 || s->connect_timeout == 0) {
+                continue;
+            }
+            left = started[i] + s->connect_timeout - now;
+            if (left <= 0) {
+                closesocket(pfd[i].fd);
+                pfd[i].fd = -1;
+                timeouts++;
+                expired = true;
+            } else if (wait < 0 || left < wait) {
+                wait = left;
+            }
+        }
+        if (expired) {
+            continue;
+        }
+        if (next < nb_ports) {
+            left = started[next - 1] + NETBIOS_CONNECT_STAGGER - now;
+            if (wait < 0 || left < wait) {
+                wait = left;
+            }
+        }
+        
+        res = poll(pfd, next, (int)wait);
+        if (res < 0 && errno != EINTR) {
+            break;
+        }
+        for (i = 0; i < next && res > 0 && winner < 0; ++i) {
+            if (pfd[i].fd < 0 || pfd[i].revents == 0) {
+                continue;
+            }
+            err = 0;
+            len = sizeof(err);
+            if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0
+                && err == 0) {
+                winner = i;
+            } else {
+                closesocket(pfd[i].fd);
+                pfd[i].fd = -1;
+            }
+        }
+    }
+    
+    for (i = 0; i < next; ++i) {
+        if (pfd[i].fd >= 0 && (int)i != winner) {
+            closesocket(pfd[i].fd);
+        }
+    }
+    if (winner < 0) {
+        // A deadline only if no port gave any answer
+        s->timed_out = timeouts == nb_ports;
+        return -1;
+    }
+    
+    s->socket       = pfd[winner].fd;
+    s->remote_addr  = addr[winner];
+    return winner;
 }
 
 #pragma mark - netbiosSessionConnect
 int netbios_session_connect(uint32_t ip, netbios_session *s, const char *name, int direct_tcp) {
     ssize_t recv_size;
     char *encoded_name = NULL;
-    uint16_t ports[2];
-    unsigned int nb_ports;
-    bool opened = false;
+    uint16_t ports[NETBIOS_SESSION_MAX_PORTS];
     
     assert(s != NULL && s->packet != NULL);
     
-    if (direct_tcp) {
-        ports[0] = htons(NETBIOS_PORT_DIRECT);
-        ports[1] = htons(NETBIOS_PORT_DIRECT_SECONDARY);
-        nb_ports = 2;
-    } else {
-        ports[0] = htons(NETBIOS_PORT_SESSION);
-        nb_ports = 1;
-    }
-    
-    for (unsigned int i = 0; i < nb_ports && !opened; ++i) {
-        s->remote_addr.sin_port         = ports[i];
-        s->remote_addr.sin_family       = AF_INET;
-        s->remote_addr.sin_addr.s_addr  = ip;
-        opened = open_socket_and_connect(s) == DSM_SUCCESS;
-    }
-    
-    if (!opened) {
-        goto error;
+    // DirectTCP first, port 139 raced shortly after it. Over 139, NBT needs a
+    // NetBIOS session, DirectTCP speaks SMB on it as on 445.
+    ports[0] = htons(NETBIOS_PORT_DIRECT);
+    ports[1] = htons(direct_tcp ? NETBIOS_PORT_DIRECT_SECONDARY : NETBIOS_PORT_SESSION);
+    
+    s->timed_out  = false;
+    s->rbuf_start = 0;
+    s->rbuf_end   = 0;
+    switch (netbios_session_race(s, ip, ports, NETBIOS_SESSION_MAX_PORTS)) {
+        case 0:
+            s->direct_tcp = true;
+            break;
+        case 1:
+            s->direct_tcp = direct_tcp;
+            break;
+        default:
+            goto error;
     }
     
-    if (!direct_tcp) {
+    if (!s->direct_tcp) {
         // Send the Session Request message
         netbios_session_packet_init(s);
         s->packet->opcode = NETBIOS_OP_SESSION_REQ;
@@ -152,6 +330,53 @@ error:
     return 0;
 }
 
+#pragma mark - netbiosSessionSetTimeouts
+void netbios_session_set_timeouts(netbios_session *s, unsigned connect_ms,
+                                  unsigned send_ms, unsigned recv_ms) {
+    assert(s != NULL);
+    
+    s->connect_timeout = connect_ms;
+    s->send_timeout    = send_ms;
+    s->recv_timeout    = recv_ms;
+}
+
+#pragma mark - netbiosSessionTimedOut
+int netbios_session_timed_out(netbios_session *s) {
+    assert(s != NULL);
+    
+    return s->timed_out;
+}
+
+#pragma mark - netbiosSessionUseUring
+int netbios_session_use_uring(netbios_session *s) {
+    assert(s != NULL && s->socket >= 0 && s->uring == NULL);
+    
+    s->uring = netbios_uring_new(s->socket, s->rbuf, NETBIOS_SESSION_RBUF_SIZE);
+    
+    return s->uring != NULL;
+}
+
+#pragma mark - netbiosSessionFlush
+int netbios_session_flush(netbios_session *s) {
+    assert(s != NULL);
+    
+    if (s->uring == NULL) {
+        return 1;
+    }
+    if (s->timed_out) {
+        return 0;
+    }
+    
+    return netbios_uring_flush(s->uring, s->send_timeout, &s->timed_out);
+}
+
+#pragma mark - netbiosSessionMaxPayload
+size_t netbios_session_max_payload(netbios_session *s) {
+    assert(s != NULL);
+    
+    return s->direct_tcp ? NETBIOS_DIRECT_MAX_PAYLOAD : NETBIOS_SESSION_MAX_PAYLOAD;
+}
+
 #pragma mark - netbiosSessionPacketInit
 void netbios_session_packet_init(netbios_session *s) {
     assert(s != NULL);
@@ -180,23 +405,112 @@ int netbios_session_packet_append(netbios_session *s, const char *data, size_t s
     return 1;
 }
 
+// sendmsg() the whole iovec, even if the kernel only takes part of it at once.
+// 'iov' is modified.
+static int netbios_session_send_all(netbios_session *s, struct iovec *iov, int iovcnt) {
+    struct msghdr msg;
+    struct timespec start;
+    ssize_t sent;
+    
+    if (s->timed_out) {
+        return 0;
+    }
+    
+    if (s->uring != NULL) {
+        return netbios_uring_send(s->uring, iov, iovcnt, s->send_timeout,
+                                  &s->timed_out);
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (iovcnt > 0) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        
+        sent = sendmsg(s->socket, &msg, 0);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        // The socket buffer is full, wait for room until the deadline
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (netbios_session_wait(s, POLLOUT, s->send_timeout, &start) <= 0) {
+                return 0;
+            }
+            continue;
+        }
+        if (sent <= 0) {
+            //bdsm_perror("netbios_session_packet_send: Unable to send (full?) packet");
+            return 0;
+        }
+        
+        // Skip what has been sent
+        while (iovcnt > 0 && (size_t)sent >= iov->iov_len) {
+            sent -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    
+    return 1;
+}
+
 #pragma mark - netbiosSessionPacketSend
 int netbios_session_packet_send(netbios_session *s) {
+    struct iovec iov;
     ssize_t to_send;
-    ssize_t sent;
     
     assert(s && s->packet && s->socket >= 0 && s->state > 0);
     
-    s->packet->length = htons(s->packet_cursor);
+    if (s->packet_cursor > netbios_session_max_payload(s)) {
+        return 0;
+    }
+    
+    s->packet->length = htons(s->packet_cursor & 0xffff);
+    s->packet->flags  = (s->packet_cursor >> 16) & 0xff;
     to_send = sizeof(netbios_session_packet) + s->packet_cursor;
-    sent = send(s->socket, (void *)s->packet, to_send, 0);
     
-    if (sent != to_send) {
-        //bdsm_perror("netbios_session_packet_send: Unable to send (full?) packet");
+    iov.iov_base = s->packet;
+    iov.iov_len  = to_send;
+    if (!netbios_session_send_all(s, &iov, 1)) {
         return 0;
     }
     
-    return sent;
+    return to_send;
+}
+
+#pragma mark - netbiosSessionPacketSendv
+int netbios_session_packet_sendv(netbios_session *s, const struct iovec *iov,
+                                 int iovcnt) {
+    netbios_session_packet header;
+    struct iovec vec[NETBIOS_SESSION_MAX_IOV + 1];
+    size_t size = 0;
+    
+    assert(s && s->socket >= 0 && s->state > 0);
+    assert(iovcnt >= 0 && iovcnt <= NETBIOS_SESSION_MAX_IOV);
+    
+    for (int i = 0; i < iovcnt; i++) {
+        size += iov[i].iov_len;
+        vec[i + 1] = iov[i];
+    }
+    if (size > netbios_session_max_payload(s)) {
+        return 0;
+    }
+    
+    header.opcode = NETBIOS_OP_SESSION_MSG;
+    header.flags  = (size >> 16) & 0xff;
+    header.length = htons(size & 0xffff);
+    vec[0].iov_base = &header;
+    vec[0].iov_len  = sizeof(header);
+    
+    if (!netbios_session_send_all(s, vec, iovcnt + 1)) {
+        return 0;
+    }
+    
+    return (int)(sizeof(header) + size);
 }
 
 static int session_buffer_realloc(netbios_session *s, size_t new_size) {
@@ -204,7 +518,7 @@ static int session_buffer_realloc(netbios_session *s, size_t new_size) {
     
     assert(s != NULL);
     
-    new_ptr  = realloc(s->packet, new_size);
+    new_ptr  = realloc(s->packet, sizeof(netbios_session_packet) + new_size);
     if (new_ptr != NULL) {
         s->packet_payload_size = new_size;
         s->packet = new_ptr;
@@ -216,58 +530,161 @@ static int session_buffer_realloc(netbios_session *s, size_t new_size) {
     return 0;
 }
 
-static ssize_t netbios_session_get_next_packet(netbios_session *s) {
+// Receives exactly 'size' bytes, from what is buffered first. The socket is
+// read with the rest of 'dst' then the (empty) buffer as destinations: a large
+// payload goes straight to 'dst', and each recvmsg() also brings what follows
+// it, so small frames and keepalives seldom cost a syscall of their own.
+static int netbios_session_recv_all(netbios_session *s, void *dst, size_t size) {
+    struct timespec start;
+    struct msghdr msg;
+    struct iovec iov[2];
     ssize_t res;
-    size_t total;
     size_t sofar;
+    long left = 0;
+    bool small;
     
-    assert(s != NULL && s->packet != NULL && s->socket >= 0 && s->state > 0);
+    if (s->timed_out) {
+        return 0;
+    }
     
-    // Only get packet header and analyze it to get only needed number of bytes
-    // needed for the packet. This will prevent losing a part of next packet
-    total = sizeof(netbios_session_packet);
-    sofar = 0;
-    while (sofar < total) {
-        res = recv(s->socket, (uint8_t *)(s->packet) + sofar, total - sofar, 0);
-        if (res <= 0) {
-            //bdsm_perror("netbios_session_packet_recv: ");
-            return -1;
+    sofar = s->rbuf_end - s->rbuf_start;
+    sofar = sofar < size ? sofar : size;
+    memcpy(dst, s->rbuf + s->rbuf_start, sofar);
+    s->rbuf_start += sofar;
+    if (sofar == size) {
+        return 1;
+    }
+    s->rbuf_start = 0;
+    s->rbuf_end   = 0;
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (sofar < size) {
+        if (s->uring != NULL) {
+            if (s->recv_timeout > 0
+                && (left = s->recv_timeout - netbios_session_elapsed(&start)) <= 0) {
+                s->timed_out = true;
+                return 0;
+            }
+            
+            // A small read is done in the registered buffer, then copied
+            small = size - sofar < NETBIOS_SESSION_URING_DIRECT;
+            res = netbios_uring_recv(s->uring, small ? NULL : (uint8_t *)dst + sofar,
+                                     size - sofar, (unsigned)left, &s->timed_out);
+            if (res <= 0) {
+                return 0;
+            }
+            if (small) {
+                s->rbuf_end   = res;
+                s->rbuf_start = (size_t)res < size - sofar ? (size_t)res : size - sofar;
+                memcpy((uint8_t *)dst + sofar, s->rbuf, s->rbuf_start);
+                sofar += s->rbuf_start;
+                continue;
+            }
+        } else {
+            iov[0].iov_base = (uint8_t *)dst + sofar;
+            iov[0].iov_len  = size - sofar;
+            iov[1].iov_base = s->rbuf;
+            iov[1].iov_len  = NETBIOS_SESSION_RBUF_SIZE;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = 2;
+            
+            res = recvmsg(s->socket, &msg, 0);
+            if (res < 0 && errno == EINTR) {
+                continue;
+            }
+            // Nothing yet, wait for data until the deadline
+            if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (netbios_session_wait(s, POLLIN, s->recv_timeout, &start) <= 0) {
+                    return 0;
+                }
+                continue;
+            }
+            if (res <= 0) {
+                //bdsm_perror("netbios_session_packet_recv: ");
+                return 0;
+            }
+        }
+        if ((size_t)res > size - sofar) {
+            s->rbuf_end = res - (size - sofar);
+            res = size - sofar;
         }
         sofar += res;
     }
     
-    total  = ntohs(s->packet->length);
-    total |= (s->packet->flags & 0x01) << 16;
-    sofar  = 0;
+    return 1;
+}
+
+// Throw away what the caller didn't read of the previous packet, so we stay
+// in sync with the stream.
+static int netbios_session_skip_pending(netbios_session *s) {
+    uint8_t trash[512];
+    size_t chunk;
+    
+    chunk = s->rbuf_end - s->rbuf_start;
+    chunk = s->packet_pending < chunk ? s->packet_pending : chunk;
+    s->rbuf_start     += chunk;
+    s->packet_pending -= chunk;
+    
+    while (s->packet_pending > 0) {
+        chunk = s->packet_pending < sizeof(trash) ? s->packet_pending : sizeof(trash);
+        if (!netbios_session_recv_all(s, trash, chunk)) {
+            return 0;
+        }
+        s->packet_pending -= chunk;
+    }
+    
+    return 1;
+}
+
+static ssize_t netbios_session_get_next_packet(netbios_session *s, size_t head_size) {
+    size_t total;
+    size_t head;
     
-    if (total + sizeof(netbios_session_packet) > s->packet_payload_size &&
-        !session_buffer_realloc(s, total + sizeof(netbios_session_packet))) {
+    assert(s != NULL && s->packet != NULL && s->socket >= 0 && s->state > 0);
+    
+    if (!netbios_session_skip_pending(s)) {
         return -1;
     }
     
-    while (sofar < total) {
-        res = recv(s->socket, (uint8_t *)(s->packet) + sizeof(netbios_session_packet)
-                   + sofar, total - sofar, 0);
-        if (res <= 0) {
-            return -1;
-        }
-        sofar += res;
+    // Only get packet header and analyze it to get only needed number of bytes
+    // needed for the packet. This will prevent losing a part of next packet
+    if (!netbios_session_recv_all(s, s->packet, sizeof(netbios_session_packet))) {
+        return -1;
+    }
+    
+    total  = ntohs(s->packet->length);
+    total |= (s->packet->flags & (s->direct_tcp ? 0xff : 0x01)) << 16;
+    head   = total < head_size ? total : head_size;
+    
+    // The buffer only has to hold what we read now, the rest of the packet
+    // is left in the socket for netbios_session_packet_recv_body()
+    if (head > s->packet_payload_size && !session_buffer_realloc(s, head)) {
+        return -1;
     }
     
-    if (sofar > total) {
+    if (!netbios_session_recv_all(s, s->packet->payload, head)) {
         return -1;
     }
+    s->packet_received = head;
+    s->packet_pending  = total - head;
     
-    return sofar;
+    return total;
 }
 
 #pragma mark - netbiosSessionPacketRecv
 ssize_t netbios_session_packet_recv(netbios_session *s, void **data) {
+    return netbios_session_packet_recv_head(s, SIZE_MAX, data);
+}
+
+#pragma mark - netbiosSessionPacketRecvHead
+ssize_t netbios_session_packet_recv_head(netbios_session *s, size_t head_size,
+                                         void **data) {
     ssize_t size;
     
     // ignore keepalive messages if needed
     do {
-        size = netbios_session_get_next_packet(s);
+        size = netbios_session_get_next_packet(s, head_size);
     } while (size >= 0 && s->packet->opcode == NETBIOS_OP_SESSION_KEEPALIVE);
     
     if ((size >= 0) && (data != NULL)) {
@@ -276,4 +693,32 @@ ssize_t netbios_session_packet_recv(netbios_session *s, void **data) {
     
     return size;
 }
+
+#pragma mark - netbiosSessionPacketRecvBody
+ssize_t netbios_session_packet_recv_body(netbios_session *s, void *dst,
+                                         size_t size, void **data) {
+    assert(s != NULL && s->packet != NULL);
+    
+    size = size < s->packet_pending ? size : s->packet_pending;
+    
+    if (dst == NULL) {
+        if (s->packet_received + size > s->packet_payload_size &&
+            !session_buffer_realloc(s, s->packet_received + size)) {
+            return -1;
+        }
+        dst = s->packet->payload + s->packet_received;
+        s->packet_received += size;
+    }
+    
+    if (!netbios_session_recv_all(s, dst, size)) {
+        return -1;
+    }
+    s->packet_pending -= size;
+    
+    if (data != NULL) {
+        *data = (void *) s->packet->payload;
+    }
+    
+    return size;
+}
 @end
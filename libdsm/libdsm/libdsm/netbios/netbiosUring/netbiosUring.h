@@ -0,0 +1,69 @@
+//
+//  netbiosUring.h
+//  test
+//
+//  Created by trekvn on 4/14/17.
+//  Copyright © 2017 trekvn. All rights reserved.
+//
+#ifdef __OBJC__
+#import <Foundation/Foundation.h>
+#import "config.h"
+
+#import <stdbool.h>
+#import <sys/types.h>
+#import <sys/uio.h>
+
+// Size of the buffer the messages to send are gathered in
+#define NETBIOS_URING_SEND_SIZE     (256 * 1024)
+// Messages from this size on are sent from the caller's buffers, not gathered
+#define NETBIOS_URING_SEND_DIRECT   (16 * 1024)
+// Most buffers of a send: the gathered messages and those of a message
+#define NETBIOS_URING_MAX_IOV       (16)
+
+typedef struct netbios_uring_s netbios_uring;
+
+@interface netbiosUring : NSObject
+#pragma mark - netbiosUringNew
+/*!Set up an io_uring to do the I/O of a connected socket
+ * 'rbuf' is registered with the ring, the kernel reads into it without mapping it each time. The small messages to send are gathered in a buffer of #NETBIOS_URING_SEND_SIZE bytes.
+ *\param socket The connected socket
+ *\param rbuf The receive buffer of the session
+ *\param rbuf_size Its size
+ *\returns The ring, or NULL if io_uring is not available (not Linux, or not allowed by the kernel), in which case the socket is used as before
+ */
+netbios_uring *netbios_uring_new(int socket, void *rbuf, size_t rbuf_size);
+
+#pragma mark - netbiosUringDestroy
+/*!Release a ring, without sending what is still gathered
+ */
+void netbios_uring_destroy(netbios_uring *u);
+
+#pragma mark - netbiosUringSend
+/*!Gather a message to be sent
+ * The buffers of a message under #NETBIOS_URING_SEND_DIRECT bytes are copied, the message goes out with the next netbios_uring_recv() or netbios_uring_flush(), in the same io_uring_enter() call as the messages gathered before. Only when the buffer is full is it sent from here.
+ * A larger message is sent from here, without copy: its buffers go to the socket (IORING_OP_SENDMSG) behind the messages gathered before, and the call returns once the socket took them all.
+ *\param timeout Deadline of that sending, in milliseconds (0 for none)
+ *\param timed_out Set if the deadline passed
+ *\returns 1 on success, 0 on error
+ */
+int netbios_uring_send(netbios_uring *u, const struct iovec *iov, int iovcnt,
+                       unsigned timeout, bool *timed_out);
+
+#pragma mark - netbiosUringFlush
+/*!Send the gathered messages now
+ * Needed when no receive follows, which sends them otherwise.
+ *\returns 1 on success, 0 on error
+ */
+int netbios_uring_flush(netbios_uring *u, unsigned timeout, bool *timed_out);
+
+#pragma mark - netbiosUringRecv
+/*!Send the gathered messages and receive what the socket has
+ * If 'dst' is NULL, the data is read into the registered receive buffer (up to its size), otherwise up to 'size' bytes go into 'dst' and the rest of what is available into the receive buffer.
+ *\param timeout Deadline of the whole operation, in milliseconds (0 for none)
+ *\param timed_out Set if the deadline passed
+ *\returns The total number of bytes received, 0 on error or at the end of the stream
+ */
+ssize_t netbios_uring_recv(netbios_uring *u, void *dst, size_t size,
+                           unsigned timeout, bool *timed_out);
+@end
+#endif
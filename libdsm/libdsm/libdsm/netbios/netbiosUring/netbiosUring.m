@@ -0,0 +1,493 @@
+//
+//  netbiosUring.m
+//  test
+//
+//  Created by trekvn on 4/14/17.
+//  Copyright © 2017 trekvn. All rights reserved.
+//
+
+#import "netbiosUring.h"
+
+#import <assert.h>
+#import <errno.h>
+#import <stdint.h>
+#import <stdlib.h>
+#import <string.h>
+
+#if defined(__linux__) && defined(HAVE_LINUX_IO_URING_H)
+#   import <fcntl.h>
+#   import <linux/io_uring.h>
+#   import <signal.h>
+#   import <sys/mman.h>
+#   import <sys/socket.h>
+#   import <sys/syscall.h>
+#   import <time.h>
+#   import <unistd.h>
+
+// No more than a send and a receive are queued at once
+#define NETBIOS_URING_ENTRIES       4
+
+// What a completion is about
+#define NETBIOS_URING_OP_SEND       1
+#define NETBIOS_URING_OP_RECV       2
+
+// Index of the registered receive buffer
+#define NETBIOS_URING_BUF_RECV      0
+
+struct netbios_uring_s {
+    int                 fd;             // The ring
+    int                 socket;
+    // Both queues, shared with the kernel
+    void                *map;
+    size_t              map_size;
+    unsigned            *sq_head;
+    unsigned            *sq_tail;
+    unsigned            *sq_mask;
+    unsigned            *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t              sqes_size;
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned            *cq_mask;
+    struct io_uring_cqe *cqes;
+    // Operations queued or submitted, whose completion isn't reaped yet
+    unsigned            queued;
+    unsigned            inflight;
+    // The registered receive buffer, and the one messages are gathered in
+    uint8_t             *rbuf;
+    size_t              rbuf_size;
+    uint8_t             *sbuf;
+    size_t              staged;         // Bytes of 'sbuf' to be sent
+    // The send in progress: the gathered messages, then the buffers of a
+    // large message sent in place. Advanced as the socket takes them.
+    struct msghdr       smsg;
+    struct iovec        siov[NETBIOS_URING_MAX_IOV];
+};
+
+// Milliseconds since 'start'
+static long netbios_uring_elapsed(const struct timespec *start) {
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000
+           + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static struct io_uring_sqe *netbios_uring_sqe(netbios_uring *u, uint8_t opcode,
+                                              uint64_t op) {
+    struct io_uring_sqe *sqe;
+    unsigned            tail, index;
+    
+    assert(u->inflight < NETBIOS_URING_ENTRIES);
+    
+    tail  = *u->sq_tail;
+    index = tail & *u->sq_mask;
+    sqe   = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode     = opcode;
+    sqe->fd         = u->socket;
+    sqe->user_data  = op;
+    u->sq_array[index] = index;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    
+    u->queued++;
+    u->inflight++;
+    return sqe;
+}
+
+// Sends what is left of u->smsg. Not a write, which raises SIGPIPE when the
+// connection is gone.
+static void netbios_uring_queue_send(netbios_uring *u) {
+    struct io_uring_sqe *sqe;
+    
+    sqe = netbios_uring_sqe(u, IORING_OP_SENDMSG, NETBIOS_URING_OP_SEND);
+    sqe->addr       = (uintptr_t)&u->smsg;
+    sqe->len        = 1;
+    sqe->msg_flags  = MSG_NOSIGNAL;
+}
+
+// Skips the 'sent' bytes the socket took, returns whether some are left
+static bool netbios_uring_sent(netbios_uring *u, size_t sent) {
+    struct iovec    *iov = u->smsg.msg_iov;
+    
+    while (u->smsg.msg_iovlen > 0 && sent >= iov->iov_len) {
+        sent -= iov->iov_len;
+        iov++;
+        u->smsg.msg_iovlen--;
+    }
+    if (u->smsg.msg_iovlen > 0) {
+        iov->iov_base = (uint8_t *)iov->iov_base + sent;
+        iov->iov_len -= sent;
+    }
+    u->smsg.msg_iov = iov;
+    
+    return u->smsg.msg_iovlen > 0;
+}
+
+// Submits what is queued and waits for a completion, for 'timeout' ms at most
+// (for ever if 0). Returns 0, or -1 with errno set (ETIME once it expired).
+static int netbios_uring_enter(netbios_uring *u, long timeout) {
+    struct io_uring_getevents_arg   arg;
+    struct __kernel_timespec        ts;
+    long                            res;
+    
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    if (timeout > 0) {
+        ts.tv_sec   = timeout / 1000;
+        ts.tv_nsec  = (timeout % 1000) * 1000000;
+        arg.ts      = (uintptr_t)&ts;
+    }
+    
+    res = syscall(__NR_io_uring_enter, u->fd, u->queued, 1,
+                  IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                  &arg, sizeof(arg));
+    if (res < 0) {
+        return -1;
+    }
+    u->queued -= (unsigned)res;
+    
+    return 0;
+}
+
+// Takes the next completion, returns 0 if there is none
+static int netbios_uring_reap(netbios_uring *u, uint64_t *op, int *res) {
+    struct io_uring_cqe *cqe;
+    unsigned            head;
+    
+    head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    
+    cqe  = &u->cqes[head & *u->cq_mask];
+    *op  = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+    u->inflight--;
+    
+    return 1;
+}
+
+// Sends the gathered messages, then the 'iovcnt' buffers of 'iov' (at most
+// NETBIOS_URING_MAX_IOV - 1) and, with 'recv', receives into 'msg' (into the
+// registered receive buffer if NULL), all in one io_uring_enter() unless the
+// socket takes a part of the messages only. Returns the number of bytes
+// received (0 without 'recv'), or -1 on error.
+static ssize_t netbios_uring_run(netbios_uring *u, const struct iovec *iov,
+                                 int iovcnt, struct msghdr *msg, bool recv,
+                                 unsigned timeout, bool *timed_out) {
+    struct io_uring_sqe *sqe;
+    struct timespec     start;
+    ssize_t             received = 0;
+    bool                sending, failed = false;
+    uint64_t            op;
+    long                left = 0;
+    int                 res, count = 0;
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    if (u->staged > 0) {
+        u->siov[count].iov_base = u->sbuf;
+        u->siov[count].iov_len  = u->staged;
+        count++;
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        u->siov[count++] = iov[i];
+    }
+    memset(&u->smsg, 0, sizeof(u->smsg));
+    u->smsg.msg_iov    = u->siov;
+    u->smsg.msg_iovlen = count;
+    
+    sending = count > 0;
+    if (sending) {
+        netbios_uring_queue_send(u);
+    }
+    if (recv && msg == NULL) {
+        sqe = netbios_uring_sqe(u, IORING_OP_READ_FIXED, NETBIOS_URING_OP_RECV);
+        sqe->addr       = (uintptr_t)u->rbuf;
+        sqe->len        = (unsigned)u->rbuf_size;
+        sqe->buf_index  = NETBIOS_URING_BUF_RECV;
+    } else if (recv) {
+        sqe = netbios_uring_sqe(u, IORING_OP_RECVMSG, NETBIOS_URING_OP_RECV);
+        sqe->addr       = (uintptr_t)msg;
+        sqe->len        = 1;
+        sqe->msg_flags  = MSG_NOSIGNAL;
+    }
+    
+    while ((sending || recv) && !failed) {
+        if (timeout > 0) {
+            left = timeout - netbios_uring_elapsed(&start);
+            if (left <= 0) {
+                *timed_out = true;
+                failed = true;
+                break;
+            }
+        }
+        
+        if (netbios_uring_enter(u, left) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            *timed_out = errno == ETIME;
+            failed = true;
+        }
+        
+        while (netbios_uring_reap(u, &op, &res)) {
+            if (op == NETBIOS_URING_OP_SEND && res > 0 && netbios_uring_sent(u, res)) {
+                // The socket took a part only, the rest goes with the next call
+                netbios_uring_queue_send(u);
+            } else if (op == NETBIOS_URING_OP_SEND) {
+                sending = false;
+                failed |= res <= 0;
+            } else {
+                recv = false;
+                received = res;
+                failed |= res <= 0;
+            }
+        }
+    }
+    
+    if (failed) {
+        // The stream is out of sync. What is still in flight is stopped, and
+        // waited for since it uses the buffers.
+        shutdown(u->socket, SHUT_RDWR);
+        while (u->inflight > 0) {
+            if (netbios_uring_enter(u, 0) < 0 && errno != EINTR) {
+                break;
+            }
+            while (netbios_uring_reap(u, &op, &res))
+                ;
+        }
+        u->staged = 0;
+        return -1;
+    }
+    
+    u->staged = 0;
+    return received;
+}
+#endif
+
+@implementation netbiosUring
+#if defined(__linux__) && defined(HAVE_LINUX_IO_URING_H)
+#pragma mark - netbiosUringNew
+netbios_uring *netbios_uring_new(int socket, void *rbuf, size_t rbuf_size) {
+    struct io_uring_params  p;
+    struct iovec            buf;
+    netbios_uring           *u;
+    uint8_t                 *map;
+    int                     flags;
+    
+    assert(socket >= 0 && rbuf != NULL);
+    
+    u = (netbios_uring *)calloc(1, sizeof(netbios_uring));
+    if (!u) {
+        return NULL;
+    }
+    u->fd        = -1;
+    u->socket    = socket;
+    u->map       = MAP_FAILED;
+    u->sqes      = MAP_FAILED;
+    u->rbuf      = rbuf;
+    u->rbuf_size = rbuf_size;
+    if ((u->sbuf = (uint8_t *)malloc(NETBIOS_URING_SEND_SIZE)) == NULL) {
+        goto error;
+    }
+    
+    // The deadlines are given to io_uring_enter() (5.11 and later, which also
+    // map both queues at once)
+    memset(&p, 0, sizeof(p));
+    u->fd = (int)syscall(__NR_io_uring_setup, NETBIOS_URING_ENTRIES, &p);
+    if (u->fd < 0 || !(p.features & IORING_FEAT_EXT_ARG)
+        || !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        goto error;
+    }
+    
+    u->map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    if (u->map_size < p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe)) {
+        u->map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    }
+    u->map = mmap(NULL, u->map_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->map == MAP_FAILED || u->sqes == MAP_FAILED) {
+        goto error;
+    }
+    map = u->map;
+    u->sq_head  = (unsigned *)(map + p.sq_off.head);
+    u->sq_tail  = (unsigned *)(map + p.sq_off.tail);
+    u->sq_mask  = (unsigned *)(map + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(map + p.sq_off.array);
+    u->cq_head  = (unsigned *)(map + p.cq_off.head);
+    u->cq_tail  = (unsigned *)(map + p.cq_off.tail);
+    u->cq_mask  = (unsigned *)(map + p.cq_off.ring_mask);
+    u->cqes     = (struct io_uring_cqe *)(map + p.cq_off.cqes);
+    
+    buf.iov_base = rbuf;
+    buf.iov_len  = rbuf_size;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS, &buf, 1) < 0) {
+        goto error;
+    }
+    
+    // The ring does the waiting, a nonblocking socket would fail its
+    // operations with EAGAIN instead
+    if ((flags = fcntl(socket, F_GETFL, 0)) < 0
+        || fcntl(socket, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+        goto error;
+    }
+    
+    return u;
+
+error:
+    netbios_uring_destroy(u);
+    return NULL;
+}
+
+#pragma mark - netbiosUringDestroy
+void netbios_uring_destroy(netbios_uring *u) {
+    if (!u) {
+        return;
+    }
+    
+    if (u->sqes != MAP_FAILED) {
+        munmap(u->sqes, u->sqes_size);
+    }
+    if (u->map != MAP_FAILED) {
+        munmap(u->map, u->map_size);
+    }
+    if (u->fd >= 0) {
+        close(u->fd);
+    }
+    free(u->sbuf);
+    free(u);
+}
+
+#pragma mark - netbiosUringSend
+int netbios_uring_send(netbios_uring *u, const struct iovec *iov, int iovcnt,
+                       unsigned timeout, bool *timed_out) {
+    struct timespec start;
+    const uint8_t   *src;
+    size_t          len, chunk, size = 0;
+    long            left = 0;
+    
+    assert(u != NULL && timed_out != NULL);
+    
+    // A large message (WRITE_ANDX data) is sent at once from the caller's
+    // buffers, behind what is gathered, instead of being copied
+    for (int i = 0; i < iovcnt; i++) {
+        size += iov[i].iov_len;
+    }
+    if (size >= NETBIOS_URING_SEND_DIRECT && iovcnt < NETBIOS_URING_MAX_IOV) {
+        return netbios_uring_run(u, iov, iovcnt, NULL, false, timeout, timed_out) >= 0;
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < iovcnt; i++) {
+        src = (const uint8_t *)iov[i].iov_base;
+        len = iov[i].iov_len;
+        while (len > 0) {
+            // Full, send it to make room
+            if (u->staged == NETBIOS_URING_SEND_SIZE) {
+                if (timeout > 0 && (left = timeout - netbios_uring_elapsed(&start)) <= 0) {
+                    *timed_out = true;
+                    return 0;
+                }
+                if (netbios_uring_run(u, NULL, 0, NULL, false, (unsigned)left, timed_out) < 0) {
+                    return 0;
+                }
+            }
+            chunk = NETBIOS_URING_SEND_SIZE - u->staged;
+            chunk = chunk < len ? chunk : len;
+            memcpy(u->sbuf + u->staged, src, chunk);
+            u->staged += chunk;
+            src += chunk;
+            len -= chunk;
+        }
+    }
+    
+    return 1;
+}
+
+#pragma mark - netbiosUringFlush
+int netbios_uring_flush(netbios_uring *u, unsigned timeout, bool *timed_out) {
+    assert(u != NULL && timed_out != NULL);
+    
+    if (u->staged == 0) {
+        return 1;
+    }
+    
+    return netbios_uring_run(u, NULL, 0, NULL, false, timeout, timed_out) >= 0;
+}
+
+#pragma mark - netbiosUringRecv
+ssize_t netbios_uring_recv(netbios_uring *u, void *dst, size_t size,
+                           unsigned timeout, bool *timed_out) {
+    struct msghdr   msg;
+    struct iovec    iov[2];
+    ssize_t         res;
+    
+    assert(u != NULL && timed_out != NULL);
+    
+    if (dst == NULL) {
+        res = netbios_uring_run(u, NULL, 0, NULL, true, timeout, timed_out);
+    } else {
+        // A large read goes straight to 'dst', what follows it to the buffer
+        iov[0].iov_base = dst;
+        iov[0].iov_len  = size;
+        iov[1].iov_base = u->rbuf;
+        iov[1].iov_len  = u->rbuf_size;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov     = iov;
+        msg.msg_iovlen  = 2;
+        res = netbios_uring_run(u, NULL, 0, &msg, true, timeout, timed_out);
+    }
+    
+    return res > 0 ? res : 0;
+}
+#else
+#pragma mark - netbiosUringNew
+netbios_uring *netbios_uring_new(int socket, void *rbuf, size_t rbuf_size) {
+    (void)socket;
+    (void)rbuf;
+    (void)rbuf_size;
+    return NULL;
+}
+
+#pragma mark - netbiosUringDestroy
+void netbios_uring_destroy(netbios_uring *u) {
+    (void)u;
+}
+
+#pragma mark - netbiosUringSend
+int netbios_uring_send(netbios_uring *u, const struct iovec *iov, int iovcnt,
+                       unsigned timeout, bool *timed_out) {
+    (void)u;
+    (void)iov;
+    (void)iovcnt;
+    (void)timeout;
+    (void)timed_out;
+    return 0;
+}
+
+#pragma mark - netbiosUringFlush
+int netbios_uring_flush(netbios_uring *u, unsigned timeout, bool *timed_out) {
+    (void)u;
+    (void)timeout;
+    (void)timed_out;
+    return 0;
+}
+
+#pragma mark - netbiosUringRecv
+ssize_t netbios_uring_recv(netbios_uring *u, void *dst, size_t size,
+                           unsigned timeout, bool *timed_out) {
+    (void)u;
+    (void)dst;
+    (void)size;
+    (void)timeout;
+    (void)timed_out;
+    return 0;
+}
+#endif
+@end
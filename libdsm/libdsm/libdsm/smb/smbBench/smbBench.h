@@ -0,0 +1,65 @@
+//
+//  smbBench.h
+//  test
+//
+//  Created by trekvn on 4/14/17.
+//  Copyright © 2017 trekvn. All rights reserved.
+//
+// Built on the loopback transport, Debug builds only
+#if defined(__OBJC__) && defined(DEBUG)
+#import <Foundation/Foundation.h>
+#import "smbHeader.h"
+
+#import <stdio.h>
+
+@interface smbBench : NSObject
+
+#pragma mark - smbBenchOptsInit
+/*!Fill an smb_bench_opts with the defaults
+ * A file of #SMB_BENCH_FILE_SIZE bytes moved #SMB_BENCH_IO_SIZE bytes at a time, #SMB_BENCH_COUNT smb_find() of #SMB_BENCH_FIND_ENTRIES files and as many smb_fstat().
+ *\param opts The options to initialize
+ */
+void smb_bench_opts_init(smb_bench_opts *opts);
+
+#pragma mark - smbBenchRun
+/*!Measure the library alone, through the in-process transport
+ * A session is connected with smb_session_connect_loopback() to 'root', then smb_fwrite() writes a file, smb_fread() reads it back, smb_find() lists a directory of opts->find_entries files and smb_fstat() queries the file, each call timed. Only the library and the local file system are measured, no network nor server.
+ * The file and the directory are created in 'root' through the session, and removed at the end.
+ *\param root A local directory, the server shares it
+ *\param opts The options, or NULL for the defaults (see smb_bench_opts_init())
+ *\param res The measures
+ *\returns 0 on success or a DSM error code in case of error
+ */
+int smb_bench_run(const char *root, const smb_bench_opts *opts,
+                  smb_bench_results *res);
+
+#pragma mark - smbBenchRunRemote
+/*!Same as smb_bench_run(), against a server through the transport of target->transport
+ * The measures include the network and the server. To compare the transports, run it once with SMB_TRANSPORT_TCP then once with SMB_TRANSPORT_URING, on the same target.
+ * The file and the directory are created at the root of target->share, and removed at the end.
+ *\param target The server, credentials, share and transport
+ *\param opts The options, or NULL for the defaults (see smb_bench_opts_init())
+ *\param res The measures
+ *\returns 0 on success or a DSM error code in case of error
+ */
+int smb_bench_run_remote(const smb_stripe_target *target,
+                         const smb_bench_opts *opts, smb_bench_results *res);
+
+#pragma mark - smbBenchOpsPerSec
+/*!Calls per second of a measure, 0 if it is empty
+ */
+double smb_bench_ops_per_sec(const smb_bench_result *r);
+
+#pragma mark - smbBenchMbPerSec
+/*!Megabytes (10^6 bytes) per second of a measure, 0 if it is empty
+ */
+double smb_bench_mb_per_sec(const smb_bench_result *r);
+
+#pragma mark - smbBenchPrint
+/*!Write the measures of smb_bench_run() as a table, one operation per line
+ *\param res The measures
+ *\param out Where to write them, stdout for example
+ */
+void smb_bench_print(const smb_bench_results *res, FILE *out);
+@end
+#endif
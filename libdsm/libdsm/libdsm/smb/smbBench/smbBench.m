@@ -0,0 +1,301 @@
+//
+//  smbBench.m
+//  test
+//
+//  Created by trekvn on 4/14/17.
+//  Copyright © 2017 trekvn. All rights reserved.
+//
+
+#import <time.h>
+
+#import "smbBench.h"
+
+#ifdef DEBUG
+
+// What is created in the share
+#define SMB_BENCH_FILE          "bench.bin"
+#define SMB_BENCH_DIR           "bench.dir"
+#define SMB_BENCH_ENTRY_FMT     "\\" SMB_BENCH_DIR "\\file%06u"
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The files smb_find() lists, created through the session so that any
+// server can be measured. The directory may be left from a previous run.
+static int bench_setup_find(smb_session *s, smb_tid tid, unsigned entries)
+{
+    char        name[64];
+    smb_fd      fd;
+    int         ret;
+    
+    smb_directory_create(s, tid, "\\" SMB_BENCH_DIR);
+    
+    for (unsigned i = 0; i < entries; i++)
+    {
+        snprintf(name, sizeof(name), SMB_BENCH_ENTRY_FMT, i);
+        if ((ret = smb_fopen(s, tid, name, SMB_MOD_RW, &fd)) != DSM_SUCCESS)
+            return ret;
+        smb_fclose(s, fd);
+    }
+    
+    return DSM_SUCCESS;
+}
+
+static void bench_cleanup(smb_session *s, smb_tid tid, unsigned entries)
+{
+    char        name[64];
+    
+    for (unsigned i = 0; i < entries; i++)
+    {
+        snprintf(name, sizeof(name), SMB_BENCH_ENTRY_FMT, i);
+        smb_file_rm(s, tid, name);
+    }
+    smb_directory_rm(s, tid, "\\" SMB_BENCH_DIR);
+    smb_file_rm(s, tid, "\\" SMB_BENCH_FILE);
+}
+
+static int bench_fwrite(smb_session *s, smb_tid tid, const smb_bench_opts *opts,
+                        uint8_t *buf, smb_bench_result *r)
+{
+    smb_fd      fd;
+    size_t      size;
+    ssize_t     res;
+    double      start;
+    int         ret;
+    
+    start = bench_now();
+    if ((ret = smb_fopen(s, tid, "\\" SMB_BENCH_FILE, SMB_MOD_RW, &fd)) != DSM_SUCCESS)
+        return ret;
+    
+    while (r->bytes < opts->file_size)
+    {
+        size = opts->io_size;
+        if (size > opts->file_size - r->bytes)
+            size = (size_t)(opts->file_size - r->bytes);
+        
+        if ((res = smb_fwrite(s, fd, buf, size)) <= 0)
+        {
+            smb_fclose(s, fd);
+            return DSM_ERROR_GENERIC;
+        }
+        r->ops++;
+        r->bytes += res;
+    }
+    
+    // What the file may still keep is part of the writing
+    smb_fclose(s, fd);
+    r->seconds = bench_now() - start;
+    
+    return DSM_SUCCESS;
+}
+
+static int bench_fread(smb_session *s, smb_tid tid, const smb_bench_opts *opts,
+                       uint8_t *buf, smb_bench_result *r)
+{
+    smb_fd      fd;
+    ssize_t     res;
+    double      start;
+    int         ret;
+    
+    start = bench_now();
+    if ((ret = smb_fopen(s, tid, "\\" SMB_BENCH_FILE, SMB_MOD_RO, &fd)) != DSM_SUCCESS)
+        return ret;
+    
+    while ((res = smb_fread(s, fd, buf, opts->io_size)) > 0)
+    {
+        r->ops++;
+        r->bytes += res;
+    }
+    
+    smb_fclose(s, fd);
+    r->seconds = bench_now() - start;
+    
+    return res == 0 && r->bytes == opts->file_size ? DSM_SUCCESS : DSM_ERROR_GENERIC;
+}
+
+static int bench_find(smb_session *s, smb_tid tid, const smb_bench_opts *opts,
+                      smb_bench_result *r)
+{
+    smb_stat_list   list;
+    size_t          count;
+    double          start;
+    
+    start = bench_now();
+    for (unsigned i = 0; i < opts->count; i++)
+    {
+        list  = smb_find(s, tid, "\\" SMB_BENCH_DIR "\\*");
+        count = smb_stat_list_count(list);
+        smb_stat_list_destroy(list);
+        
+        // The files, "." and ".."
+        if (count < opts->find_entries)
+            return DSM_ERROR_GENERIC;
+        r->ops++;
+    }
+    r->seconds = bench_now() - start;
+    
+    return DSM_SUCCESS;
+}
+
+static int bench_fstat(smb_session *s, smb_tid tid, const smb_bench_opts *opts,
+                       smb_bench_result *r)
+{
+    smb_stat    st;
+    double      start;
+    
+    start = bench_now();
+    for (unsigned i = 0; i < opts->count; i++)
+    {
+        if ((st = smb_fstat(s, tid, "\\" SMB_BENCH_FILE)) == NULL)
+            return DSM_ERROR_GENERIC;
+        smb_stat_destroy(st);
+        r->ops++;
+    }
+    r->seconds = bench_now() - start;
+    
+    return DSM_SUCCESS;
+}
+
+static void bench_print_result(FILE *out, const char *name,
+                               const smb_bench_result *r)
+{
+    fprintf(out, "%-12s %10llu ops %8.3f s %12.0f ops/s %10.1f MB/s\n", name,
+            (unsigned long long)r->ops, r->seconds, smb_bench_ops_per_sec(r),
+            smb_bench_mb_per_sec(r));
+}
+
+// Logs a connected session in, then measures the operations in 'share'
+static int bench_run(smb_session *s, const char *share,
+                     const smb_bench_opts *opts, smb_bench_results *res)
+{
+    smb_bench_opts  defaults;
+    smb_tid         tid;
+    uint8_t         *buf;
+    int             ret;
+    
+    if (opts == NULL)
+    {
+        smb_bench_opts_init(&defaults);
+        opts = &defaults;
+    }
+    if (opts->io_size == 0)
+        return DSM_ERROR_GENERIC;
+    
+    if ((ret = smb_session_login(s)) != DSM_SUCCESS
+        || (ret = smb_tree_connect(s, share, &tid)) != DSM_SUCCESS)
+        return ret;
+    
+    if ((buf = malloc(opts->io_size)) == NULL)
+        return DSM_ERROR_GENERIC;
+    // Not all zeros, in case something along the way treats them apart
+    for (size_t i = 0; i < opts->io_size; i++)
+        buf[i] = (uint8_t)(i * 31 + 7);
+    
+    if ((ret = bench_setup_find(s, tid, opts->find_entries)) == DSM_SUCCESS
+        && (ret = bench_fwrite(s, tid, opts, buf, &res->fwrite)) == DSM_SUCCESS
+        && (ret = bench_fread(s, tid, opts, buf, &res->fread)) == DSM_SUCCESS
+        && (ret = bench_find(s, tid, opts, &res->find)) == DSM_SUCCESS)
+        ret = bench_fstat(s, tid, opts, &res->fstat);
+    
+    bench_cleanup(s, tid, opts->find_entries);
+    free(buf);
+    
+    return ret;
+}
+
+@implementation smbBench
+
+#pragma mark - smbBenchOptsInit
+void smb_bench_opts_init(smb_bench_opts *opts)
+{
+    assert(opts != NULL);
+    
+    memset(opts, 0, sizeof(*opts));
+    opts->file_size     = SMB_BENCH_FILE_SIZE;
+    opts->io_size       = SMB_BENCH_IO_SIZE;
+    opts->count         = SMB_BENCH_COUNT;
+    opts->find_entries  = SMB_BENCH_FIND_ENTRIES;
+}
+
+#pragma mark - smbBenchRun
+int smb_bench_run(const char *root, const smb_bench_opts *opts,
+                  smb_bench_results *res)
+{
+    smb_session     *s;
+    int             ret;
+    
+    assert(root != NULL && res != NULL);
+    
+    memset(res, 0, sizeof(*res));
+    if ((s = smb_session_new()) == NULL)
+        return DSM_ERROR_GENERIC;
+    
+    if ((ret = smb_session_connect_loopback(s, root)) == DSM_SUCCESS)
+    {
+        smb_session_set_creds(s, SMB_LOOPBACK_NAME, "bench", "bench");
+        ret = bench_run(s, "bench", opts, res);
+    }
+    smb_session_destroy(s);
+    
+    return ret;
+}
+
+#pragma mark - smbBenchRunRemote
+int smb_bench_run_remote(const smb_stripe_target *target,
+                         const smb_bench_opts *opts, smb_bench_results *res)
+{
+    smb_session     *s;
+    int             ret;
+    
+    assert(target != NULL && target->hostname != NULL && target->share != NULL);
+    assert(res != NULL);
+    
+    memset(res, 0, sizeof(*res));
+    if ((s = smb_session_new()) == NULL)
+        return DSM_ERROR_GENERIC;
+    
+    if ((ret = smb_session_connect(s, target->hostname, target->ip,
+                                   target->transport)) == DSM_SUCCESS)
+    {
+        smb_session_set_creds(s, target->domain, target->login, target->password);
+        ret = bench_run(s, target->share, opts, res);
+    }
+    smb_session_destroy(s);
+    
+    return ret;
+}
+
+#pragma mark - smbBenchOpsPerSec
+double smb_bench_ops_per_sec(const smb_bench_result *r)
+{
+    assert(r != NULL);
+    
+    return r->seconds > 0 ? r->ops / r->seconds : 0;
+}
+
+#pragma mark - smbBenchMbPerSec
+double smb_bench_mb_per_sec(const smb_bench_result *r)
+{
+    assert(r != NULL);
+    
+    return r->seconds > 0 ? r->bytes / r->seconds / 1e6 : 0;
+}
+
+#pragma mark - smbBenchPrint
+void smb_bench_print(const smb_bench_results *res, FILE *out)
+{
+    assert(res != NULL && out != NULL);
+    
+    bench_print_result(out, "smb_fwrite", &res->fwrite);
+    bench_print_result(out, "smb_fread", &res->fread);
+    bench_print_result(out, "smb_find", &res->find);
+    bench_print_result(out, "smb_fstat", &res->fstat);
+}
+@end
+#endif
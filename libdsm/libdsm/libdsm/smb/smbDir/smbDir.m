@@ -19,6 +19,7 @@ int smb_directory_rm(smb_session *s, smb_tid tid, const char *path)
     smb_directory_rm_resp *resp;
     size_t                utf_pattern_len;
     char                  *utf_pattern;
+    int                   res = DSM_SUCCESS;
     
     assert(s != NULL && path != NULL);
     
@@ -42,22 +43,25 @@ int smb_directory_rm(smb_session *s, smb_tid tid, const char *path)
     SMB_MSG_PUT_PKT(req_msg, req);
     smb_message_append(req_msg, utf_pattern, utf_pattern_len);
     
+    pthread_mutex_lock(&s->io_lock);
     smb_session_send_msg(s, req_msg);
     smb_message_destroy(req_msg);
     
     free(utf_pattern);
     
     if (!smb_session_recv_msg(s, &resp_msg))
-        return DSM_ERROR_NETWORK;
-    
-    if (!smb_session_check_nt_status(s, &resp_msg))
-        return DSM_ERROR_NT;
-    
-    resp = (smb_directory_rm_resp *)resp_msg.packet->payload;
-    if ((resp->wct != 0) || (resp->bct != 0))
-        return DSM_ERROR_NETWORK;
+        res = smb_session_network_error(s);
+    else if (!smb_session_check_nt_status(s, &resp_msg))
+        res = DSM_ERROR_NT;
+    else
+    {
+        resp = (smb_directory_rm_resp *)resp_msg.packet->payload;
+        if ((resp->wct != 0) || (resp->bct != 0))
+            res = smb_session_network_error(s);
+    }
+    pthread_mutex_unlock(&s->io_lock);
     
-    return 0;
+    return res;
 }
 
 #pragma mark - smbDirectoryCreate
@@ -69,6 +73,7 @@ int smb_directory_create(smb_session *s, smb_tid tid, const char *path)
     smb_directory_mk_resp *resp;
     size_t                utf_pattern_len;
     char                  *utf_pattern;
+    int                   res = DSM_SUCCESS;
     
     assert(s != NULL && path != NULL);
     
@@ -92,22 +97,25 @@ int smb_directory_create(smb_session *s, smb_tid tid, const char *path)
     SMB_MSG_PUT_PKT(req_msg, req);
     smb_message_append(req_msg, utf_pattern, utf_pattern_len);
     
+    pthread_mutex_lock(&s->io_lock);
     smb_session_send_msg(s, req_msg);
     smb_message_destroy(req_msg);
     
     free(utf_pattern);
     
     if (!smb_session_recv_msg(s, &resp_msg))
-        return DSM_ERROR_NETWORK;
-    
-    if (!smb_session_check_nt_status(s, &resp_msg))
-        return DSM_ERROR_NT;
-    
-    resp = (smb_directory_mk_resp *)resp_msg.packet->payload;
-    if ((resp->wct != 0) || (resp->bct != 0))
-        return DSM_ERROR_NETWORK;
+        res = smb_session_network_error(s);
+    else if (!smb_session_check_nt_status(s, &resp_msg))
+        res = DSM_ERROR_NT;
+    else
+    {
+        resp = (smb_directory_mk_resp *)resp_msg.packet->payload;
+        if ((resp->wct != 0) || (resp->bct != 0))
+            res = smb_session_network_error(s);
+    }
+    pthread_mutex_unlock(&s->io_lock);
     
-    return 0;
+    return res;
 }
 
 @end
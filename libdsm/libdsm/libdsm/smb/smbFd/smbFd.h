@@ -30,5 +30,21 @@ smb_file *smb_session_file_get(smb_session *s, smb_fd fd);
 
 #pragma mark - smbSessionFileRemove
 smb_file *smb_session_file_remove(smb_session *s, smb_fd fd);
+
+#pragma mark - smbSessionFileCachePut
+void smb_session_file_cache_put(smb_session *s, smb_file *file);
+
+#pragma mark - smbSessionFileCacheTake
+smb_file *smb_session_file_cache_take(smb_session *s, smb_tid tid,
+                                      const char *path, uint32_t mode);
+
+#pragma mark - smbSessionFileCacheGet
+smb_file *smb_session_file_cache_get(smb_session *s, smb_fd fd);
+
+#pragma mark - smbSessionFileCacheExpired
+smb_file *smb_session_file_cache_expired(smb_session *s, time_t now);
+
+#pragma mark - smbSessionFileCacheDrop
+void smb_session_file_cache_drop(smb_session *s, smb_tid tid);
 @end
 #endif
@@ -89,6 +89,7 @@ void smb_session_share_clear(smb_session *s)
             fiter = fiter->next;
             
             free(ftmp->name);
+            free(ftmp->path);
             free(ftmp);
         }
         
@@ -96,6 +97,16 @@ void smb_session_share_clear(smb_session *s)
         iter = iter->next;
         free(tmp);
     }
+    
+    // The cached files go with their shares
+    while ((fiter = s->cached) != NULL)
+    {
+        s->cached = fiter->next;
+        free(fiter->name);
+        free(fiter->path);
+        free(fiter);
+    }
+    s->cached_count = 0;
 }
 
 #pragma mark - smbSessionFileAdd
@@ -158,7 +169,7 @@ smb_file  *smb_session_file_remove(smb_session *s, smb_fd fd) {
         return iter;
     }
     
-    while (iter->next != NULL && iter->next->fid != SMB_FD_TID(fd))
+    while (iter->next != NULL && iter->next->fid != SMB_FD_FID(fd))
         iter = iter->next;
     if (iter->next != NULL)
     {
@@ -169,4 +180,107 @@ smb_file  *smb_session_file_remove(smb_session *s, smb_fd fd) {
     else
         return NULL;
 }
+
+// Unlinks the cached file following 'prev' (the first one if NULL)
+static smb_file *smb_session_file_cache_unlink(smb_session *s, smb_file *prev)
+{
+    smb_file  *file;
+    
+    if (prev == NULL)
+    {
+        file = s->cached;
+        s->cached = file->next;
+    }
+    else
+    {
+        file = prev->next;
+        prev->next = file->next;
+    }
+    file->next = NULL;
+    s->cached_count--;
+    
+    return file;
+}
+
+#pragma mark - smbSessionFileCachePut
+void smb_session_file_cache_put(smb_session *s, smb_file *file)
+{
+    assert(s != NULL && file != NULL && file->path != NULL);
+    
+    file->closed = time(NULL);
+    file->next   = s->cached;
+    s->cached    = file;
+    s->cached_count++;
+}
+
+#pragma mark - smbSessionFileCacheTake
+smb_file *smb_session_file_cache_take(smb_session *s, smb_tid tid,
+                                      const char *path, uint32_t mode)
+{
+    smb_file  *iter, *prev = NULL;
+    
+    assert(s != NULL && path != NULL);
+    
+    for (iter = s->cached; iter != NULL; prev = iter, iter = iter->next)
+        if (iter->tid == tid && iter->mode == mode && !strcmp(iter->path, path))
+            return smb_session_file_cache_unlink(s, prev);
+    
+    return NULL;
+}
+
+#pragma mark - smbSessionFileCacheGet
+smb_file *smb_session_file_cache_get(smb_session *s, smb_fd fd)
+{
+    smb_file  *iter;
+    
+    assert(s != NULL && fd);
+    
+    iter = s->cached;
+    while (iter != NULL && (iter->tid != SMB_FD_TID(fd) || iter->fid != SMB_FD_FID(fd)))
+        iter = iter->next;
+    
+    return iter;
+}
+
+#pragma mark - smbSessionFileCacheExpired
+smb_file *smb_session_file_cache_expired(smb_session *s, time_t now)
+{
+    smb_file  *iter, *prev = NULL;
+    
+    assert(s != NULL);
+    
+    // A handle is only worth keeping while no one else can open the file
+    // without us knowing, that is while it holds an exclusive oplock.
+    for (iter = s->cached; iter != NULL; prev = iter, iter = iter->next)
+        if ((iter->oplock != SMB_OPLOCK_EXCLUSIVE && iter->oplock != SMB_OPLOCK_BATCH)
+            || (s->cache_idle > 0 && now - iter->closed > (time_t)s->cache_idle)
+            || (iter->next == NULL && s->cached_count > s->cache_max))
+            return smb_session_file_cache_unlink(s, prev);
+    
+    return NULL;
+}
+
+#pragma mark - smbSessionFileCacheDrop
+void smb_session_file_cache_drop(smb_session *s, smb_tid tid)
+{
+    smb_file  *iter, *prev = NULL, *file;
+    
+    assert(s != NULL);
+    
+    iter = s->cached;
+    while (iter != NULL)
+    {
+        if (iter->tid != tid)
+        {
+            prev = iter;
+            iter = iter->next;
+            continue;
+        }
+        iter = iter->next;
+        file = smb_session_file_cache_unlink(s, prev);
+        free(file->name);
+        free(file->path);
+        free(file);
+    }
+}
 @end
@@ -11,6 +11,13 @@
 
 @interface smbFile : NSObject
 
+// Threads: the file, directory, share and stat calls of a session may be
+// made from several threads at once, each exchange with the server holds the
+// session io_lock (the answers are parsed in the transport buffer). Only
+// smb_session_connect(), smb_session_connect_loopback(), smb_session_set_creds()
+// and smb_session_destroy() must be called while no other thread uses the
+// session: they replace the connection or the state the others work on.
+
 #pragma mark - smbFopen
 /*!Open a file on a share.
  * Use this function to obtain an smb_fd, necesary for file operations
@@ -24,13 +31,63 @@
 int smb_fopen(smb_session *s, smb_tid tid, const char *path,
                     uint32_t mod, smb_fd *fd);
 
+#pragma mark - smbFopenOptsInit
+/*!Fill an smb_fopen_opts with the defaults for the access modes 'mod'
+ * Share read and write, no create options, no preallocation, no write-through. Files opened for #SMB_MOD_RW are created if they don't exist and truncated if they do, the others must exist.
+ *\param opts The options to initialize
+ *\param mod The access modes that will be given to smb_fopen_ex()
+ */
+void smb_fopen_opts_init(smb_fopen_opts *opts, uint32_t mod);
+
+#pragma mark - smbFopenEx
+/*!Open a file on a share, with explicit open options
+ * Same as smb_fopen(), which always truncates #SMB_MOD_RW files and writes them through to the server disk, but the disposition, create options (think #SMB_CREATEOPT_SEQUENTIAL_ONLY or #SMB_CREATEOPT_RANDOM_ACCESS), share access, preallocated size and write-through mode are given by 'opts'.
+ * Without write-through, the server is free to cache writes, which is much faster for bulk uploads.
+ * An oplock can be requested with opts->oplock. When an exclusive or batch oplock is granted, nobody else can open the file and the read-ahead and write-behind buffers (see smb_file_set_readahead() and smb_file_set_writebehind()) and smb_stat_fd() can be trusted. When the server breaks the oplock, the buffered writes are sent, the read-ahead buffer is dropped (unless level II is kept) and the break is acknowledged. If writes are buffered, this happens at the next operation on a file of the session.
+ *\param s The session object
+ *\param tid The tid of the share the file is in, obtained via smb_tree_connect()
+ *\param path The path of the file to open
+ *\param mod The access modes requested (example: #SMB_MOD_RO)
+ *\param opts The open options, initialize them with smb_fopen_opts_init()
+ *\param fd The pointer to the smb file description that can be used for further file operations
+ *\returns 0 on success or a DSM error code in case of error
+ */
+int smb_fopen_ex(smb_session *s, smb_tid tid, const char *path,
+                 uint32_t mod, const smb_fopen_opts *opts, smb_fd *fd);
+
 #pragma mark - smbFclose
 /*!Close an open file
  * The smb_fd is invalidated and MUST not be use it anymore. You can give it the 0 value.
+ * Data still held by the write-behind buffer is written first. With smb_session_set_deferred_close(), the answer of the server isn't waited for.
  *\param s The session object
  *\param fd The SMB file descriptor
+ *\returns 0 on success, or the DSM error code of a buffered write that couldn't be written
+ */
+int smb_fclose(smb_session *s, smb_fd fd);
+
+#pragma mark - smbFcloseMany
+/*!Close several open files at once
+ * Same as smb_fclose() on each file, but the CLOSE requests are sent back-to-back and their answers are received together at the end, so closing a batch of files costs about one round trip instead of one per file (none with smb_session_set_deferred_close()).
+ * All the files are closed, even if some of them fail.
+ *\param s The session object
+ *\param fds The SMB file descriptors, which are all invalidated
+ *\param count The number of file descriptors
+ *\returns 0 on success, or the first DSM error code met (an invalid descriptor or a buffered write that couldn't be written)
+ */
+int smb_fclose_many(smb_session *s, const smb_fd *fds, size_t count);
+
+#pragma mark - smbFetchSmall
+/*!Read a small file in one round trip
+ * Open, read and close requests are chained in a single message (AndX), which makes this way faster than smb_fopen() + smb_fread() + smb_fclose() for files that fit in one read (a bit less than 64KB, see #SMB_FETCH_SMALL_MAX).
+ *\param s The session object
+ *\param tid The tid of the share the file is in, obtained via smb_tree_connect()
+ *\param path The path of the file to read
+ *\param buf Where to store the beginning of the file
+ *\param buf_size The size of 'buf'
+ *\returns The number of bytes read (less than the file size if it is larger than 'buf' or a single read) or -1 in case of error
  */
-void smb_fclose(smb_session *s, smb_fd fd);
+ssize_t smb_fetch_small(smb_session *s, smb_tid tid, const char *path,
+                        void *buf, size_t buf_size);
 
 #pragma mark - smbFread
 /*\Read from an open file
@@ -38,6 +95,9 @@ void smb_fclose(smb_session *s, smb_fd fd);
  * At most 'buf_size' bytes are read from the current seek offset and copied into
  * the memory pointed by 'buf' from the open file represented by the smb file
  * descriptor 'fd'.
+ * Large buffers are fetched with several READ_ANDX requests kept in flight at
+ * once (up to the max_mpx negotiated with the server), so a single call with a
+ * big buffer is the fastest way to download a file.
  *
  * @param[in] s The session object
  * @param[in] fd [description]
@@ -47,9 +107,25 @@ void smb_fclose(smb_session *s, smb_fd fd);
  */
 ssize_t smb_fread(smb_session *s, smb_fd fd, void *buf, size_t buf_size);
 
+#pragma mark - smbPread
+/*!Read from an open file at a given offset
+ * Same as smb_fread(), but reads at 'offset' and leaves the seek offset of 'fd' alone, like the unix pread().
+ * It may be called from several threads at once on the same session and the same 'fd': the calls are serialized on the session connection.
+ *\param[in] s The session object
+ *\param[in] fd The SMB file descriptor
+ *\param[out] buf can be NULL in order to skip buf_size bytes
+ *\param[in] buf_size The number of bytes to read
+ *\param[in] offset Where to read from, in bytes from the start of the file
+ *\returns The number of bytes read or -1 in case of error.
+ */
+ssize_t smb_pread(smb_session *s, smb_fd fd, void *buf, size_t buf_size,
+                  off_t offset);
+
 #pragma mark - smbFwrite
 /*!Write to an open file
  * At most 'buf_size' bytes from memory pointed by 'buf' are written to the current seek offset of the open file represented by the smb file descriptor 'fd'.
+ * Large buffers are sent as a window of WRITE_ANDX requests kept in flight at once, whose acknowledgements are collected as they come back.
+ * If one of them is refused or only partially written, the returned count stops at that request: the write failed at the current seek offset plus the returned value (see smb_session_get_nt_status() for the reason). If the connection is lost, it stops at the first request not acknowledged, and the next call returns -1.
  *\param[in] s The session object
  *\param[in] fd [description]
  *\param[out] buf [description]
@@ -58,6 +134,145 @@ ssize_t smb_fread(smb_session *s, smb_fd fd, void *buf, size_t buf_size);
  */
 ssize_t smb_fwrite(smb_session *s, smb_fd fd, void *buf, size_t buf_size);
 
+#pragma mark - smbPwrite
+/*!Write to an open file at a given offset
+ * Same as smb_fwrite(), but writes at 'offset' and leaves the seek offset of 'fd' alone, like the unix pwrite().
+ * It may be called from several threads at once on the same session and the same 'fd': the calls are serialized on the session connection.
+ *\param[in] s The session object
+ *\param[in] fd The SMB file descriptor
+ *\param[in] buf The data to write
+ *\param[in] buf_size The number of bytes to write
+ *\param[in] offset Where to write to, in bytes from the start of the file
+ *\returns The number of bytes written or -1 in case of error.
+ */
+ssize_t smb_pwrite(smb_session *s, smb_fd fd, const void *buf, size_t buf_size,
+                   off_t offset);
+
+#pragma mark - smbFileSetReadahead
+/*!Enable, resize or disable the read-ahead of an open file
+ * Reads are served from a per-file buffer of at most 'max_size' bytes. While the reads are sequential, each refill of the buffer asks for twice as much data as the previous one (up to 'max_size'), so that small smb_fread() calls mostly don't wait for the network.
+ * A read at any other offset closes the window again, it then takes a sequential read to open it.
+ *\param s The session object
+ *\param fd The SMB file descriptor
+ *\param max_size The size of the read-ahead buffer, 0 to disable read-ahead (the default)
+ *\returns 0 on success or a DSM error code in case of error
+ */
+int smb_file_set_readahead(smb_session *s, smb_fd fd, size_t max_size);
+
+#pragma mark - smbFileSetHandleCache
+/*!Enable, resize or disable the handle cache of a session
+ * With the cache on, smb_fclose() keeps the handle of a file open on the server instead of closing it, and a later smb_fopen() of the same path, on the same share and with the same mode, reuses it at once without any request. Only opens that don't create or truncate the file (#SMB_DISPOSITION_FILE_OPEN or #SMB_DISPOSITION_FILE_OPEN_IF) reuse a handle.
+ * A handle is only cached while it holds an exclusive or batch oplock, so the server tells us before anyone else opens the file, and the handle is closed then. smb_fopen() asks for a batch oplock for read-only files when the cache is on, smb_fopen_ex() callers have to set opts->oplock themselves.
+ * Handles are closed, the least recently used first, beyond 'max_count' and after 'max_idle' seconds. The bounds are checked on each smb_fopen() and smb_fclose().
+ *\param s The session object
+ *\param max_count The number of cached handles, 0 to disable the cache (the default) and close them all
+ *\param max_idle The number of seconds a handle stays cached, 0 for no limit
+ */
+void smb_file_set_handle_cache(smb_session *s, size_t max_count,
+                               unsigned max_idle);
+
+#pragma mark - smbFileSetWritebehind
+/*!Enable, resize or disable the write-behind of an open file
+ * Small contiguous smb_fwrite()/smb_pwrite() calls are then copied to a per-file buffer of 'max_size' bytes and return at once. The buffer is written with as few WRITE_ANDX as possible when it is full, when a write isn't contiguous, before a read of the same file, and by smb_fflush() and smb_fclose().
+ * Since the data is written later, so are the errors: a failed write is reported by the next smb_fflush() or smb_fclose(), and the writes are refused until then.
+ *\param s The session object
+ *\param fd The SMB file descriptor
+ *\param max_size The size of the write-behind buffer, 0 to disable write-behind (the default)
+ *\returns 0 on success or a DSM error code in case of error
+ */
+int smb_file_set_writebehind(smb_session *s, smb_fd fd, size_t max_size);
+
+#pragma mark - smbFflush
+/*!Write the buffered data of an open file and ask the server to commit it
+ * Sends the write-behind buffer, then a FLUSH request so the server writes the file to its storage.
+ *\param s The session object
+ *\param fd The SMB file descriptor
+ *\returns 0 on success or a DSM error code (of this flush or of a previous buffered write) in case of error
+ */
+int smb_fflush(smb_session *s, smb_fd fd);
+
+#pragma mark - smbFcopy
+/*!Copy a range of an open file to another open file, at the same offset
+ * The server is asked to copy the data itself (SRV_COPYCHUNK), so it never transits through the client. The copy requests cover up to #SMB_COPYCHUNK_MAX_CHUNKS chunks of #SMB_COPYCHUNK_MAX_SIZE bytes each and are kept in flight like reads. Whatever the server doesn't copy (old server, end of the source file...) is then read and written by the client.
+ * Both files must be on the same server, 'dst_fd' must be open for writing.
+ *\param s The session object
+ *\param src_fd The SMB file descriptor of the source file
+ *\param dst_fd The SMB file descriptor of the destination file
+ *\param offset Where the range starts, in bytes from the start of the files
+ *\param size The size of the range
+ *\returns The number of bytes copied (less than 'size' at the end of the source file or on error) or -1 in case of error
+ */
+ssize_t smb_fcopy(smb_session *s, smb_fd src_fd, smb_fd dst_fd, off_t offset,
+                  size_t size);
+
+#pragma mark - smbFileCopy
+/*!Copy a file on a share, server side
+ * The destination file is created or overwritten, preallocated to the size of the source, and filled with smb_fcopy().
+ *\param s The session object
+ *\param tid The tid of the share the files are in, obtained via smb_tree_connect()
+ *\param src_path The path of the file to copy
+ *\param dst_path The path of the copy
+ *\returns 0 on success or a DSM error code in case of error
+ */
+int smb_file_copy(smb_session *s, smb_tid tid, const char *src_path,
+                  const char *dst_path);
+
+#pragma mark - smbFileSetSparse
+/*!Mark an open file as sparse
+ * The ranges zeroed with smb_file_zero() are then deallocated by the server instead of filled with zeros.
+ *\param s The session object
+ *\param fd The SMB file descriptor, open for writing
+ *\returns 0 on success or a DSM error code in case of error (the file system may not support sparse files)
+ */
+int smb_file_set_sparse(smb_session *s, smb_fd fd);
+
+#pragma mark - smbFileAllocatedRanges
+/*!List the allocated parts of a range of an open file
+ * The rest of the range is holes, which read as zeros. The server usually rounds the ranges to its clusters.
+ * A file with as much allocated space as its size (see #SMB_STAT_ALLOC_SIZE) has no holes, asking is pointless.
+ *\param s The session object
+ *\param fd The SMB file descriptor
+ *\param offset The start of the range to look at
+ *\param length The size of the range to look at
+ *\param ranges Where to store the allocated ranges, in order
+ *\param count The number of entries of 'ranges'. If they are all used, there may be more: ask again from the end of the last one.
+ *\returns The number of entries filled or -1 in case of error
+ */
+ssize_t smb_file_allocated_ranges(smb_session *s, smb_fd fd, off_t offset,
+                                  uint64_t length, smb_file_range *ranges,
+                                  size_t count);
+
+#pragma mark - smbFileZero
+/*!Zero a range of an open file without sending the zeros
+ * The file size doesn't change, only the data up to the end of file is zeroed. On a sparse file (see smb_file_set_sparse()), the range is deallocated.
+ *\param s The session object
+ *\param fd The SMB file descriptor, open for writing
+ *\param offset The start of the range to zero
+ *\param length The size of the range to zero
+ *\returns 0 on success or a DSM error code in case of error
+ */
+int smb_file_zero(smb_session *s, smb_fd fd, off_t offset, uint64_t length);
+
+#pragma mark - smbFtruncate
+/*!Set the end of file of an open file
+ * The file is cut at 'size', or extended with zeros up to it. The buffered writes are sent before.
+ *\param s The session object
+ *\param fd The SMB file descriptor, open for writing
+ *\param size The new size of the file
+ *\returns 0 on success or a DSM error code in case of error
+ */
+int smb_ftruncate(smb_session *s, smb_fd fd, uint64_t size);
+
+#pragma mark - smbFallocate
+/*!Reserve the disk space of an open file without changing its content
+ * Sets the allocation size, so that writing up to 'size' doesn't make the server grow the file again and again. A size below the end of file truncates the file. Servers may release the space past the end of file when the file is closed.
+ *\param s The session object
+ *\param fd The SMB file descriptor, open for writing
+ *\param size The space to reserve, in bytes
+ *\returns 0 on success or a DSM error code in case of error
+ */
+int smb_fallocate(smb_session *s, smb_fd fd, uint64_t size);
+
 #pragma mark - smbFseek
 /*!Sets/Moves/Get the read/write pointer for a given file
  * The behavior of this function is the same as the Unix fseek() function, except the SEEK_END argument isn't supported. This functions adjust the read/write pointer depending on the value of
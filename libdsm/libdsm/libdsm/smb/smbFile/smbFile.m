@@ -9,77 +9,117 @@
 #import "config.h"
 #import "smbFile.h"
 
+static int smb_file_wb_flush(smb_session *s, smb_file *file);
+static void smb_file_oplock_breaks(smb_session *s);
+static smb_file *smb_file_cache_reuse(smb_session *s, smb_tid tid,
+                                      const char *path, uint32_t o_flags,
+                                      const smb_fopen_opts *opts);
+
+static void smb_file_free(smb_file *file)
+{
+    free(file->ra.buf);
+    free(file->wb.buf);
+    free(file->name);
+    free(file->path);
+    free(file);
+}
+
 @implementation smbFile
 
-#pragma mark - smbFopen
-int smb_fopen(smb_session *s, smb_tid tid, const char *path,
-                      uint32_t o_flags, smb_fd *fd) {
-    smb_share       *share;
-    smb_file        *file;
-    smb_message     *req_msg, resp_msg;
-    smb_create_req req;
-    smb_create_resp *resp;
-    size_t           path_len;
-    int              res;
+// Appends an NT_CREATE_ANDX block to 'msg'
+static int smb_fopen_put_req(smb_message *msg, const char *path,
+                             uint32_t o_flags, const smb_fopen_opts *opts)
+{
+    smb_create_req  req;
+    size_t          path_len;
     char            *utf_path;
     
-    assert(s != NULL && path != NULL && fd != NULL);
-    
-    if ((share = smb_session_share_get(s, tid)) == NULL)
-        return DSM_ERROR_GENERIC;
-    
     path_len = smb_to_utf16(path, strlen(path) + 1, &utf_path);
     if (path_len == 0)
         return DSM_ERROR_CHARSET;
     
-    req_msg = smb_message_new(SMB_CMD_CREATE);
-    if (!req_msg) {
-        free(utf_path);
-        return DSM_ERROR_GENERIC;
-    }
-    
-    // Set SMB Headers
-    req_msg->packet->header.tid = tid;
-    
     // Create AndX Params
     SMB_MSG_INIT_PKT_ANDX(req);
     req.wct            = 24;
-    req.flags          = 0;
+    req.flags          = opts->oplock;
     req.root_fid       = 0;
     req.access_mask    = o_flags;
-    req.alloc_size     = 0;
+    req.alloc_size     = opts->alloc_size;
     req.file_attr      = 0;
-    req.share_access   = SMB_SHARE_READ | SMB_SHARE_WRITE;
-    if ((o_flags & SMB_MOD_RW) == SMB_MOD_RW)
-    {
-        req.disposition    = SMB_DISPOSITION_FILE_SUPERSEDE; // Create if doesn't exist
-        req.create_opts    = SMB_CREATEOPT_WRITE_THROUGH;
-    }
-    else
-    {
-        req.disposition    = SMB_DISPOSITION_FILE_OPEN;  // Open and fails if doesn't exist
-        req.create_opts    = 0;                          // We dont't support create
-    }
+    req.share_access   = opts->share_access;
+    req.disposition    = opts->disposition;
+    req.create_opts    = opts->create_opts;
+    if (opts->write_through)
+        req.create_opts |= SMB_CREATEOPT_WRITE_THROUGH;
     req.impersonation  = SMB_IMPERSONATION_SEC_IMPERSONATE;
     req.security_flags = SMB_SECURITY_NO_TRACKING;
     req.path_length    = path_len;
     req.bct            = path_len + 1;
-    SMB_MSG_PUT_PKT(req_msg, req);
+    SMB_MSG_PUT_PKT(msg, req);
     
     // Create AndX 'Body'
-    smb_message_put8(req_msg, 0);   // Align beginning of path
-    smb_message_append(req_msg, utf_path, path_len);
+    smb_message_put8(msg, 0);   // Align beginning of path
+    smb_message_append(msg, utf_path, path_len);
     free(utf_path);
     
-    // smb_message_put16(req_msg, 0);  // ??
+    return DSM_SUCCESS;
+}
+
+#pragma mark - smbFopenOptsInit
+void smb_fopen_opts_init(smb_fopen_opts *opts, uint32_t mod)
+{
+    assert(opts != NULL);
+    
+    memset(opts, 0, sizeof(*opts));
+    opts->share_access = SMB_SHARE_READ | SMB_SHARE_WRITE;
+    if ((mod & SMB_MOD_RW) == SMB_MOD_RW)
+        opts->disposition = SMB_DISPOSITION_FILE_OVERWRITE_IF; // Create if doesn't exist
+    else
+        opts->disposition = SMB_DISPOSITION_FILE_OPEN;  // Open and fails if doesn't exist
+}
+
+// Opens 'path' with a CREATE request, or takes its handle back from the
+// cache. The caller holds the session io_lock.
+static int smb_fopen_locked(smb_session *s, smb_tid tid, const char *path,
+                            uint32_t o_flags, const smb_fopen_opts *opts,
+                            smb_fd *fd)
+{
+    smb_share       *share;
+    smb_file        *file;
+    smb_message     *req_msg, resp_msg;
+    smb_create_resp *resp;
+    int              res;
+    
+    if ((share = smb_session_share_get(s, tid)) == NULL)
+        return DSM_ERROR_GENERIC;
+    
+    if (s->cache_max > 0
+        && (file = smb_file_cache_reuse(s, tid, path, o_flags, opts)) != NULL)
+    {
+        *fd = SMB_FD(tid, file->fid);
+        return DSM_SUCCESS;
+    }
+    
+    req_msg = smb_message_new(SMB_CMD_CREATE);
+    if (!req_msg)
+        return DSM_ERROR_GENERIC;
+    
+    // Set SMB Headers
+    req_msg->packet->header.tid = tid;
+    
+    res = smb_fopen_put_req(req_msg, path, o_flags, opts);
+    if (res != DSM_SUCCESS) {
+        smb_message_destroy(req_msg);
+        return res;
+    }
     
     res = smb_session_send_msg(s, req_msg);
     smb_message_destroy(req_msg);
     if (!res)
-        return DSM_ERROR_NETWORK;
+        return smb_session_network_error(s);
     
     if (!smb_session_recv_msg(s, &resp_msg))
-        return DSM_ERROR_NETWORK;
+        return smb_session_network_error(s);
     if (!smb_session_check_nt_status(s, &resp_msg))
         return DSM_ERROR_NT;
     
@@ -98,7 +138,12 @@ int smb_fopen(smb_session *s, smb_tid tid, const char *path,
     file->alloc_size    = resp->alloc_size;
     file->size          = resp->size;
     file->attr          = resp->attr;
+    file->write_through = opts->write_through;
+    file->oplock        = resp->oplock_level;
     file->is_dir        = resp->is_dir;
+    file->mode          = o_flags;
+    if (s->cache_max > 0)
+        file->path = strdup(path);
     
     smb_session_file_add(s, tid, file); // XXX Check return
     
@@ -106,173 +151,1287 @@ int smb_fopen(smb_session *s, smb_tid tid, const char *path,
     return DSM_SUCCESS;
 }
 
-#pragma mark - smbFclose
-void smb_fclose(smb_session *s, smb_fd fd)
+#pragma mark - smbFopen
+int smb_fopen(smb_session *s, smb_tid tid, const char *path,
+                      uint32_t o_flags, smb_fd *fd) {
+    smb_fopen_opts  opts;
+    
+    // Keep the historical behavior: truncate and write-through in RW
+    smb_fopen_opts_init(&opts, o_flags);
+    if ((o_flags & SMB_MOD_RW) == SMB_MOD_RW)
+    {
+        opts.disposition   = SMB_DISPOSITION_FILE_SUPERSEDE;
+        opts.write_through = true;
+    }
+    // Only a handle with an oplock can go to the handle cache
+    else if (s->cache_max > 0)
+        opts.oplock = SMB_CREATE_OPLOCK | SMB_CREATE_BATCH_OPLOCK;
+    
+    return smb_fopen_ex(s, tid, path, o_flags, &opts, fd);
+}
+
+#pragma mark - smbFopenEx
+int smb_fopen_ex(smb_session *s, smb_tid tid, const char *path,
+                 uint32_t o_flags, const smb_fopen_opts *opts, smb_fd *fd) {
+    int              res;
+    
+    assert(s != NULL && path != NULL && opts != NULL && fd != NULL);
+    
+    pthread_mutex_lock(&s->io_lock);
+    res = smb_fopen_locked(s, tid, path, o_flags, opts, fd);
+    pthread_mutex_unlock(&s->io_lock);
+    
+    return res;
+}
+
+// Sends a CLOSE for 'fid' without waiting for the answer, which is received
+// later along with the others. The caller holds the session io_lock.
+static void smb_file_close_fid(smb_session *s, smb_tid tid, smb_fid fid)
 {
-    smb_file        *file;
     smb_message     *msg;
     smb_close_req   req;
+    size_t          keep;
     
-    assert(s != NULL);
-    if (!fd)
-        return;
-    
-    // XXX Memory leak, destroy the file after removing it
-    if ((file = smb_session_file_remove(s, fd)) == NULL)
+    // Keep a request slot free for the caller's next request
+    keep = s->srv.max_mpx > 1 ? s->srv.max_mpx - 2 : 0;
+    if (smb_session_drain_closes(s, keep) != DSM_SUCCESS)
         return;
     
     msg = smb_message_new(SMB_CMD_CLOSE);
-    if (!msg) {
-        free(file->name);
-        free(file);
+    if (!msg)
         return;
-    }
     
-    msg->packet->header.tid = SMB_FD_TID(fd);
+    msg->packet->header.tid = tid;
     
     SMB_MSG_INIT_PKT(req);
     req.wct        = 3;
-    req.fid        = SMB_FD_FID(fd);
+    req.fid        = fid;
     req.last_write = ~0;
     req.bct        = 0;
     SMB_MSG_PUT_PKT(msg, req);
     
     // We don't check for succes or failure, since we actually don't really
     // care about creating a potentiel leak server side.
-    smb_session_send_msg(s, msg);
-    smb_session_recv_msg(s, 0);
+    if (smb_session_send_msg(s, msg))
+        s->closes_pending++;
     smb_message_destroy(msg);
+}
+
+// Receives the answers of the CLOSEs just sent, unless they are deferred.
+// A server taking a single request at a time can't have any pending.
+static void smb_file_close_end(smb_session *s)
+{
+    if (!s->deferred_close || s->srv.max_mpx < 2)
+        smb_session_drain_closes(s, 0);
+    else // Nothing is received for now, they must not wait in the transport
+        s->transport.flush(s->transport.session);
+}
+
+// Closes the cached handles that must go: their oplock was broken, they have
+// been idle for too long, or the cache is over its size. The caller holds
+// the session io_lock.
+static void smb_file_cache_prune(smb_session *s)
+{
+    smb_file        *file;
     
-    free(file->name);
-    free(file);
+    while ((file = smb_session_file_cache_expired(s, time(NULL))) != NULL)
+    {
+        smb_file_close_fid(s, file->tid, file->fid);
+        smb_file_free(file);
+    }
 }
 
-#pragma mark - smbFread
-ssize_t smb_fread(smb_session *s, smb_fd fd, void *buf, size_t buf_size)
+// Keeps the handle of a file being closed for a later smb_fopen() of the
+// same path. The exclusive oplock it holds guarantees the server tells us
+// before anyone else opens the file. The caller holds the session io_lock.
+static bool smb_file_cache_keep(smb_session *s, smb_file *file)
+{
+    if (s->cache_max == 0 || file->path == NULL || file->oplock_break
+        || (file->oplock != SMB_OPLOCK_EXCLUSIVE && file->oplock != SMB_OPLOCK_BATCH))
+        return false;
+    
+    // It comes back like a freshly opened file
+    free(file->ra.buf);
+    free(file->wb.buf);
+    memset(&file->ra, 0, sizeof(file->ra));
+    memset(&file->wb, 0, sizeof(file->wb));
+    file->offset = 0;
+    
+    smb_session_file_cache_put(s, file);
+    return true;
+}
+
+// Takes the cached handle of 'path' back to the open files, unless opening
+// the file again would do more than that (create or truncate it).
+static smb_file *smb_file_cache_reuse(smb_session *s, smb_tid tid,
+                                      const char *path, uint32_t o_flags,
+                                      const smb_fopen_opts *opts)
 {
     smb_file        *file;
-    smb_message     *req_msg, resp_msg;
-    smb_read_req    req;
-    smb_read_resp   *resp;
-    size_t          max_read;
-    int             res;
     
+    pthread_mutex_lock(&s->io_lock);
+    smb_file_cache_prune(s);
+    file = smb_session_file_cache_take(s, tid, path, o_flags);
+    if (file != NULL && opts->disposition != SMB_DISPOSITION_FILE_OPEN
+        && opts->disposition != SMB_DISPOSITION_FILE_OPEN_IF)
+    {
+        smb_file_close_fid(s, file->tid, file->fid);
+        smb_file_free(file);
+        file = NULL;
+    }
+    if (file != NULL)
+    {
+        file->write_through = opts->write_through;
+        smb_session_file_add(s, tid, file);
+    }
+    smb_file_close_end(s);
+    pthread_mutex_unlock(&s->io_lock);
+    
+    return file;
+}
+
+#pragma mark - smbFclose
+int smb_fclose(smb_session *s, smb_fd fd)
+{
     assert(s != NULL);
+    if (!fd)
+        return DSM_ERROR_GENERIC;
     
-    if ((file = smb_session_file_get(s, fd)) == NULL)
+    return smb_fclose_many(s, &fd, 1);
+}
+
+#pragma mark - smbFcloseMany
+int smb_fclose_many(smb_session *s, const smb_fd *fds, size_t count)
+{
+    smb_file        *file;
+    int             res = DSM_SUCCESS, err;
+    
+    assert(s != NULL && (fds != NULL || count == 0));
+    
+    pthread_mutex_lock(&s->io_lock);
+    smb_file_oplock_breaks(s);
+    // The CLOSEs go back-to-back, their answers are received at the end
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!fds[i] || (file = smb_session_file_get(s, fds[i])) == NULL)
+        {
+            res = res == DSM_SUCCESS ? DSM_ERROR_GENERIC : res;
+            continue;
+        }
+        
+        // Buffered data goes out before the handle is gone
+        err = smb_file_wb_flush(s, file);
+        res = res == DSM_SUCCESS ? err : res;
+        // Closing the file releases its oplock, a late break needs no answer
+        if (file->oplock_break)
+            s->oplock_breaks--;
+        smb_session_file_remove(s, fds[i]);
+        
+        if (err != DSM_SUCCESS || !smb_file_cache_keep(s, file))
+        {
+            smb_file_close_fid(s, SMB_FD_TID(fds[i]), SMB_FD_FID(fds[i]));
+            smb_file_free(file);
+        }
+    }
+    smb_file_cache_prune(s);
+    smb_file_close_end(s);
+    pthread_mutex_unlock(&s->io_lock);
+    
+    return res;
+}
+
+#pragma mark - smbFetchSmall
+ssize_t smb_fetch_small(smb_session *s, smb_tid tid, const char *path,
+                        void *buf, size_t buf_size)
+{
+    smb_fopen_opts  opts;
+    smb_message     *req_msg, resp_msg;
+    smb_read_req    read_req;
+    smb_close_req   close_req;
+    smb_create_resp *create_resp;
+    smb_read_resp   *read_resp;
+    size_t          block, data_len, data_pos;
+    uint8_t         cmd;
+    bool            closed = false;
+    ssize_t         res = -1;
+    
+    assert(s != NULL && path != NULL && (buf != NULL || buf_size == 0));
+    
+    // A single READ_ANDX, and the CLOSE answer must still be reachable by
+    // its 16 bits AndX offset after the data (+ some room for padding).
+    if (buf_size > s->srv.max_read)
+        buf_size = s->srv.max_read;
+    if (buf_size > SMB_FETCH_SMALL_MAX)
+        buf_size = SMB_FETCH_SMALL_MAX;
+    
+    req_msg = smb_message_new(SMB_CMD_CREATE);
+    if (!req_msg)
+        return -1;
+    
+    req_msg->packet->header.tid = tid;
+    
+    // NT_CREATE_ANDX -> READ_ANDX -> CLOSE, the server uses the fid it
+    // just opened for the chained commands.
+    smb_fopen_opts_init(&opts, SMB_MOD_RO);
+    if (smb_fopen_put_req(req_msg, path, SMB_MOD_RO, &opts) != DSM_SUCCESS) {
+        smb_message_destroy(req_msg);
         return -1;
+    }
+    
+    smb_message_chain(req_msg, 0, SMB_CMD_READ);
+    block = req_msg->cursor;
+    SMB_MSG_INIT_PKT_ANDX(read_req);
+    read_req.wct              = 12;
+    read_req.fid              = 0xffff;
+    read_req.offset           = 0;
+    read_req.max_count        = buf_size & 0xffff;
+    read_req.min_count        = buf_size & 0xffff;
+    read_req.max_count_high   = buf_size >> 16;
+    read_req.remaining        = 0;
+    read_req.offset_high      = 0;
+    read_req.bct              = 0;
+    SMB_MSG_PUT_PKT(req_msg, read_req);
+    
+    smb_message_chain(req_msg, block, SMB_CMD_CLOSE);
+    SMB_MSG_INIT_PKT(close_req);
+    close_req.wct        = 3;
+    close_req.fid        = 0xffff;
+    close_req.last_write = ~0;
+    close_req.bct        = 0;
+    SMB_MSG_PUT_PKT(req_msg, close_req);
+    
+    pthread_mutex_lock(&s->io_lock);
+    if (!smb_session_send_msg(s, req_msg)
+        || !smb_session_recv_msg(s, &resp_msg))
+        goto out;
+    
+    // When a command fails, the chain stops there and the header holds
+    // its status, so the blocks present tell how far the server went.
+    create_resp = (smb_create_resp *)resp_msg.packet->payload;
+    if (resp_msg.payload_size < sizeof(smb_create_resp) || create_resp->wct < 34)
+    {
+        smb_session_check_nt_status(s, &resp_msg);
+        goto out;
+    }
+    
+    block = 0;
+    cmd   = resp_msg.packet->header.command;
+    if (smb_message_andx_next(&resp_msg, &block, &cmd) && cmd == SMB_CMD_READ
+        && block + sizeof(smb_read_resp) <= resp_msg.payload_size
+        && resp_msg.packet->payload[block] >= 12)
+    {
+        read_resp = (smb_read_resp *)(resp_msg.packet->payload + block);
+        data_len  = read_resp->data_len | ((size_t)read_resp->data_len_high << 16);
+        data_pos  = read_resp->data_offset - sizeof(smb_header);
+        if (data_len > buf_size)
+            data_len = buf_size;
+        if (read_resp->data_offset >= sizeof(smb_header)
+            && data_pos + data_len <= resp_msg.payload_size)
+        {
+            memcpy(buf, resp_msg.packet->payload + data_pos, data_len);
+            res = data_len;
+        }
+        
+        closed = smb_message_andx_next(&resp_msg, &block, &cmd)
+                 && cmd == SMB_CMD_CLOSE;
+    }
+    else if (resp_msg.packet->header.status == NT_STATUS_END_OF_FILE)
+        res = 0;    // Empty file
+    else
+        smb_session_check_nt_status(s, &resp_msg);
+    
+    // The chain stopped before closing the file, do it separately
+    if (!closed)
+    {
+        smb_file_close_fid(s, tid, create_resp->fid);
+        smb_file_close_end(s);
+    }
+    
+out:
+    pthread_mutex_unlock(&s->io_lock);
+    smb_message_destroy(req_msg);
+    
+    return res;
+}
+
+// A READ_ANDX or WRITE_ANDX request in flight, matched with its response
+// using the multiplex id.
+typedef struct
+{
+    uint16_t        mid;
+    size_t          pos;        // Position relative to the start of the buffer
+    size_t          size;       // Requested size
+    bool            busy;
+} smb_io_slot;
+
+static size_t smb_io_depth(smb_session *s, size_t size, size_t chunk)
+{
+    size_t depth = s->srv.max_mpx;
+    size_t count = (size + chunk - 1) / chunk;
+    
+    // The CLOSE answers still expected count as requests in flight
+    depth = depth > s->closes_pending ? depth - s->closes_pending : 1;
+    
+    depth = depth < SMB_IO_PIPELINE_DEPTH ? depth : SMB_IO_PIPELINE_DEPTH;
+    depth = depth < count ? depth : count;
+    
+    return depth ? depth : 1;
+}
+
+static smb_io_slot *smb_io_slot_find(smb_io_slot *slots, size_t depth, uint16_t mid)
+{
+    for (size_t i = 0; i < depth; i++)
+        if (slots[i].busy && slots[i].mid == mid)
+            return &slots[i];
+    return NULL;
+}
+
+// Lowers 'done' to the first request still waiting for its response: what
+// is before it has been acknowledged.
+static size_t smb_io_acked(smb_io_slot *slots, size_t depth, size_t done)
+{
+    for (size_t i = 0; i < depth; i++)
+        if (slots[i].busy && slots[i].pos < done)
+            done = slots[i].pos;
+    return done;
+}
+
+// Sends one request of a pipelined transfer, and stores the multiplex id used.
+// 'ctx' is given as is to every request of the transfer.
+typedef int     (*smb_io_send_fn)(smb_session *s, smb_file *file, off_t offset,
+                                  void *buf, size_t size, const void *ctx,
+                                  uint16_t *mid);
+// Handles a successful response, returns the number of bytes transferred, or
+// SIZE_MAX if the rest of the response couldn't be received.
+// Only 'head_size' bytes of the response have been received, the handler
+// fetches the rest with smb_session_recv_msg_body() if it needs it.
+typedef size_t  (*smb_io_recv_fn)(smb_session *s, smb_message *msg,
+                                  void *buf, size_t size);
+
+// Keeps up to max_mpx requests in flight, each one transferring at most
+// 'chunk' bytes, and matches the responses back to the position they were
+// issued for. Returns the number of contiguous bytes transferred from
+// 'offset', or -1 if nothing could be transferred.
+// On a short or failed transfer no more requests are issued, but those
+// already in flight are drained so the session stays usable. If a response
+// is lost midway, nothing more can be received: what was acknowledged before
+// it is reported, as a short transfer.
+static ssize_t smb_io_pipelined(smb_session *s, smb_file *file, off_t offset,
+                                void *buf, size_t buf_size, size_t chunk,
+                                smb_io_send_fn send_fn, smb_io_recv_fn recv_fn,
+                                size_t head_size, const void *ctx)
+{
+    smb_io_slot     slots[SMB_IO_PIPELINE_DEPTH];
+    smb_io_slot     *slot;
+    smb_message     resp_msg;
+    size_t          depth, sent, done, inflight, len;
+    bool            stop, failed;
+    
+    depth     = smb_io_depth(s, buf_size, chunk);
+    sent      = 0;
+    done      = buf_size;   // Lowered by the first short or failed request
+    inflight  = 0;
+    stop      = false;
+    failed    = false;
+    memset(slots, 0, sizeof(slots));
+    
+    for (;;)
+    {
+        for (size_t i = 0; i < depth && !stop && sent < buf_size; i++)
+        {
+            if (slots[i].busy)
+                continue;
+            
+            slots[i].pos  = sent;
+            slots[i].size = buf_size - sent < chunk ? buf_size - sent : chunk;
+            if (!send_fn(s, file, offset + sent, buf ? (char *)buf + sent : NULL,
+                         slots[i].size, ctx, &slots[i].mid))
+            {
+                stop = failed = true;
+                done = done < sent ? done : sent;
+                break;
+            }
+            slots[i].busy = true;
+            sent += slots[i].size;
+            inflight++;
+        }
+        
+        if (inflight == 0)
+            break;
+        
+        if (!smb_session_recv_msg_head(s, &resp_msg, head_size))
+        {
+            failed = true;
+            done = smb_io_acked(slots, depth, done < sent ? done : sent);
+            break;
+        }
+        if ((slot = smb_io_slot_find(slots, depth, resp_msg.packet->header.mux_id)) == NULL)
+            continue; // Not for us, drop it
+        slot->busy = false;
+        inflight--;
+        
+        if (!smb_session_check_nt_status(s, &resp_msg))
+        {
+            if (resp_msg.packet->header.status != NT_STATUS_END_OF_FILE)
+                failed = true;
+            len = 0;
+        }
+        else
+            len = recv_fn(s, &resp_msg, buf ? (char *)buf + slot->pos : NULL, slot->size);
+        
+        if (len == SIZE_MAX)
+        {
+            failed = true;
+            done = smb_io_acked(slots, depth, done < slot->pos ? done : slot->pos);
+            break;
+        }
+        if (len < slot->size)
+        {
+            // Short transfer (EOF or error), nothing after this chunk is valid.
+            stop = true;
+            done = done < slot->pos + len ? done : slot->pos + len;
+        }
+    }
+    
+    if (done == 0 && failed)
+        return -1;
+    
+    return done;
+}
+
+static int smb_fread_send(smb_session *s, smb_file *file, off_t offset,
+                          void *buf, size_t size, const void *ctx,
+                          uint16_t *mid)
+{
+    smb_message     *req_msg;
+    smb_read_req    req;
+    int             res;
+    
+    (void)buf;
+    (void)ctx;
     
     req_msg = smb_message_new(SMB_CMD_READ);
     if (!req_msg)
-        return -1;
+        return 0;
     req_msg->packet->header.tid = file->tid;
     
-    max_read = 0xffff;
-    max_read = max_read < buf_size ? max_read : buf_size;
-    
     SMB_MSG_INIT_PKT_ANDX(req);
     req.wct              = 12;
     req.fid              = file->fid;
-    req.offset           = (uint32_t)file->offset;
-    req.max_count        = max_read;
-    req.min_count        = max_read;
-    req.max_count_high   = 0;
+    req.offset           = (uint32_t)offset;
+    req.max_count        = size & 0xffff;
+    req.min_count        = size & 0xffff;
+    req.max_count_high   = size >> 16;
     req.remaining        = 0;
-    req.offset_high      = (file->offset >> 32) & 0xffffffff;
+    req.offset_high      = (offset >> 32) & 0xffffffff;
     req.bct              = 0;
     SMB_MSG_PUT_PKT(req_msg, req);
     
     res = smb_session_send_msg(s, req_msg);
+    *mid = req_msg->packet->header.mux_id;
     smb_message_destroy(req_msg);
-    if (!res)
-        return -1;
     
-    if (!smb_session_recv_msg(s, &resp_msg))
-        return -1;
-    if (!smb_session_check_nt_status(s, &resp_msg))
-        return -1;
+    return res;
+}
+
+// The response data is received straight into the caller buffer, it never
+// transits through the session buffer.
+static size_t smb_fread_recv(smb_session *s, smb_message *msg, void *buf, size_t size)
+{
+    smb_read_resp   *resp;
+    size_t          len, have, skip;
+    ssize_t         res;
+    
+    if (msg->payload_size < sizeof(smb_read_resp))
+        return 0;
+    
+    resp = (smb_read_resp *)msg->packet->payload;
+    len  = resp->data_len | ((size_t)(resp->data_len_high & 0xffff) << 16);
+    len  = len < size ? len : size;
+    have = sizeof(smb_header) + msg->payload_size;
+    
+    if (resp->data_offset < have)
+    {
+        // Data starts inside the head we already hold, do it the slow way.
+        if (smb_session_recv_msg_body(s, msg, NULL, SIZE_MAX) < 0)
+            return SIZE_MAX;
+        resp = (smb_read_resp *)msg->packet->payload;
+        have = sizeof(smb_header) + msg->payload_size;
+        len  = len < have - resp->data_offset ? len : have - resp->data_offset;
+        if (buf)
+            memcpy(buf, (char *)msg->packet + resp->data_offset, len);
+        return len;
+    }
+    
+    // Skip the padding, the data is then where the caller wants it.
+    skip = resp->data_offset - have;
+    if (skip && (res = smb_session_recv_msg_body(s, msg, NULL, skip)) != (ssize_t)skip)
+        return res < 0 ? SIZE_MAX : 0;
+    if (!buf)
+        return len; // Will be skipped on next receive
     
-    resp = (smb_read_resp *)resp_msg.packet->payload;
-    if (buf)
-        memcpy(buf, (char *)resp_msg.packet + resp->data_offset, resp->data_len);
-    smb_fseek(s, fd, resp->data_len, SEEK_CUR);
+    res = smb_session_recv_msg_body(s, msg, buf, len);
     
-    return resp->data_len;
+    return res < 0 ? SIZE_MAX : (size_t)res;
 }
 
-#pragma mark - smbFwrite
-ssize_t smb_fwrite(smb_session *s, smb_fd fd, void *buf, size_t buf_size)
+static int smb_fwrite_send(smb_session *s, smb_file *file, off_t offset,
+                           void *buf, size_t size, const void *ctx,
+                           uint16_t *mid)
 {
-    smb_file       *file;
-    smb_message    *req_msg, resp_msg;
+    smb_message    *req_msg;
     smb_write_req   req;
-    smb_write_resp *resp;
-    uint16_t        max_write;
     int             res;
     
-    assert(s != NULL && buf != NULL);
-    
-    file = smb_session_file_get(s, fd);
-    if (file == NULL)
-        return -1;
+    (void)ctx;
     
     req_msg = smb_message_new(SMB_CMD_WRITE);
     if (!req_msg)
-        return -1;
+        return 0;
     req_msg->packet->header.tid = (uint16_t)file->tid;
     
-    // total size of SMB message shall not exceed maximum size of netbios data payload
-    max_write = UINT16_MAX - sizeof(smb_packet) - sizeof(smb_write_req);
-    max_write = max_write < buf_size ? max_write : (uint16_t)buf_size;
-    
     SMB_MSG_INIT_PKT_ANDX(req);
     req.wct              = 14; // Must be 14
     req.fid              = file->fid;
-    req.offset           = file->offset & 0xffffffff;
+    req.offset           = offset & 0xffffffff;
     req.timeout          = 0;
-    req.write_mode       = SMB_WRITEMODE_WRITETHROUGH;
+    req.write_mode       = file->write_through ? SMB_WRITEMODE_WRITETHROUGH : 0;
     req.remaining        = 0;
-    req.reserved         = 0;
-    req.data_len         = max_write;
+    req.data_len_high    = size >> 16;
+    req.data_len         = size & 0xffff;
     req.data_offset      = sizeof(smb_packet) + sizeof(smb_write_req);
-    req.offset_high      = (file->offset >> 32) & 0xffffffff;
-    req.bct              = max_write;
+    req.offset_high      = (offset >> 32) & 0xffffffff;
+    req.bct              = size & 0xffff; // Ignored by the server for large writes
     SMB_MSG_PUT_PKT(req_msg, req);
-    smb_message_append(req_msg, buf, max_write);
     
-    res = smb_session_send_msg(s, req_msg);
+    // Data isn't copied into the message, it is sent right from 'buf'
+    res = smb_session_send_msg_data(s, req_msg, buf, size);
+    *mid = req_msg->packet->header.mux_id;
     smb_message_destroy(req_msg);
-    if (!res)
+    
+    return res;
+}
+
+static size_t smb_fwrite_recv(smb_session *s, smb_message *msg, void *buf, size_t size)
+{
+    smb_write_resp  *resp;
+    size_t          len;
+    
+    (void)s;
+    (void)buf;
+    
+    resp = (smb_write_resp *)msg->packet->payload;
+    len  = resp->data_len | ((size_t)resp->data_len_high << 16);
+    
+    return len < size ? len : size;
+}
+
+// Reads straight from the server, no read-ahead involved
+static ssize_t smb_file_read(smb_session *s, smb_file *file, void *buf,
+                             size_t buf_size, off_t offset)
+{
+    return smb_io_pipelined(s, file, offset, buf, buf_size, s->srv.max_read,
+                            smb_fread_send, smb_fread_recv,
+                            sizeof(smb_header) + sizeof(smb_read_resp), NULL);
+}
+
+// Serves what it can from the read-ahead buffer, then either refills it
+// (sequential access) or reads the rest directly (random access or large
+// reads, which the pipelining already handles well).
+static ssize_t smb_file_read_ahead(smb_session *s, smb_file *file, void *buf,
+                                   size_t buf_size, off_t offset)
+{
+    smb_readahead   *ra = &file->ra;
+    size_t          done = 0, len;
+    ssize_t         res;
+    
+    if (offset == ra->next)
+    {
+        // Sequential: open the window, then double it on each hit
+        if (ra->window == 0)
+            ra->window = s->srv.max_read < ra->max ? s->srv.max_read : ra->max;
+        else if (ra->window < ra->max / 2)
+            ra->window *= 2;
+        else
+            ra->window = ra->max;
+    }
+    else
+        ra->window = 0;
+    
+    if (offset >= ra->offset && offset < ra->offset + (off_t)ra->len)
+    {
+        done = ra->offset + ra->len - offset;
+        if (done > buf_size)
+            done = buf_size;
+        if (buf != NULL)
+            memcpy(buf, ra->buf + (offset - ra->offset), done);
+    }
+    
+    while (done < buf_size)
+    {
+        len = buf_size - done;
+        if (ra->window == 0 || len >= ra->window)
+        {
+            res = smb_file_read(s, file, buf ? (uint8_t *)buf + done : NULL,
+                                len, offset + done);
+            if (res > 0)
+                done += res;
+            else if (done == 0)
+                done = res;
+            break;
+        }
+        
+        res = smb_file_read(s, file, ra->buf, ra->window, offset + done);
+        if (res <= 0)
+        {
+            ra->len = 0;
+            if (done == 0)
+                done = res;
+            break;
+        }
+        ra->offset = offset + done;
+        ra->len    = res;
+        
+        len = (size_t)res < len ? (size_t)res : len;
+        if (buf != NULL)
+            memcpy((uint8_t *)buf + done, ra->buf, len);
+        done += len;
+        if ((size_t)res < ra->window)
+            break; // End of file
+    }
+    
+    if ((ssize_t)done > 0)
+        ra->next = offset + done;
+    
+    return done;
+}
+
+#pragma mark - smbFread
+ssize_t smb_fread(smb_session *s, smb_fd fd, void *buf, size_t buf_size)
+{
+    smb_file        *file;
+    ssize_t         res;
+    
+    assert(s != NULL);
+    
+    // The offset moves along with the read for the other threads
+    pthread_mutex_lock(&s->io_lock);
+    if ((file = smb_session_file_get(s, fd)) == NULL)
+        res = -1;
+    else if ((res = smb_pread(s, fd, buf, buf_size, file->offset)) > 0)
+        smb_fseek(s, fd, res, SEEK_CUR);
+    pthread_mutex_unlock(&s->io_lock);
+    
+    return res;
+}
+
+#pragma mark - smbPread
+ssize_t smb_pread(smb_session *s, smb_fd fd, void *buf, size_t buf_size,
+                  off_t offset)
+{
+    smb_file        *file;
+    ssize_t         res = -1;
+    
+    assert(s != NULL);
+    
+    // The whole pipeline owns the connection: responses of another caller
+    // would otherwise be taken for ours (or dropped).
+    pthread_mutex_lock(&s->io_lock);
+    smb_file_oplock_breaks(s);
+    if ((file = smb_session_file_get(s, fd)) != NULL)
+    {
+        // The data to read may still be in the write-behind buffer
+        smb_file_wb_flush(s, file);
+        if (file->ra.max > 0)
+            res = smb_file_read_ahead(s, file, buf, buf_size, offset);
+        else
+            res = smb_file_read(s, file, buf, buf_size, offset);
+    }
+    smb_file_oplock_breaks(s);    // Those received meanwhile
+    pthread_mutex_unlock(&s->io_lock);
+    
+    return res;
+}
+
+// Writes straight to the server, no write-behind involved
+static ssize_t smb_file_write(smb_session *s, smb_file *file, const void *buf,
+                              size_t buf_size, off_t offset)
+{
+    return smb_io_pipelined(s, file, offset, (void *)buf, buf_size,
+                            s->srv.max_write, smb_fwrite_send, smb_fwrite_recv,
+                            SIZE_MAX, NULL);
+}
+
+// Sends the buffered data, a failure is kept until reported by
+// smb_fflush() or smb_fclose(). Returns the pending error if any.
+static int smb_file_wb_flush(smb_session *s, smb_file *file)
+{
+    smb_writebehind *wb = &file->wb;
+    size_t          done = 0;
+    ssize_t         res;
+    
+    if (wb->len > 0 && wb->error == DSM_SUCCESS)
+    {
+        // After a short write, the next one tells a refusal from a lost
+        // connection
+        do
+            res = smb_file_write(s, file, wb->buf + done, wb->len - done,
+                                 wb->offset + done);
+        while (res > 0 && (done += res) < wb->len);
+        if (res < 0)
+            wb->error = smb_session_network_error(s);
+        else if (done != wb->len)
+            wb->error = DSM_ERROR_NT;
+    }
+    wb->len = 0;
+    
+    return wb->error;
+}
+
+// Appends small writes to the buffer as long as they are contiguous,
+// writes large ones directly.
+static ssize_t smb_file_wb_write(smb_session *s, smb_file *file,
+                                 const void *buf, size_t buf_size, off_t offset)
+{
+    smb_writebehind *wb = &file->wb;
+    
+    if (wb->len > 0 && (offset != wb->offset + (off_t)wb->len
+                        || wb->len + buf_size > wb->max))
+        smb_file_wb_flush(s, file);
+    
+    // Once a write has been lost, refuse the next ones until it is reported
+    if (wb->error != DSM_SUCCESS)
         return -1;
     
-    if (!smb_session_recv_msg(s, &resp_msg))
+    if (buf_size >= wb->max)
+        return smb_file_write(s, file, buf, buf_size, offset);
+    
+    if (wb->len == 0)
+        wb->offset = offset;
+    memcpy(wb->buf + wb->len, buf, buf_size);
+    wb->len += buf_size;
+    
+    return buf_size;
+}
+
+// Completes the oplock breaks the receive loop couldn't acknowledge at once
+// because of buffered writes. These have to reach the server first.
+static void smb_file_oplock_breaks(smb_session *s)
+{
+    smb_share       *share;
+    smb_file        *file;
+    
+    for (share = s->shares; share != NULL && s->oplock_breaks > 0; share = share->next)
+        for (file = share->files; file != NULL; file = file->next)
+            if (file->oplock_break)
+            {
+                smb_file_wb_flush(s, file);
+                smb_session_oplock_release(s, file, file->oplock_break_to);
+            }
+}
+
+#pragma mark - smbFwrite
+ssize_t smb_fwrite(smb_session *s, smb_fd fd, void *buf, size_t buf_size)
+{
+    smb_file       *file;
+    ssize_t         res;
+    
+    assert(s != NULL && buf != NULL);
+    
+    pthread_mutex_lock(&s->io_lock);
+    if ((file = smb_session_file_get(s, fd)) == NULL)
+        res = -1;
+    else if ((res = smb_pwrite(s, fd, buf, buf_size, file->offset)) > 0)
+        smb_fseek(s, fd, res, SEEK_CUR);
+    pthread_mutex_unlock(&s->io_lock);
+    
+    return res;
+}
+
+#pragma mark - smbPwrite
+ssize_t smb_pwrite(smb_session *s, smb_fd fd, const void *buf, size_t buf_size,
+                   off_t offset)
+{
+    smb_file        *file;
+    ssize_t         res = -1;
+    
+    assert(s != NULL && buf != NULL);
+    
+    pthread_mutex_lock(&s->io_lock);
+    smb_file_oplock_breaks(s);
+    if ((file = smb_session_file_get(s, fd)) != NULL)
+    {
+        // Don't serve stale data from the read-ahead buffer afterward
+        file->ra.len = 0;
+        if (file->wb.max > 0)
+            res = smb_file_wb_write(s, file, buf, buf_size, offset);
+        else
+            res = smb_file_write(s, file, buf, buf_size, offset);
+        // Keep smb_stat_fd() right, at least for our own changes
+        if (res > 0 && (uint64_t)(offset + res) > file->size)
+            file->size = offset + res;
+    }
+    smb_file_oplock_breaks(s);    // Those received meanwhile
+    pthread_mutex_unlock(&s->io_lock);
+    
+    return res;
+}
+
+#pragma mark - smbFileSetReadahead
+int smb_file_set_readahead(smb_session *s, smb_fd fd, size_t max_size)
+{
+    smb_file        *file;
+    uint8_t         *buf = NULL;
+    int             res = DSM_ERROR_GENERIC;
+    
+    assert(s != NULL);
+    
+    if (max_size > 0 && (buf = malloc(max_size)) == NULL)
+        return DSM_ERROR_GENERIC;
+    
+    pthread_mutex_lock(&s->io_lock);
+    if ((file = smb_session_file_get(s, fd)) != NULL)
+    {
+        free(file->ra.buf);
+        memset(&file->ra, 0, sizeof(file->ra));
+        file->ra.buf  = buf;
+        file->ra.max  = max_size;
+        file->ra.next = file->offset;
+        buf = NULL;
+        res = DSM_SUCCESS;
+    }
+    pthread_mutex_unlock(&s->io_lock);
+    
+    free(buf);
+    return res;
+}
+
+#pragma mark - smbFileSetHandleCache
+void smb_file_set_handle_cache(smb_session *s, size_t max_count,
+                               unsigned max_idle)
+{
+    assert(s != NULL);
+    
+    pthread_mutex_lock(&s->io_lock);
+    s->cache_max  = max_count;
+    s->cache_idle = max_idle;
+    smb_file_cache_prune(s);
+    smb_file_close_end(s);
+    pthread_mutex_unlock(&s->io_lock);
+}
+
+#pragma mark - smbFileSetWritebehind
+int smb_file_set_writebehind(smb_session *s, smb_fd fd, size_t max_size)
+{
+    smb_file        *file;
+    uint8_t         *buf = NULL;
+    int             res = DSM_ERROR_GENERIC;
+    
+    assert(s != NULL);
+    
+    if (max_size > 0 && (buf = malloc(max_size)) == NULL)
+        return DSM_ERROR_GENERIC;
+    
+    pthread_mutex_lock(&s->io_lock);
+    if ((file = smb_session_file_get(s, fd)) != NULL)
+    {
+        // Whatever was buffered so far is written with the previous setting
+        res = smb_file_wb_flush(s, file);
+        if (res == DSM_SUCCESS)
+        {
+            free(file->wb.buf);
+            memset(&file->wb, 0, sizeof(file->wb));
+            file->wb.buf = buf;
+            file->wb.max = max_size;
+            buf = NULL;
+        }
+    }
+    pthread_mutex_unlock(&s->io_lock);
+    
+    free(buf);
+    return res;
+}
+
+#pragma mark - smbFflush
+int smb_fflush(smb_session *s, smb_fd fd)
+{
+    smb_file        *file;
+    smb_message     *req_msg, resp_msg;
+    smb_flush_req   req;
+    int             res;
+    
+    assert(s != NULL);
+    
+    pthread_mutex_lock(&s->io_lock);
+    smb_file_oplock_breaks(s);
+    if ((file = smb_session_file_get(s, fd)) == NULL)
+    {
+        pthread_mutex_unlock(&s->io_lock);
+        return DSM_ERROR_GENERIC;
+    }
+    
+    // Report (and forget) a previous failure, as fflush() does
+    res = smb_file_wb_flush(s, file);
+    file->wb.error = DSM_SUCCESS;
+    if (res != DSM_SUCCESS)
+    {
+        pthread_mutex_unlock(&s->io_lock);
+        return res;
+    }
+    
+    req_msg = smb_message_new(SMB_CMD_FLUSH);
+    if (!req_msg)
+    {
+        pthread_mutex_unlock(&s->io_lock);
+        return DSM_ERROR_GENERIC;
+    }
+    
+    req_msg->packet->header.tid = SMB_FD_TID(fd);
+    
+    SMB_MSG_INIT_PKT(req);
+    req.wct = 1;
+    req.fid = SMB_FD_FID(fd);
+    req.bct = 0;
+    SMB_MSG_PUT_PKT(req_msg, req);
+    
+    if (!smb_session_send_msg(s, req_msg))
+        res = smb_session_network_error(s);
+    else if (!smb_session_recv_msg(s, &resp_msg))
+        res = smb_session_network_error(s);
+    else if (!smb_session_check_nt_status(s, &resp_msg))
+        res = DSM_ERROR_NT;
+    
+    smb_message_destroy(req_msg);
+    smb_file_oplock_breaks(s);    // Those received meanwhile
+    pthread_mutex_unlock(&s->io_lock);
+    
+    return res;
+}
+
+// One SRV_COPYCHUNK request, sent on the destination file: up to
+// SMB_COPYCHUNK_MAX_CHUNKS chunks, copied at the same offset from the source
+// file whose resume key is 'ctx'.
+static int smb_fcopy_send(smb_session *s, smb_file *file, off_t offset,
+                          void *buf, size_t size, const void *ctx,
+                          uint16_t *mid)
+{
+    uint8_t             in[sizeof(smb_copychunk_req)
+                           + SMB_COPYCHUNK_MAX_CHUNKS * sizeof(smb_copychunk)];
+    smb_copychunk_req   *req = (smb_copychunk_req *)in;
+    smb_copychunk       *chunk;
+    size_t              len;
+    
+    (void)buf;
+    
+    memset(in, 0, sizeof(in));
+    memcpy(req->key, ctx, SMB_COPYCHUNK_KEY_SIZE);
+    while (size > 0 && req->chunk_count < SMB_COPYCHUNK_MAX_CHUNKS)
+    {
+        len   = size < SMB_COPYCHUNK_MAX_SIZE ? size : SMB_COPYCHUNK_MAX_SIZE;
+        chunk = &req->chunks[req->chunk_count++];
+        chunk->src_offset = offset;
+        chunk->dst_offset = offset;
+        chunk->length     = (uint32_t)len;
+        offset += len;
+        size   -= len;
+    }
+    
+    return smb_ioctl_send(s, file->tid, file->fid, SMB_FSCTL_SRV_COPYCHUNK,
+                          in, sizeof(smb_copychunk_req)
+                          + req->chunk_count * sizeof(smb_copychunk),
+                          sizeof(smb_copychunk_resp), mid);
+}
+
+static size_t smb_fcopy_recv(smb_session *s, smb_message *msg, void *buf, size_t size)
+{
+    const smb_copychunk_resp    *resp;
+    
+    (void)s;
+    (void)buf;
+    
+    if (smb_ioctl_output(msg, (const void **)&resp) < (ssize_t)sizeof(smb_copychunk_resp))
+        return 0;
+    
+    return resp->total_bytes_written < size ? resp->total_bytes_written : size;
+}
+
+// Has the server copy as much as it can from the start of the range, returns
+// the number of bytes copied.
+static size_t smb_fcopy_server(smb_session *s, smb_file *src, smb_file *dst,
+                               off_t offset, size_t size)
+{
+    uint8_t         key[SMB_COPYCHUNK_KEY_SIZE + 4];   // Key + context length
+    ssize_t         res;
+    
+    res = smb_ioctl(s, src->tid, src->fid, SMB_FSCTL_SRV_REQUEST_RESUME_KEY,
+                    NULL, 0, key, sizeof(key));
+    if (res < SMB_COPYCHUNK_KEY_SIZE)
+        return 0;
+    
+    // Each request is a whole batch of chunks, they are pipelined like reads
+    res = smb_io_pipelined(s, dst, offset, NULL, size,
+                           SMB_COPYCHUNK_MAX_CHUNKS * SMB_COPYCHUNK_MAX_SIZE,
+                           smb_fcopy_send, smb_fcopy_recv, SIZE_MAX, key);
+    
+    return res > 0 ? (size_t)res : 0;
+}
+
+#pragma mark - smbFcopy
+ssize_t smb_fcopy(smb_session *s, smb_fd src_fd, smb_fd dst_fd, off_t offset,
+                  size_t size)
+{
+    smb_file        *src, *dst;
+    uint8_t         *buf;
+    size_t          done, len;
+    ssize_t         res;
+    bool            failed = false;
+    
+    assert(s != NULL);
+    
+    pthread_mutex_lock(&s->io_lock);
+    smb_file_oplock_breaks(s);
+    src = smb_session_file_get(s, src_fd);
+    dst = smb_session_file_get(s, dst_fd);
+    if (src == NULL || dst == NULL)
+    {
+        pthread_mutex_unlock(&s->io_lock);
         return -1;
-    if (!smb_session_check_nt_status(s, &resp_msg))
+    }
+    
+    // The server only sees what it has been sent
+    smb_file_wb_flush(s, src);
+    smb_file_wb_flush(s, dst);
+    dst->ra.len = 0;
+    
+    done = smb_fcopy_server(s, src, dst, offset, size);
+    if (done > 0 && (uint64_t)(offset + done) > dst->size)
+        dst->size = offset + done;
+    smb_file_oplock_breaks(s);    // Those received meanwhile
+    pthread_mutex_unlock(&s->io_lock);
+    
+    if (done == size)
+        return done;
+    
+    // Copy the rest through the client: the server doesn't support
+    // SRV_COPYCHUNK or stopped early (end of file, quota, ...).
+    if ((buf = malloc(SMB_COPYCHUNK_MAX_SIZE)) == NULL)
+        return done > 0 ? (ssize_t)done : -1;
+    while (done < size)
+    {
+        len = size - done < SMB_COPYCHUNK_MAX_SIZE ? size - done : SMB_COPYCHUNK_MAX_SIZE;
+        if ((res = smb_pread(s, src_fd, buf, len, offset + done)) <= 0)
+        {
+            failed = res < 0;
+            break;
+        }
+        if (smb_pwrite(s, dst_fd, buf, res, offset + done) != res)
+        {
+            failed = true;
+            break;
+        }
+        done += res;
+    }
+    free(buf);
+    
+    if (done == 0 && failed)
         return -1;
     
-    resp = (smb_write_resp *)resp_msg.packet->payload;
+    return done;
+}
+
+#pragma mark - smbFileCopy
+int smb_file_copy(smb_session *s, smb_tid tid, const char *src_path,
+                  const char *dst_path)
+{
+    smb_fopen_opts  opts;
+    smb_fd          src_fd, dst_fd;
+    smb_file        *src;
+    uint64_t        size, done = 0;
+    size_t          len;
+    ssize_t         res;
+    int             err;
+    
+    assert(s != NULL && src_path != NULL && dst_path != NULL);
+    
+    if ((err = smb_fopen(s, tid, src_path, SMB_MOD_RO, &src_fd)) != DSM_SUCCESS)
+        return err;
+    // Another thread may close it meanwhile, the size is taken once
+    pthread_mutex_lock(&s->io_lock);
+    src  = smb_session_file_get(s, src_fd);
+    size = src != NULL ? src->size : 0;
+    pthread_mutex_unlock(&s->io_lock);
+    if (src == NULL)
+        return DSM_ERROR_GENERIC;
     
-    smb_fseek(s, fd, resp->data_len, SEEK_CUR);
+    // Let the server allocate the whole file at once and cache the writes
+    smb_fopen_opts_init(&opts, SMB_MOD_RW);
+    opts.alloc_size = size;
+    if ((err = smb_fopen_ex(s, tid, dst_path, SMB_MOD_RW, &opts, &dst_fd)) != DSM_SUCCESS)
+    {
+        smb_fclose(s, src_fd);
+        return err;
+    }
     
-    return resp->data_len;
+    // smb_fcopy() counts in ssize_t, which is 32 bits on some targets
+    while (done < size)
+    {
+        len = size - done < SIZE_MAX / 2 ? (size_t)(size - done) : SIZE_MAX / 2;
+        res = smb_fcopy(s, src_fd, dst_fd, done, len);
+        if (res < 0)
+            err = smb_session_network_error(s);
+        else if ((size_t)res != len)
+            err = DSM_ERROR_NT;
+        if (err != DSM_SUCCESS)
+            break;
+        done += len;
+    }
+    
+    smb_fclose(s, src_fd);
+    if (smb_fclose(s, dst_fd) != DSM_SUCCESS && err == DSM_SUCCESS)
+        err = DSM_ERROR_NT;
+    
+    return err;
+}
+
+// Runs an FSCTL on an open file, serialized with the other I/O of the
+// session. The server sees the buffered writes first, and the read-ahead
+// buffer is dropped since the data may change.
+static ssize_t smb_file_fsctl(smb_session *s, smb_fd fd, uint32_t function,
+                              const void *in, size_t in_size,
+                              void *out, size_t out_size)
+{
+    smb_file        *file;
+    ssize_t         res = -1;
+    
+    pthread_mutex_lock(&s->io_lock);
+    smb_file_oplock_breaks(s);
+    if ((file = smb_session_file_get(s, fd)) != NULL)
+    {
+        smb_file_wb_flush(s, file);
+        file->ra.len = 0;
+        res = smb_ioctl(s, file->tid, file->fid, function, in, in_size,
+                        out, out_size);
+    }
+    smb_file_oplock_breaks(s);    // Those received meanwhile
+    pthread_mutex_unlock(&s->io_lock);
+    
+    return res;
+}
+
+#pragma mark - smbFileSetSparse
+int smb_file_set_sparse(smb_session *s, smb_fd fd)
+{
+    assert(s != NULL);
+    
+    if (smb_file_fsctl(s, fd, SMB_FSCTL_SET_SPARSE, NULL, 0, NULL, 0) < 0)
+        return DSM_ERROR_NT;
+    
+    return DSM_SUCCESS;
+}
+
+#pragma mark - smbFileAllocatedRanges
+ssize_t smb_file_allocated_ranges(smb_session *s, smb_fd fd, off_t offset,
+                                  uint64_t length, smb_file_range *ranges,
+                                  size_t count)
+{
+    smb_file_range  in;
+    ssize_t         res;
+    
+    assert(s != NULL && (ranges != NULL || count == 0));
+    
+    in.offset = offset;
+    in.length = length;
+    res = smb_file_fsctl(s, fd, SMB_FSCTL_QUERY_ALLOCATED_RANGES, &in, sizeof(in),
+                         ranges, count * sizeof(smb_file_range));
+    
+    return res < 0 ? -1 : res / (ssize_t)sizeof(smb_file_range);
+}
+
+#pragma mark - smbFileZero
+int smb_file_zero(smb_session *s, smb_fd fd, off_t offset, uint64_t length)
+{
+    smb_zero_data   in;
+    
+    assert(s != NULL);
+    
+    in.offset            = offset;
+    in.beyond_final_zero = offset + length;
+    if (smb_file_fsctl(s, fd, SMB_FSCTL_SET_ZERO_DATA, &in, sizeof(in), NULL, 0) < 0)
+        return DSM_ERROR_NT;
+    
+    return DSM_SUCCESS;
+}
+
+// Sets the end of file or the allocation size of an open file, serialized
+// with the other I/O of the session like smb_file_fsctl(). The buffered
+// writes are sent first, so that none lands past a new end of file.
+static int smb_file_set_size(smb_session *s, smb_fd fd, uint16_t interest,
+                             uint64_t size)
+{
+    smb_file        *file;
+    int             res = DSM_ERROR_GENERIC;
+    
+    pthread_mutex_lock(&s->io_lock);
+    smb_file_oplock_breaks(s);
+    if ((file = smb_session_file_get(s, fd)) != NULL
+        && (res = smb_file_wb_flush(s, file)) == DSM_SUCCESS)
+    {
+        file->ra.len = 0;
+        res = smb_set_file_info(s, file->tid, file->fid, interest,
+                                &size, sizeof(size));
+        if (res == DSM_SUCCESS && interest == SMB_SET_FILE_END_OF_FILE_INFO)
+            file->size = size;
+        else if (res == DSM_SUCCESS)
+        {
+            // An allocation below the end of file truncates the file
+            file->alloc_size = size;
+            if (file->size > size)
+                file->size = size;
+        }
+    }
+    smb_file_oplock_breaks(s);    // Those received meanwhile
+    pthread_mutex_unlock(&s->io_lock);
+    
+    return res;
+}
+
+#pragma mark - smbFtruncate
+int smb_ftruncate(smb_session *s, smb_fd fd, uint64_t size)
+{
+    assert(s != NULL);
+    
+    return smb_file_set_size(s, fd, SMB_SET_FILE_END_OF_FILE_INFO, size);
+}
+
+#pragma mark - smbFallocate
+int smb_fallocate(smb_session *s, smb_fd fd, uint64_t size)
+{
+    assert(s != NULL);
+    
+    return smb_file_set_size(s, fd, SMB_SET_FILE_ALLOCATION_INFO, size);
 }
 
 #pragma mark - smbFseek
 ssize_t smb_fseek(smb_session *s, smb_fd fd, off_t offset, int whence)
 {
     smb_file  *file;
+    ssize_t   res = -1;
     
     assert(s != NULL);
     
-    if ((file = smb_session_file_get(s, fd)) == NULL)
-        return -1;
-    
-    if (whence == SMB_SEEK_SET)
-        file->offset = offset;
-    else if (whence == SMB_SEEK_CUR)
-        file->offset += offset;
+    // The file list may change under another thread
+    pthread_mutex_lock(&s->io_lock);
+    if ((file = smb_session_file_get(s, fd)) != NULL)
+    {
+        if (whence == SMB_SEEK_SET)
+            file->offset = offset;
+        else if (whence == SMB_SEEK_CUR)
+            file->offset += offset;
+        res = (ssize_t)file->offset;
+    }
+    pthread_mutex_unlock(&s->io_lock);
     
-    return (ssize_t)file->offset;
+    return res;
 }
 
 #pragma mark - smbFileRM
@@ -283,6 +1442,7 @@ int smb_file_rm(smb_session *s, smb_tid tid, const char *path)
     smb_file_rm_resp      *resp;
     size_t                utf_pattern_len;
     char                  *utf_pattern;
+    int                   res = DSM_SUCCESS;
     
     assert(s != NULL && path != NULL);
     
@@ -308,21 +1468,25 @@ int smb_file_rm(smb_session *s, smb_tid tid, const char *path)
     SMB_MSG_PUT_PKT(req_msg, req);
     smb_message_append(req_msg, utf_pattern, utf_pattern_len);
     
+    pthread_mutex_lock(&s->io_lock);
     smb_session_send_msg(s, req_msg);
     smb_message_destroy(req_msg);
     
     free(utf_pattern);
     
     if (!smb_session_recv_msg(s, &resp_msg))
-        return DSM_ERROR_NETWORK;
-    if (!smb_session_check_nt_status(s, &resp_msg))
-        return DSM_ERROR_NT;
-    
-    resp = (smb_file_rm_resp *)resp_msg.packet->payload;
-    if ((resp->wct != 0) || (resp->bct != 0))
-        return DSM_ERROR_NETWORK;
+        res = smb_session_network_error(s);
+    else if (!smb_session_check_nt_status(s, &resp_msg))
+        res = DSM_ERROR_NT;
+    else
+    {
+        resp = (smb_file_rm_resp *)resp_msg.packet->payload;
+        if ((resp->wct != 0) || (resp->bct != 0))
+            res = smb_session_network_error(s);
+    }
+    pthread_mutex_unlock(&s->io_lock);
     
-    return 0;
+    return res;
 }
 
 #pragma mark - smbFileMV
@@ -333,6 +1497,7 @@ int smb_file_mv(smb_session *s, smb_tid tid, const char *old_path, const char *n
     smb_file_mv_resp      *resp;
     size_t                utf_old_len,utf_new_len;
     char                  *utf_old_path,*utf_new_path;
+    int                   res = DSM_SUCCESS;
     
     assert(s != NULL && old_path != NULL && new_path != NULL);
     
@@ -369,6 +1534,7 @@ int smb_file_mv(smb_session *s, smb_tid tid, const char *old_path, const char *n
     smb_message_put8(req_msg, 0x04); // Buffer format 2, must be 4
     smb_message_append(req_msg, utf_new_path, utf_new_len);
     
+    pthread_mutex_lock(&s->io_lock);
     smb_session_send_msg(s, req_msg);
     smb_message_destroy(req_msg);
     
@@ -376,15 +1542,17 @@ int smb_file_mv(smb_session *s, smb_tid tid, const char *old_path, const char *n
     free(utf_new_path);
     
     if (!smb_session_recv_msg(s, &resp_msg))
-        return DSM_ERROR_NETWORK;
-    
-    if (!smb_session_check_nt_status(s, &resp_msg))
-        return DSM_ERROR_NT;
-    
-    resp = (smb_file_mv_resp *)resp_msg.packet->payload;
-    if ((resp->wct != 0) || (resp->bct != 0))
-        return DSM_ERROR_NETWORK;
+        res = smb_session_network_error(s);
+    else if (!smb_session_check_nt_status(s, &resp_msg))
+        res = DSM_ERROR_NT;
+    else
+    {
+        resp = (smb_file_mv_resp *)resp_msg.packet->payload;
+        if ((resp->wct != 0) || (resp->bct != 0))
+            res = smb_session_network_error(s);
+    }
+    pthread_mutex_unlock(&s->io_lock);
     
-    return DSM_SUCCESS;
+    return res;
 }
 @end
@@ -0,0 +1,53 @@
+//
+//  smbIoctl.h
+//  test
+//
+//  Created by trekvn on 4/13/17.
+//  Copyright © 2017 trekvn. All rights reserved.
+//
+#ifdef __OBJC__
+#import <Foundation/Foundation.h>
+#import "smbHeader.h"
+
+@interface smbIoctl : NSObject
+
+#pragma mark - smbIoctlSend
+/*!Send a file system control (FSCTL) request on an open file, without waiting for its response
+ * The request is an NT_TRANSACT IOCTL. Its response can be received with smb_session_recv_msg() (match it with 'mid') and decoded with smb_ioctl_output(). Hold the session io_lock from the request to the response, other threads would take it otherwise.
+ *\param s The session object
+ *\param tid The tid of the share the file is in
+ *\param fid The server fid of the file
+ *\param function The FSCTL code (example: #SMB_FSCTL_SRV_REQUEST_RESUME_KEY)
+ *\param in The input data of the request, NULL if 'in_size' is 0
+ *\param in_size The size of the input data
+ *\param out_max The largest output data the server may return
+ *\param mid Where to store the multiplex id of the request, can be NULL
+ *\returns 1 on success, 0 if the request couldn't be sent
+ */
+int smb_ioctl_send(smb_session *s, smb_tid tid, smb_fid fid, uint32_t function,
+                   const void *in, size_t in_size, size_t out_max, uint16_t *mid);
+
+#pragma mark - smbIoctlOutput
+/*!Find the output data of an NT_TRANSACT IOCTL response
+ *\param msg The response message, fully received
+ *\param out Where to store the address of the output data, inside 'msg'
+ *\returns The size of the output data or -1 if the response is malformed
+ */
+ssize_t smb_ioctl_output(const smb_message *msg, const void **out);
+
+#pragma mark - smbIoctl
+/*!Send a file system control (FSCTL) request on an open file and wait for its response
+ *\param s The session object
+ *\param tid The tid of the share the file is in
+ *\param fid The server fid of the file
+ *\param function The FSCTL code (example: #SMB_FSCTL_SRV_REQUEST_RESUME_KEY)
+ *\param in The input data of the request, NULL if 'in_size' is 0
+ *\param in_size The size of the input data
+ *\param out Where to store the output data, can be NULL if 'out_size' is 0
+ *\param out_size The size of 'out'
+ *\returns The size of the output data copied to 'out', or -1 in case of error (see smb_session_get_nt_status() if the server refused the request). When the output is larger than 'out_size', the server status is #NT_STATUS_BUFFER_OVERFLOW and what fits is returned.
+ */
+ssize_t smb_ioctl(smb_session *s, smb_tid tid, smb_fid fid, uint32_t function,
+                  const void *in, size_t in_size, void *out, size_t out_size);
+@end
+#endif
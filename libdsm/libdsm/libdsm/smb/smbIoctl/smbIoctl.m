@@ -0,0 +1,121 @@
+//
+//  smbIoctl.m
+//  test
+//
+//  Created by trekvn on 4/13/17.
+//  Copyright © 2017 trekvn. All rights reserved.
+//
+
+#import "smbIoctl.h"
+
+@implementation smbIoctl
+
+#pragma mark - smbIoctlSend
+int smb_ioctl_send(smb_session *s, smb_tid tid, smb_fid fid, uint32_t function,
+                   const void *in, size_t in_size, size_t out_max, uint16_t *mid)
+{
+    smb_message             *req_msg;
+    smb_nt_trans_ioctl_req  req;
+    size_t                  offset, padding;
+    int                     res;
+    
+    assert(s != NULL);
+    
+    req_msg = smb_message_new(SMB_CMD_NT_TRANSACT);
+    if (!req_msg)
+        return 0;
+    req_msg->packet->header.tid = tid;
+    
+    // The data starts right after the byte count, aligned on 4 bytes
+    offset  = sizeof(smb_header) + sizeof(smb_nt_trans_ioctl_req);
+    padding = (4 - offset % 4) % 4;
+    offset += padding;
+    
+    SMB_MSG_INIT_PKT(req);
+    req.wct                 = 23;
+    req.max_setup_count     = 1;
+    req.total_data_count    = (uint32_t)in_size;
+    req.max_data_count      = (uint32_t)out_max;
+    req.param_offset        = (uint32_t)offset;
+    req.data_count          = (uint32_t)in_size;
+    req.data_offset         = (uint32_t)offset;
+    req.setup_count         = 4;
+    req.cmd                 = SMB_NT_TRANSACT_IOCTL;
+    req.function            = function;
+    req.fid                 = fid;
+    req.is_fsctl            = 1;
+    req.is_flags            = 0;
+    req.bct                 = (uint16_t)(padding + in_size);
+    SMB_MSG_PUT_PKT(req_msg, req);
+    
+    while (padding--)
+        smb_message_put8(req_msg, 0);
+    if (in_size)
+        smb_message_append(req_msg, in, in_size);
+    
+    res = smb_session_send_msg(s, req_msg);
+    if (mid)
+        *mid = req_msg->packet->header.mux_id;
+    smb_message_destroy(req_msg);
+    
+    return res;
+}
+
+#pragma mark - smbIoctlOutput
+ssize_t smb_ioctl_output(const smb_message *msg, const void **out)
+{
+    smb_nt_trans_resp   *resp;
+    size_t              offset;
+    
+    assert(msg != NULL && out != NULL);
+    
+    if (msg->payload_size < sizeof(smb_nt_trans_resp))
+        return -1;
+    resp = (smb_nt_trans_resp *)msg->packet->payload;
+    if (resp->wct < 18)
+        return -1;
+    
+    *out = NULL;
+    if (resp->data_count == 0)
+        return 0;
+    
+    // The offset is counted from the start of the SMB header
+    if (resp->data_offset < sizeof(smb_header))
+        return -1;
+    offset = resp->data_offset - sizeof(smb_header);
+    if (offset > msg->payload_size || resp->data_count > msg->payload_size - offset)
+        return -1;
+    
+    *out = msg->packet->payload + offset;
+    
+    return resp->data_count;
+}
+
+#pragma mark - smbIoctl
+ssize_t smb_ioctl(smb_session *s, smb_tid tid, smb_fid fid, uint32_t function,
+                  const void *in, size_t in_size, void *out, size_t out_size)
+{
+    smb_message     resp_msg;
+    const void      *data;
+    ssize_t         len;
+    
+    assert(s != NULL);
+    
+    pthread_mutex_lock(&s->io_lock);
+    if (!smb_ioctl_send(s, tid, fid, function, in, in_size, out_size, NULL)
+        || !smb_session_recv_msg(s, &resp_msg))
+        len = -1;
+    // The output didn't fit but what is there is valid
+    else if (!smb_session_check_nt_status(s, &resp_msg)
+             && resp_msg.packet->header.status != NT_STATUS_BUFFER_OVERFLOW)
+        len = -1;
+    else if ((len = smb_ioctl_output(&resp_msg, &data)) > 0)
+    {
+        len = (size_t)len < out_size ? len : (ssize_t)out_size;
+        memcpy(out, data, len);
+    }
+    pthread_mutex_unlock(&s->io_lock);
+    
+    return len;
+}
+@end
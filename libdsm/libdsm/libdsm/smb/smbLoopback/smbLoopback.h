@@ -0,0 +1,103 @@
+//
+//  smbLoopback.h
+//  test
+//
+//  Created by trekvn on 4/14/17.
+//  Copyright © 2017 trekvn. All rights reserved.
+//
+// The in-process transport is for tests and benchmarks, Debug builds only
+#if defined(__OBJC__) && defined(DEBUG)
+#import <Foundation/Foundation.h>
+#import "smbHeader.h"
+
+#import <sys/uio.h>
+
+// Largest message, the same as with DirectTCP
+#define SMB_LOOPBACK_MAX_PAYLOAD    (0xffffff)
+// Name of the server, which doesn't have one
+#define SMB_LOOPBACK_NAME           "LOOPBACK"
+
+typedef struct smb_loopback_s {
+    // The server the requests are given to
+    struct smb_mock_server_s    *server;
+    // Its answers, not received yet. Each one is preceded by its size (a
+    // uint32_t), they are read from 'queue_start' to 'queue_end'
+    uint8_t                     *queue;
+    size_t                      queue_size;
+    size_t                      queue_start;
+    size_t                      queue_end;
+    // The request being built (pkt_init()/pkt_append()), or gathered from
+    // the buffers given to smb_loopback_sendv()
+    uint8_t                     *request;
+    size_t                      request_size;
+    size_t                      request_cursor;
+    // The answer being received, as netbios_session 'packet'
+    uint8_t                     *packet;
+    size_t                      packet_size;
+    size_t                      packet_received;
+    size_t                      packet_pending;
+} smb_loopback;
+
+@interface smbLoopback : NSObject
+#pragma mark - smbLoopbackNew
+smb_loopback *smb_loopback_new(size_t buf_size);
+
+#pragma mark - smbLoopbackDestroy
+void smb_loopback_destroy(smb_loopback *lb);
+
+#pragma mark - smbLoopbackConnect
+/*!Start the server of the transport
+ *\param ip Unused
+ *\param lb The transport
+ *\param root The local directory the server shares (see smb_mock_server_new())
+ *\returns 1 on success, 0 if the directory can't be opened
+ */
+int smb_loopback_connect(uint32_t ip, smb_loopback *lb, const char *root);
+
+#pragma mark - smbLoopbackSetTimeouts
+/*!Nothing can time out, the server answers as it gets the requests
+ */
+void smb_loopback_set_timeouts(smb_loopback *lb, unsigned connect_ms,
+                               unsigned send_ms, unsigned recv_ms);
+
+#pragma mark - smbLoopbackTimedOut
+int smb_loopback_timed_out(smb_loopback *lb);
+
+#pragma mark - smbLoopbackFlush
+int smb_loopback_flush(smb_loopback *lb);
+
+#pragma mark - smbLoopbackPacketInit
+void smb_loopback_packet_init(smb_loopback *lb);
+
+#pragma mark - smbLoopbackPacketAppend
+int smb_loopback_packet_append(smb_loopback *lb, const void *data, size_t size);
+
+#pragma mark - smbLoopbackPacketSend
+int smb_loopback_packet_send(smb_loopback *lb);
+
+#pragma mark - smbLoopbackPacketSendv
+/*!Give a message made of several buffers to the server
+ * The server processes it at once, its answer is queued until it is received.
+ *\returns The size of the message or 0 on error
+ */
+int smb_loopback_packet_sendv(smb_loopback *lb, const struct iovec *iov,
+                              int iovcnt);
+
+#pragma mark - smbLoopbackPacketRecv
+ssize_t smb_loopback_packet_recv(smb_loopback *lb, void **data);
+
+#pragma mark - smbLoopbackPacketRecvHead
+/*!Receive the first 'head_size' bytes of the next answer, see netbios_session_packet_recv_head()
+ *\returns The full size of the answer or -1 if there is none
+ */
+ssize_t smb_loopback_packet_recv_head(smb_loopback *lb, size_t head_size,
+                                      void **data);
+
+#pragma mark - smbLoopbackPacketRecvBody
+/*!Receive up to 'size' more bytes of the current answer, see netbios_session_packet_recv_body()
+ *\returns The number of bytes received or -1 on error
+ */
+ssize_t smb_loopback_packet_recv_body(smb_loopback *lb, void *dst,
+                                      size_t size, void **data);
+@end
+#endif
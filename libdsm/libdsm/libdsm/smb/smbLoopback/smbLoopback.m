@@ -0,0 +1,275 @@
+//
+//  smbLoopback.m
+//  test
+//
+//  Created by trekvn on 4/14/17.
+//  Copyright © 2017 trekvn. All rights reserved.
+//
+
+#import "smbLoopback.h"
+#import "smbMockServer.h"
+
+#ifdef DEBUG
+
+// Makes '*buf' at least 'size' bytes long
+static int loopback_reserve(uint8_t **buf, size_t *buf_size, size_t size)
+{
+    uint8_t *tmp;
+    
+    if (size <= *buf_size)
+        return 1;
+    
+    tmp = realloc(*buf, size);
+    if (!tmp)
+        return 0;
+    *buf      = tmp;
+    *buf_size = size;
+    
+    return 1;
+}
+
+// Hands a request to the server, its answer goes at the end of the queue
+static int loopback_process(smb_loopback *lb, const void *req, size_t size)
+{
+    ssize_t     res;
+    uint32_t    answer_size;
+    
+    if (lb->server == NULL)
+        return 0;
+    
+    // Room for the largest answer, after what wasn't received yet, which is
+    // moved to the beginning of the queue first
+    if (lb->queue_start == lb->queue_end)
+        lb->queue_start = lb->queue_end = 0;
+    if (lb->queue_start > 0
+        && lb->queue_end + sizeof(answer_size) + SMB_MOCK_SERVER_MAX_ANSWER > lb->queue_size)
+    {
+        memmove(lb->queue, lb->queue + lb->queue_start,
+                lb->queue_end - lb->queue_start);
+        lb->queue_end  -= lb->queue_start;
+        lb->queue_start = 0;
+    }
+    if (!loopback_reserve(&lb->queue, &lb->queue_size, lb->queue_end
+                          + sizeof(answer_size) + SMB_MOCK_SERVER_MAX_ANSWER))
+        return 0;
+    
+    res = smb_mock_server_process(lb->server, req, size,
+                                  lb->queue + lb->queue_end + sizeof(answer_size));
+    if (res < 0)
+        return 0;
+    
+    // Some requests have no answer
+    if (res > 0)
+    {
+        answer_size = (uint32_t)res;
+        memcpy(lb->queue + lb->queue_end, &answer_size, sizeof(answer_size));
+        lb->queue_end += sizeof(answer_size) + answer_size;
+    }
+    
+    return 1;
+}
+
+@implementation smbLoopback
+#pragma mark - smbLoopbackNew
+smb_loopback *smb_loopback_new(size_t buf_size)
+{
+    smb_loopback *lb;
+    
+    lb = calloc(1, sizeof(smb_loopback));
+    if (!lb)
+        return NULL;
+    
+    if (!loopback_reserve(&lb->packet, &lb->packet_size, buf_size))
+    {
+        free(lb);
+        return NULL;
+    }
+    
+    return lb;
+}
+
+#pragma mark - smbLoopbackDestroy
+void smb_loopback_destroy(smb_loopback *lb)
+{
+    if (lb == NULL)
+        return;
+    
+    smb_mock_server_destroy(lb->server);
+    free(lb->queue);
+    free(lb->request);
+    free(lb->packet);
+    free(lb);
+}
+
+#pragma mark - smbLoopbackConnect
+int smb_loopback_connect(uint32_t ip, smb_loopback *lb, const char *root)
+{
+    (void)ip;
+    assert(lb != NULL && root != NULL);
+    
+    smb_mock_server_destroy(lb->server);
+    lb->queue_start    = 0;
+    lb->queue_end      = 0;
+    lb->packet_pending = 0;
+    
+    lb->server = smb_mock_server_new(root);
+    
+    return lb->server != NULL;
+}
+
+#pragma mark - smbLoopbackSetTimeouts
+void smb_loopback_set_timeouts(smb_loopback *lb, unsigned connect_ms,
+                               unsigned send_ms, unsigned recv_ms)
+{
+    (void)lb;
+    (void)connect_ms;
+    (void)send_ms;
+    (void)recv_ms;
+}
+
+#pragma mark - smbLoopbackTimedOut
+int smb_loopback_timed_out(smb_loopback *lb)
+{
+    (void)lb;
+    
+    return 0;
+}
+
+#pragma mark - smbLoopbackFlush
+int smb_loopback_flush(smb_loopback *lb)
+{
+    // The requests are processed as they are sent
+    (void)lb;
+    
+    return 1;
+}
+
+#pragma mark - smbLoopbackPacketInit
+void smb_loopback_packet_init(smb_loopback *lb)
+{
+    assert(lb != NULL);
+    
+    lb->request_cursor = 0;
+}
+
+#pragma mark - smbLoopbackPacketAppend
+int smb_loopback_packet_append(smb_loopback *lb, const void *data, size_t size)
+{
+    assert(lb != NULL && data != NULL);
+    
+    if (!loopback_reserve(&lb->request, &lb->request_size,
+                          lb->request_cursor + size))
+        return 0;
+    
+    memcpy(lb->request + lb->request_cursor, data, size);
+    lb->request_cursor += size;
+    
+    return 1;
+}
+
+#pragma mark - smbLoopbackPacketSend
+int smb_loopback_packet_send(smb_loopback *lb)
+{
+    assert(lb != NULL);
+    
+    if (!loopback_process(lb, lb->request, lb->request_cursor))
+        return 0;
+    
+    return (int)lb->request_cursor;
+}
+
+#pragma mark - smbLoopbackPacketSendv
+int smb_loopback_packet_sendv(smb_loopback *lb, const struct iovec *iov,
+                              int iovcnt)
+{
+    size_t  total = 0;
+    
+    assert(lb != NULL && iov != NULL && iovcnt > 0);
+    
+    // The server wants the message in one piece
+    if (iovcnt == 1)
+    {
+        total = iov[0].iov_len;
+        if (!loopback_process(lb, iov[0].iov_base, total))
+            return 0;
+        return (int)total;
+    }
+    
+    smb_loopback_packet_init(lb);
+    for (int i = 0; i < iovcnt; i++)
+    {
+        if (!smb_loopback_packet_append(lb, iov[i].iov_base, iov[i].iov_len))
+            return 0;
+    }
+    
+    return smb_loopback_packet_send(lb);
+}
+
+#pragma mark - smbLoopbackPacketRecv
+ssize_t smb_loopback_packet_recv(smb_loopback *lb, void **data)
+{
+    return smb_loopback_packet_recv_head(lb, SIZE_MAX, data);
+}
+
+#pragma mark - smbLoopbackPacketRecvHead
+ssize_t smb_loopback_packet_recv_head(smb_loopback *lb, size_t head_size,
+                                      void **data)
+{
+    uint32_t    total;
+    size_t      head;
+    
+    assert(lb != NULL);
+    
+    // What the caller didn't read of the previous answer
+    lb->queue_start    += lb->packet_pending;
+    lb->packet_pending  = 0;
+    
+    // Nothing was asked that is still to be answered
+    if (lb->queue_end - lb->queue_start < sizeof(total))
+        return -1;
+    
+    memcpy(&total, lb->queue + lb->queue_start, sizeof(total));
+    lb->queue_start += sizeof(total);
+    head = total < head_size ? total : head_size;
+    
+    if (!loopback_reserve(&lb->packet, &lb->packet_size, head))
+        return -1;
+    memcpy(lb->packet, lb->queue + lb->queue_start, head);
+    lb->queue_start     += head;
+    lb->packet_received  = head;
+    lb->packet_pending   = total - head;
+    
+    if (data != NULL)
+        *data = (void *)lb->packet;
+    
+    return total;
+}
+
+#pragma mark - smbLoopbackPacketRecvBody
+ssize_t smb_loopback_packet_recv_body(smb_loopback *lb, void *dst,
+                                      size_t size, void **data)
+{
+    assert(lb != NULL);
+    
+    size = size < lb->packet_pending ? size : lb->packet_pending;
+    
+    if (dst == NULL)
+    {
+        if (!loopback_reserve(&lb->packet, &lb->packet_size,
+                              lb->packet_received + size))
+            return -1;
+        dst = lb->packet + lb->packet_received;
+        lb->packet_received += size;
+    }
+    
+    memcpy(dst, lb->queue + lb->queue_start, size);
+    lb->queue_start    += size;
+    lb->packet_pending -= size;
+    
+    if (data != NULL)
+        *data = (void *)lb->packet;
+    
+    return size;
+}
+@end
+#endif
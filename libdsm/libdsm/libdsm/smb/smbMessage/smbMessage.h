@@ -73,6 +73,26 @@ int smb_message_put_uuid(smb_message *msg, uint32_t a, uint16_t b,
 #pragma mark - smbMessageSetAndxMembers
 void smb_message_set_andx_members(smb_message *msg);
 
+#pragma mark - smbMessageChain
+/*!Chain another command to the message, with an AndX link
+ * Pads the message so that the next command starts at the cursor on a 4 bytes boundary, and points the AndX members of the block starting at 'block' to it. The next command block can then be appended.
+ *\param msg The message being built
+ *\param block The payload offset of an AndX command block of the message (0 for the first one)
+ *\param cmd The command appended next (example: #SMB_CMD_READ)
+ *\returns 1 on success, 0 or -1 otherwise
+ */
+int smb_message_chain(smb_message *msg, size_t block, uint8_t cmd);
+
+#pragma mark - smbMessageAndxNext
+/*!Move to the next command block of a received AndX chain
+ * Start with *block = 0 and *cmd = msg->packet->header.command. The block at *block must be an AndX one.
+ *\param msg The received message
+ *\param block The payload offset of the current block, updated to the next one
+ *\param cmd Updated to the command of the next block
+ *\returns 1 if there is a next block, 0 at the end of the chain (or if it is malformed)
+ */
+int smb_message_andx_next(const smb_message *msg, size_t *block, uint8_t *cmd);
+
 #pragma mark - smbMessageFlag
 void smb_message_flag(smb_message *msg, uint32_t flag, int value);
 @end
@@ -206,6 +206,56 @@ void smb_message_set_andx_members(smb_message *msg)
     req->andx_offset    = 0;
 }
 
+#pragma mark - smbMessageChain
+int smb_message_chain(smb_message *msg, size_t block, uint8_t cmd)
+{
+    // This could have been any type with the 'SMB_ANDX_MEMBERS';
+    smb_session_req   *req;
+    
+    if (msg == NULL)
+        return -1;
+    
+    // Next command starts on a 4 bytes boundary (counted from the header)
+    while ((sizeof(smb_header) + msg->cursor) % 4)
+        if (!smb_message_put8(msg, 0))
+            return 0;
+    
+    req = (smb_session_req *)(msg->packet->payload + block);
+    req->andx           = cmd;
+    req->andx_reserved  = 0;
+    req->andx_offset    = sizeof(smb_header) + msg->cursor;
+    
+    return 1;
+}
+
+#pragma mark - smbMessageAndxNext
+int smb_message_andx_next(const smb_message *msg, size_t *block, uint8_t *cmd)
+{
+    const smb_session_req *req;
+    size_t                next;
+    
+    if (msg == NULL || msg->packet == NULL || block == NULL || cmd == NULL)
+        return 0;
+    
+    // The current block must at least hold its wct and AndX members
+    if (*block + 1 + 4 > msg->payload_size)
+        return 0;
+    req = (const smb_session_req *)(msg->packet->payload + *block);
+    if (req->wct < 2 || req->andx == 0xff)
+        return 0;
+    
+    // Blocks only go forward, which also rules out loops
+    next = req->andx_offset - sizeof(smb_header);
+    if (req->andx_offset < sizeof(smb_header) || next <= *block
+        || next >= msg->payload_size)
+        return 0;
+    
+    *block = next;
+    *cmd   = req->andx;
+    
+    return 1;
+}
+
 #pragma mark - smbMessageFlag
 void smb_message_flag(smb_message *msg, uint32_t flag, int value)
 {
@@ -0,0 +1,48 @@
+//
+//  smbMockServer.h
+//  test
+//
+//  Created by trekvn on 4/14/17.
+//  Copyright © 2017 trekvn. All rights reserved.
+//
+// A file server has no place in a shipped library, Debug builds only
+#if defined(__OBJC__) && defined(DEBUG)
+#import <Foundation/Foundation.h>
+#import "smbHeader.h"
+
+// Largest answer of the server: a READ_ANDX of SMB_IO_LARGE_MAX bytes, with
+// room for the headers
+#define SMB_MOCK_SERVER_MAX_ANSWER      (SMB_IO_LARGE_MAX + 1024)
+// Files and searches (FIND_FIRST2 not ended) that can be open at once
+#define SMB_MOCK_SERVER_MAX_FILES       (256)
+#define SMB_MOCK_SERVER_MAX_SEARCHES    (16)
+
+typedef struct smb_mock_server_s smb_mock_server;
+
+@interface smbMockServer : NSObject
+#pragma mark - smbMockServerNew
+/*!Create a minimal SMB1 server sharing a local directory
+ * It answers NEGOTIATE, SESSION_SETUP, TREE_CONNECT, CREATE_DIRECTORY, DELETE_DIRECTORY, DELETE, NT_CREATE, READ_ANDX, WRITE_ANDX, CLOSE, FLUSH and TRANS2 FIND_FIRST2, FIND_NEXT2, QUERY_PATH_INFO and SET_FILE_INFO, the rest with NT_STATUS_NOT_IMPLEMENTED. Any credentials are accepted, any share name is the directory, and no oplock is granted.
+ * It is meant for tests and benchmarks of the client (see smb_transport_loopback()), it has no network side.
+ *\param root The directory to share
+ *\returns The server, or NULL if 'root' can't be opened
+ */
+smb_mock_server *smb_mock_server_new(const char *root);
+
+#pragma mark - smbMockServerDestroy
+/*!Release a server, closing the files and searches left open
+ */
+void smb_mock_server_destroy(smb_mock_server *srv);
+
+#pragma mark - smbMockServerProcess
+/*!Process a request and build its answer
+ *\param srv The server
+ *\param req The request, an SMB message without the transport header
+ *\param req_size Its size
+ *\param answer Where to build the answer, #SMB_MOCK_SERVER_MAX_ANSWER bytes
+ *\returns The size of the answer, 0 if the request has none (oplock acknowledgement), -1 if it isn't an SMB message
+ */
+ssize_t smb_mock_server_process(smb_mock_server *srv, const void *req,
+                                size_t req_size, void *answer);
+@end
+#endif
@@ -0,0 +1,1196 @@
+//
+//  smbMockServer.m
+//  test
+//
+//  Created by trekvn on 4/14/17.
+//  Copyright © 2017 trekvn. All rights reserved.
+//
+
+#import <dirent.h>
+#import <fcntl.h>
+#import <fnmatch.h>
+#import <sys/stat.h>
+#import <time.h>
+
+#import "config.h"
+#import "smbMockServer.h"
+
+#if defined(__linux__) && defined(HAVE_LINUX_OPENAT2_H)
+#   import <linux/openat2.h>
+#   import <sys/syscall.h>
+#endif
+
+#ifdef DEBUG
+
+// Seconds from the Windows epoch (1601) to the UNIX one (1970)
+#define SMB_MOCK_EPOCH_DELTA    (11644473600ULL)
+// The share, and the user everybody is logged in as
+#define SMB_MOCK_TID            (1)
+#define SMB_MOCK_UID            (100)
+// The fid given to the commands chained to an NT_CREATE
+#define SMB_MOCK_CHAINED_FID    (0xffff)
+
+typedef struct
+{
+    DIR                 *dir;           // NULL if the slot is free
+    char                *pattern;       // What the names are matched against
+} smb_mock_search;
+
+struct smb_mock_server_s
+{
+    int                 root;           // The shared directory
+    int                 files[SMB_MOCK_SERVER_MAX_FILES];   // fid - 1 -> fd, -1 if free
+    smb_mock_search     searches[SMB_MOCK_SERVER_MAX_SEARCHES]; // sid - 1
+};
+
+// A request being processed, one of its (chained) commands at a time
+typedef struct
+{
+    smb_mock_server     *srv;
+    const smb_packet    *req;
+    size_t              req_size;       // Size of the request payload
+    size_t              block;          // Offset of the command in it
+    smb_packet          *ans;
+    size_t              out;            // Offset of the answer of the command in its payload
+    uint16_t            fid;            // The file an NT_CREATE opened, for the next commands
+    uint32_t            status;
+} smb_mock_call;
+
+static uint32_t mock_status(int err)
+{
+    switch (err)
+    {
+        case ENOENT:
+            return NT_STATUS_OBJECT_NAME_NOT_FOUND;
+        case ENOTDIR:
+            return NT_STATUS_OBJECT_PATH_NOT_FOUND;
+        case EEXIST:
+            return NT_STATUS_OBJECT_NAME_COLLISION;
+        case EISDIR:
+            return NT_STATUS_FILE_IS_A_DIRECTORY;
+        case ENOTEMPTY:
+            return NT_STATUS_DIRECTORY_NOT_EMPTY;
+        case EMFILE:
+        case ENFILE:
+            return NT_STATUS_TOO_MANY_OPENED_FILES;
+        case ENOMEM:
+        case ENOSPC:
+            return NT_STATUS_INSUFF_SERVER_RESOURCES;
+        default:
+            return NT_STATUS_ACCESS_DENIED;
+    }
+}
+
+static uint64_t mock_time(time_t t)
+{
+    return ((uint64_t)t + SMB_MOCK_EPOCH_DELTA) * 10000000;
+}
+
+static uint32_t mock_attr(const struct stat *st)
+{
+    return S_ISDIR(st->st_mode) ? SMB_ATTR_DIR : SMB_ATTR_ARCHIVE;
+}
+
+// The command of the call, if the request holds at least 'size' bytes of it
+static const void *mock_request(smb_mock_call *c, size_t size)
+{
+    if (c->block + size > c->req_size)
+    {
+        c->status = NT_STATUS_INVALID_PARAMETER;
+        return NULL;
+    }
+    
+    return c->req->payload + c->block;
+}
+
+// Where the answer of the command goes, and how much of it fits
+static void *mock_answer(smb_mock_call *c)
+{
+    return c->ans->payload + c->out;
+}
+
+static size_t mock_answer_room(smb_mock_call *c)
+{
+    return SMB_MOCK_SERVER_MAX_ANSWER - sizeof(smb_packet) - c->out;
+}
+
+static size_t mock_answer_empty(smb_mock_call *c)
+{
+    memset(mock_answer(c), 0, sizeof(smb_simple_struct));
+    
+    return sizeof(smb_simple_struct);
+}
+
+// The slot of an open file, NULL if 'fid' isn't one
+static int *mock_file_slot(smb_mock_call *c, uint16_t fid)
+{
+    if (fid == SMB_MOCK_CHAINED_FID)
+        fid = c->fid;
+    if (fid == 0 || fid > SMB_MOCK_SERVER_MAX_FILES
+        || c->srv->files[fid - 1] < 0)
+        return NULL;
+    
+    return &c->srv->files[fid - 1];
+}
+
+// The descriptor of an open file, -1 if 'fid' isn't one
+static int mock_file(smb_mock_call *c, uint16_t fid)
+{
+    int *slot = mock_file_slot(c, fid);
+    
+    return slot != NULL ? *slot : -1;
+}
+
+// Converts a path of a request (UTF-16, from the root of the share, with
+// '\' separators) to a path relative to the shared directory
+static uint32_t mock_path(const uint8_t *name, size_t len, char **path)
+{
+    char        *p, *part;
+    size_t      res;
+    
+    len &= ~(size_t)1;
+    while (len >= 2 && name[len - 2] == 0 && name[len - 1] == 0)
+        len -= 2;
+    
+    // The root of the share
+    if (len == 0)
+        return (*path = strdup(".")) != NULL ? NT_STATUS_SUCCESS
+                                             : NT_STATUS_INSUFF_SERVER_RESOURCES;
+    
+    if ((res = smb_from_utf16((const char *)name, len, path)) == 0)
+        return NT_STATUS_OBJECT_PATH_SYNTAX_BAD;
+    (*path)[res] = 0;
+    
+    for (p = *path; *p; p++)
+        if (*p == '\\')
+            *p = '/';
+    
+    // Nothing out of the shared directory
+    for (part = *path; part != NULL; part = strchr(part, '/'))
+    {
+        while (*part == '/')
+            part++;
+        if (part[0] == '.' && part[1] == '.' && (part[2] == '/' || part[2] == 0))
+        {
+            free(*path);
+            return NT_STATUS_OBJECT_PATH_SYNTAX_BAD;
+        }
+    }
+    
+    // The leading separators
+    for (p = *path; *p == '/'; p++)
+        ;
+    if (*p == 0)
+        p = ".";
+    memmove(*path, p, strlen(p) + 1);
+    
+    return NT_STATUS_SUCCESS;
+}
+
+// Opens a directory of the share ('dir' as given by mock_path()) without
+// following any symlink, so that nothing out of the shared directory is
+// reached. 'dir' may be modified.
+static int mock_open_dir(smb_mock_server *srv, char *dir)
+{
+    char        *part, *next;
+    int         fd, sub, err;
+    
+#if defined(__linux__) && defined(HAVE_LINUX_OPENAT2_H) && defined(SYS_openat2)
+    struct open_how how;
+    
+    memset(&how, 0, sizeof(how));
+    how.flags   = O_RDONLY | O_DIRECTORY;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS;
+    if ((fd = (int)syscall(SYS_openat2, srv->root, dir, &how, sizeof(how))) >= 0
+        || errno != ENOSYS)
+        return fd;
+#endif
+    
+    // One component at a time where openat2() isn't available
+    if ((fd = openat(srv->root, ".", O_RDONLY | O_DIRECTORY)) < 0)
+        return -1;
+    for (part = dir; part != NULL && *part; part = next)
+    {
+        if ((next = strchr(part, '/')) != NULL)
+            *next++ = 0;
+        if (*part == 0)
+            continue;
+        
+        sub = openat(fd, part, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        err = errno;
+        close(fd);
+        if (sub < 0)
+        {
+            errno = err;
+            return -1;
+        }
+        fd = sub;
+    }
+    
+    return fd;
+}
+
+// Opens the directory holding the last component of 'path' with
+// mock_open_dir(), and points 'name' to that component. The caller accesses
+// it without following it if it is a symlink.
+static int mock_open_parent(smb_mock_server *srv, char *path, const char **name)
+{
+    char        *slash;
+    
+    if ((slash = strrchr(path, '/')) == NULL)
+    {
+        *name = path;
+        return openat(srv->root, ".", O_RDONLY | O_DIRECTORY);
+    }
+    
+    *slash = 0;
+    *name  = slash + 1;
+    
+    return mock_open_dir(srv, path);
+}
+
+static size_t mock_negotiate(smb_mock_call *c)
+{
+    const char          *dialects[] = SMB_DIALECTS;
+    const smb_nego_req  *req;
+    smb_nego_resp       *nego;
+    const char          *p, *end;
+    uint16_t            index = 0xffff;
+    
+    if ((req = mock_request(c, sizeof(smb_nego_req))) == NULL)
+        return 0;
+    
+    p   = req->dialects;
+    end = (const char *)c->req->payload + c->req_size;
+    for (uint16_t i = 0; p < end && memchr(p, 0, end - p) != NULL; i++)
+    {
+        if (strcmp(p, dialects[SMB_DIALECT_NTLM]) == 0)
+            index = i;
+        p += strlen(p) + 1;
+    }
+    
+    nego = mock_answer(c);
+    memset(nego, 0, sizeof(smb_nego_resp));
+    nego->wct             = 17;
+    nego->dialect_index   = index;
+    nego->security_mode   = 3;    // User level, challenge/response
+    nego->max_mpx         = 50;
+    nego->max_vcs         = 1;
+    nego->max_bufsize     = SMB_SESSION_MAX_BUFFER;
+    nego->max_rawbuffer   = 0x10000;
+    nego->caps            = SMB_CAPS_UNICODE | SMB_CAPS_NTSMB | SMB_CAPS_LARGE
+                            | SMB_CAPS_LARGE_READX | SMB_CAPS_LARGE_WRITEX;
+    nego->ts              = mock_time(time(NULL));
+    nego->key_length      = sizeof(nego->challenge);
+    nego->bct             = sizeof(nego->challenge);
+    nego->challenge       = 0x1122334455667788ULL;
+    
+    return sizeof(smb_nego_resp);
+}
+
+static size_t mock_setup(smb_mock_call *c)
+{
+    smb_session_resp    *resp;
+    
+    if (mock_request(c, sizeof(smb_session_req)) == NULL)
+        return 0;
+    
+    c->ans->header.uid = SMB_MOCK_UID;
+    
+    resp = mock_answer(c);
+    memset(resp, 0, sizeof(smb_session_resp));
+    resp->wct   = 3;
+    resp->andx  = 0xff;
+    
+    return sizeof(smb_session_resp);
+}
+
+static size_t mock_tree_connect(smb_mock_call *c)
+{
+    static const char       service[] = "A:";
+    smb_tree_connect_resp   *resp;
+    
+    if (mock_request(c, sizeof(smb_tree_connect_req)) == NULL)
+        return 0;
+    
+    c->ans->header.tid = SMB_MOCK_TID;
+    
+    resp = mock_answer(c);
+    memset(resp, 0, sizeof(smb_tree_connect_resp));
+    resp->wct           = 7;
+    resp->andx          = 0xff;
+    resp->opt_support   = 1;
+    resp->max_rights    = 0x1f01ff;
+    resp->bct           = sizeof(service);
+    memcpy(resp->payload, service, sizeof(service));
+    
+    return sizeof(smb_tree_connect_resp) + sizeof(service);
+}
+
+static int mock_open_flags(uint32_t disposition)
+{
+    switch (disposition)
+    {
+        case SMB_DISPOSITION_FILE_SUPERSEDE:
+        case SMB_DISPOSITION_FILE_OVERWRITE_IF:
+            return O_CREAT | O_TRUNC;
+        case SMB_DISPOSITION_FILE_OPEN:
+            return 0;
+        case SMB_DISPOSITION_FILE_CREATE:
+            return O_CREAT | O_EXCL;
+        case SMB_DISPOSITION_FILE_OPEN_IF:
+            return O_CREAT;
+        case SMB_DISPOSITION_FILE_OVERWRITE:
+            return O_TRUNC;
+        default:
+            return -1;
+    }
+}
+
+static size_t mock_create(smb_mock_call *c)
+{
+    const smb_create_req    *req;
+    smb_create_resp         *resp;
+    struct stat             st;
+    char                    *path;
+    const char              *name;
+    bool                    existed;
+    int                     flags, dir, fd = -1;
+    uint16_t                fid;
+    
+    if ((req = mock_request(c, sizeof(smb_create_req))) == NULL)
+        return 0;
+    // The path follows an alignment byte
+    if (mock_request(c, sizeof(smb_create_req) + 1 + req->path_length) == NULL)
+        return 0;
+    if ((flags = mock_open_flags(req->disposition)) < 0)
+    {
+        c->status = NT_STATUS_INVALID_PARAMETER;
+        return 0;
+    }
+    
+    for (fid = 1; fid <= SMB_MOCK_SERVER_MAX_FILES; fid++)
+        if (c->srv->files[fid - 1] < 0)
+            break;
+    if (fid > SMB_MOCK_SERVER_MAX_FILES)
+    {
+        c->status = NT_STATUS_TOO_MANY_OPENED_FILES;
+        return 0;
+    }
+    
+    if ((c->status = mock_path(req->path + 1, req->path_length, &path)))
+        return 0;
+    
+    // A symlink is never followed, opening one fails with ELOOP
+    dir     = mock_open_parent(c->srv, path, &name);
+    existed = dir >= 0 && fstatat(dir, name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+    if (existed && S_ISDIR(st.st_mode))
+    {
+        // Directories are only opened, to be queried
+        if (flags & O_EXCL)
+            errno = EEXIST;
+        else if (flags & O_TRUNC)
+            errno = EISDIR;
+        else
+            fd = openat(dir, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    }
+    else if (dir >= 0)
+    {
+        fd = openat(dir, name, O_RDWR | O_NOFOLLOW | flags, 0644);
+        if (fd < 0 && errno == EACCES && !(flags & (O_CREAT | O_TRUNC)))
+            fd = openat(dir, name, O_RDONLY | O_NOFOLLOW);
+    }
+    if (dir >= 0)
+        close(dir);
+    free(path);
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        c->status = mock_status(errno);
+        if (fd >= 0)
+            close(fd);
+        return 0;
+    }
+    
+    c->srv->files[fid - 1] = fd;
+    c->fid = fid;
+    
+    resp = mock_answer(c);
+    memset(resp, 0, sizeof(smb_create_resp));
+    resp->wct           = 34;
+    resp->andx          = 0xff;
+    resp->fid           = fid;
+    resp->action        = existed ? 1 : 2;  // Opened, created
+    resp->created       = mock_time(st.st_mtime);
+    resp->accessed      = mock_time(st.st_atime);
+    resp->written       = mock_time(st.st_mtime);
+    resp->changed       = mock_time(st.st_ctime);
+    resp->attr          = mock_attr(&st);
+    resp->alloc_size    = (uint64_t)st.st_blocks * 512;
+    resp->size          = st.st_size;
+    resp->is_dir        = S_ISDIR(st.st_mode);
+    
+    return sizeof(smb_create_resp);
+}
+
+// The path closing a MKDIR, RMDIR or RMFILE request, after its 'size' bytes
+// of words and buffer format ('bct' counts the latter)
+static uint32_t mock_request_path(smb_mock_call *c, size_t size, uint16_t bct,
+                                  char **path)
+{
+    if (bct < 1 || mock_request(c, size + bct - 1) == NULL)
+        return NT_STATUS_INVALID_PARAMETER;
+    
+    return mock_path(c->req->payload + c->block + size, bct - 1, path);
+}
+
+static size_t mock_mkdir(smb_mock_call *c)
+{
+    const smb_directory_mk_req  *req;
+    char                        *path;
+    const char                  *name;
+    int                         dir, res = -1;
+    
+    if ((req = mock_request(c, sizeof(smb_directory_mk_req))) == NULL)
+        return 0;
+    if ((c->status = mock_request_path(c, sizeof(smb_directory_mk_req), req->bct, &path)))
+        return 0;
+    
+    if ((dir = mock_open_parent(c->srv, path, &name)) >= 0)
+    {
+        res = mkdirat(dir, name, 0755);
+        close(dir);
+    }
+    free(path);
+    if (res < 0)
+    {
+        c->status = mock_status(errno);
+        return 0;
+    }
+    
+    return mock_answer_empty(c);
+}
+
+// RMDIR, or RMFILE if not 'dir'
+static size_t mock_remove(smb_mock_call *c, bool dir)
+{
+    const smb_directory_rm_req  *rmdir;
+    const smb_file_rm_req       *rm;
+    char                        *path;
+    const char                  *name;
+    int                         fd, res = -1;
+    
+    if (dir)
+    {
+        if ((rmdir = mock_request(c, sizeof(smb_directory_rm_req))) == NULL)
+            return 0;
+        c->status = mock_request_path(c, sizeof(smb_directory_rm_req), rmdir->bct, &path);
+    }
+    else
+    {
+        if ((rm = mock_request(c, sizeof(smb_file_rm_req))) == NULL)
+            return 0;
+        c->status = mock_request_path(c, sizeof(smb_file_rm_req), rm->bct, &path);
+    }
+    if (c->status)
+        return 0;
+    
+    // A symlink is removed, not what it points to
+    if ((fd = mock_open_parent(c->srv, path, &name)) >= 0)
+    {
+        res = unlinkat(fd, name, dir ? AT_REMOVEDIR : 0);
+        close(fd);
+    }
+    free(path);
+    if (res < 0)
+    {
+        c->status = mock_status(errno);
+        return 0;
+    }
+    
+    return mock_answer_empty(c);
+}
+
+static size_t mock_read(smb_mock_call *c)
+{
+    const smb_read_req  *req;
+    smb_read_resp       *resp;
+    size_t              count, room;
+    uint64_t            offset;
+    ssize_t             res;
+    int                 fd;
+    
+    if ((req = mock_request(c, sizeof(smb_read_req))) == NULL)
+        return 0;
+    if ((fd = mock_file(c, req->fid)) < 0)
+    {
+        c->status = NT_STATUS_INVALID_HANDLE;
+        return 0;
+    }
+    
+    // The data follows a padding byte
+    count  = req->max_count | ((size_t)(req->max_count_high & 0xffff) << 16);
+    room   = mock_answer_room(c) - sizeof(smb_read_resp) - 1;
+    count  = count < room ? count : room;
+    offset = req->offset | ((uint64_t)req->offset_high << 32);
+    
+    resp = mock_answer(c);
+    res  = pread(fd, (uint8_t *)resp + sizeof(smb_read_resp) + 1, count, offset);
+    if (res < 0 || (res == 0 && count > 0))
+    {
+        c->status = res < 0 ? mock_status(errno) : NT_STATUS_END_OF_FILE;
+        return 0;
+    }
+    
+    memset(resp, 0, sizeof(smb_read_resp) + 1);
+    resp->wct           = 12;
+    resp->andx          = 0xff;
+    resp->data_len      = res & 0xffff;
+    resp->data_len_high = (uint32_t)(res >> 16);
+    resp->data_offset   = sizeof(smb_header) + c->out + sizeof(smb_read_resp) + 1;
+    resp->bct           = (uint16_t)(res + 1);
+    
+    return sizeof(smb_read_resp) + 1 + res;
+}
+
+static size_t mock_write(smb_mock_call *c)
+{
+    const smb_write_req *req;
+    smb_write_resp      *resp;
+    size_t              count, pos;
+    uint64_t            offset;
+    ssize_t             res;
+    int                 fd;
+    
+    if ((req = mock_request(c, sizeof(smb_write_req))) == NULL)
+        return 0;
+    if ((fd = mock_file(c, req->fid)) < 0)
+    {
+        c->status = NT_STATUS_INVALID_HANDLE;
+        return 0;
+    }
+    
+    count  = req->data_len | ((size_t)req->data_len_high << 16);
+    pos    = req->data_offset - sizeof(smb_header);
+    offset = req->offset | ((uint64_t)req->offset_high << 32);
+    if (req->data_offset < sizeof(smb_header) || pos + count > c->req_size)
+    {
+        c->status = NT_STATUS_INVALID_PARAMETER;
+        return 0;
+    }
+    
+    if ((res = pwrite(fd, c->req->payload + pos, count, offset)) < 0)
+    {
+        c->status = mock_status(errno);
+        return 0;
+    }
+    
+    resp = mock_answer(c);
+    memset(resp, 0, sizeof(smb_write_resp));
+    resp->wct           = 6;
+    resp->andx          = 0xff;
+    resp->data_len      = res & 0xffff;
+    resp->data_len_high = (uint16_t)(res >> 16);
+    
+    return sizeof(smb_write_resp);
+}
+
+static size_t mock_close(smb_mock_call *c)
+{
+    const smb_close_req *req;
+    int                 *slot;
+    
+    if ((req = mock_request(c, sizeof(smb_close_req))) == NULL)
+        return 0;
+    if ((slot = mock_file_slot(c, req->fid)) == NULL)
+    {
+        c->status = NT_STATUS_INVALID_HANDLE;
+        return 0;
+    }
+    
+    close(*slot);
+    *slot = -1;
+    
+    return mock_answer_empty(c);
+}
+
+static size_t mock_flush(smb_mock_call *c)
+{
+    const smb_flush_req *req;
+    
+    if ((req = mock_request(c, sizeof(smb_flush_req))) == NULL)
+        return 0;
+    // The data is handed to the system as it comes, there is nothing to wait
+    // for (and a fsync() would only measure the disk)
+    if (req->fid != 0xffff && mock_file(c, req->fid) < 0)
+    {
+        c->status = NT_STATUS_INVALID_HANDLE;
+        return 0;
+    }
+    
+    return mock_answer_empty(c);
+}
+
+static void mock_search_close(smb_mock_search *search)
+{
+    if (search->dir != NULL)
+        closedir(search->dir);
+    free(search->pattern);
+    search->dir     = NULL;
+    search->pattern = NULL;
+}
+
+// The parameters of a TRANS2 answer follow its words, and the data follows
+// them on a 4 bytes boundary
+static uint8_t *mock_trans2_params(smb_mock_call *c)
+{
+    return (uint8_t *)mock_answer(c) + sizeof(smb_trans2_resp);
+}
+
+static size_t mock_trans2_pad(size_t param_count)
+{
+    return (4 - param_count % 4) % 4;
+}
+
+static uint8_t *mock_trans2_data(smb_mock_call *c, size_t param_count)
+{
+    return mock_trans2_params(c) + param_count + mock_trans2_pad(param_count);
+}
+
+static size_t mock_trans2_answer(smb_mock_call *c, size_t param_count,
+                                 size_t data_count)
+{
+    smb_trans2_resp *resp;
+    size_t          pad = mock_trans2_pad(param_count);
+    
+    resp = mock_answer(c);
+    memset(resp, 0, sizeof(smb_trans2_resp));
+    memset(mock_trans2_params(c) + param_count, 0, pad);
+    resp->wct                 = 10;
+    resp->total_param_count   = param_count;
+    resp->total_data_count    = data_count;
+    resp->param_count         = param_count;
+    resp->param_offset        = sizeof(smb_header) + c->out + sizeof(smb_trans2_resp);
+    resp->data_count          = data_count;
+    resp->data_offset         = resp->param_offset + param_count + pad;
+    resp->bct                 = sizeof(resp->padding) + param_count + pad + data_count;
+    
+    return sizeof(smb_trans2_resp) + param_count + pad + data_count;
+}
+
+// Fills 'data' with the next entries of a search, in the
+// SMB_FIND2_INTEREST_BOTH_DIRECTORY_INFO format. Returns their number.
+static size_t mock_find_entries(smb_mock_search *search, uint8_t *data,
+                                size_t max, size_t count, size_t *size,
+                                uint16_t *last, bool *eos)
+{
+    smb_tr2_find2_entry *entry, *prev = NULL;
+    struct dirent       *ent;
+    struct stat         st;
+    char                *name;
+    size_t              name_len, entry_size, used = 0, n = 0;
+    long                pos;
+    
+    *last = 0;
+    *eos  = false;
+    while (n < count)
+    {
+        pos = telldir(search->dir);
+        if ((ent = readdir(search->dir)) == NULL)
+        {
+            *eos = true;
+            break;
+        }
+        // Symlinks are left out, mock_create() doesn't follow them
+        if (fnmatch(search->pattern, ent->d_name, 0) != 0
+            || fstatat(dirfd(search->dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0
+            || S_ISLNK(st.st_mode))
+            continue;
+        if ((name_len = smb_to_utf16(ent->d_name, strlen(ent->d_name), &name)) == 0)
+            continue;
+        
+        // Entries start on 8 bytes boundaries
+        entry_size = (sizeof(smb_tr2_find2_entry) + name_len + 7) & ~(size_t)7;
+        if (used + entry_size > max)
+        {
+            // For the next FIND_NEXT2
+            seekdir(search->dir, pos);
+            free(name);
+            break;
+        }
+        
+        entry = (smb_tr2_find2_entry *)(data + used);
+        memset(entry, 0, entry_size);
+        entry->index      = (uint32_t)n;
+        entry->created    = mock_time(st.st_mtime);
+        entry->accessed   = mock_time(st.st_atime);
+        entry->written    = mock_time(st.st_mtime);
+        entry->changed    = mock_time(st.st_ctime);
+        entry->size       = st.st_size;
+        entry->alloc_size = (uint64_t)st.st_blocks * 512;
+        entry->attr       = mock_attr(&st);
+        entry->name_len   = (uint32_t)name_len;
+        memcpy(entry->name, name, name_len);
+        free(name);
+        
+        if (prev != NULL)
+            prev->next_entry = (uint32_t)((uint8_t *)entry - (uint8_t *)prev);
+        prev  = entry;
+        *last = (uint16_t)used;
+        used += entry_size;
+        n++;
+    }
+    *size = used;
+    
+    return n;
+}
+
+// The most data a FIND_FIRST2/FIND_NEXT2 answer can have after its parameters
+static size_t mock_find_max(smb_mock_call *c, const smb_trans2_req *tr2,
+                            size_t param_count)
+{
+    size_t  max = mock_answer_room(c) - sizeof(smb_trans2_resp) - param_count;
+    
+    return tr2->max_data_count < max ? tr2->max_data_count : max;
+}
+
+static size_t mock_find_first(smb_mock_call *c, const smb_trans2_req *tr2,
+                              const uint8_t *params, size_t param_count)
+{
+    const smb_tr2_findfirst2    *find = (const smb_tr2_findfirst2 *)params;
+    smb_tr2_findfirst2_params   *resp;
+    smb_mock_search             *search;
+    char                        *path, *pattern;
+    size_t                      count, size;
+    uint16_t                    sid, last;
+    bool                        eos;
+    int                         fd;
+    
+    if (param_count < sizeof(smb_tr2_findfirst2))
+    {
+        c->status = NT_STATUS_INVALID_PARAMETER;
+        return 0;
+    }
+    if (find->interest != SMB_FIND2_INTEREST_BOTH_DIRECTORY_INFO)
+    {
+        c->status = NT_STATUS_NOT_IMPLEMENTED;
+        return 0;
+    }
+    
+    for (sid = 1; sid <= SMB_MOCK_SERVER_MAX_SEARCHES; sid++)
+        if (c->srv->searches[sid - 1].dir == NULL)
+            break;
+    if (sid > SMB_MOCK_SERVER_MAX_SEARCHES)
+    {
+        c->status = NT_STATUS_INSUFF_SERVER_RESOURCES;
+        return 0;
+    }
+    search = &c->srv->searches[sid - 1];
+    
+    if ((c->status = mock_path(find->pattern, param_count - sizeof(smb_tr2_findfirst2),
+                               &path)))
+        return 0;
+    
+    // The last part of the path is the pattern, the rest the directory
+    if ((pattern = strrchr(path, '/')) != NULL)
+        *pattern++ = 0;
+    else
+        pattern = path;
+    search->pattern = strdup(strcmp(pattern, "*.*") ? pattern : "*");
+    if (pattern == path)
+        fd = openat(c->srv->root, ".", O_RDONLY | O_DIRECTORY);
+    else
+        fd = mock_open_dir(c->srv, path);
+    free(path);
+    if (fd < 0 || search->pattern == NULL
+        || (search->dir = fdopendir(fd)) == NULL)
+    {
+        c->status = fd < 0 ? mock_status(errno) : NT_STATUS_INSUFF_SERVER_RESOURCES;
+        if (fd >= 0)
+            close(fd);
+        mock_search_close(search);
+        return 0;
+    }
+    
+    resp  = (smb_tr2_findfirst2_params *)mock_trans2_params(c);
+    count = mock_find_entries(search, mock_trans2_data(c, sizeof(*resp)),
+                              mock_find_max(c, tr2, sizeof(*resp)),
+                              find->count, &size, &last, &eos);
+    if (count == 0 && eos)
+    {
+        mock_search_close(search);
+        c->status = NT_STATUS_NO_SUCH_FILE;
+        return 0;
+    }
+    if ((eos && (find->flags & SMB_FIND2_FLAG_CLOSE_EOS))
+        || (find->flags & SMB_FIND2_FLAG_CLOSE))
+        mock_search_close(search);
+    
+    memset(resp, 0, sizeof(*resp));
+    resp->eid               = sid;
+    resp->count             = count;
+    resp->eos               = eos;
+    resp->last_name_offset  = last;
+    
+    return mock_trans2_answer(c, sizeof(*resp), size);
+}
+
+static size_t mock_find_next(smb_mock_call *c, const smb_trans2_req *tr2,
+                             const uint8_t *params, size_t param_count)
+{
+    const smb_tr2_findnext2     *find = (const smb_tr2_findnext2 *)params;
+    smb_tr2_findnext2_params    *resp;
+    smb_mock_search             *search;
+    size_t                      count, size;
+    uint16_t                    last;
+    bool                        eos;
+    
+    if (param_count < sizeof(smb_tr2_findnext2))
+    {
+        c->status = NT_STATUS_INVALID_PARAMETER;
+        return 0;
+    }
+    if (find->interest != SMB_FIND2_INTEREST_BOTH_DIRECTORY_INFO)
+    {
+        c->status = NT_STATUS_NOT_IMPLEMENTED;
+        return 0;
+    }
+    if (find->sid == 0 || find->sid > SMB_MOCK_SERVER_MAX_SEARCHES
+        || c->srv->searches[find->sid - 1].dir == NULL)
+    {
+        c->status = NT_STATUS_INVALID_HANDLE;
+        return 0;
+    }
+    search = &c->srv->searches[find->sid - 1];
+    
+    // The search goes on from where the previous answer stopped, whatever
+    // the resume key
+    resp  = (smb_tr2_findnext2_params *)mock_trans2_params(c);
+    count = mock_find_entries(search, mock_trans2_data(c, sizeof(*resp)),
+                              mock_find_max(c, tr2, sizeof(*resp)),
+                              find->count, &size, &last, &eos);
+    if ((eos && (find->flags & SMB_FIND2_FLAG_CLOSE_EOS))
+        || (find->flags & SMB_FIND2_FLAG_CLOSE))
+        mock_search_close(search);
+    
+    memset(resp, 0, sizeof(*resp));
+    resp->count             = count;
+    resp->eos               = eos;
+    resp->last_name_offset  = last;
+    
+    return mock_trans2_answer(c, sizeof(*resp), size);
+}
+
+static size_t mock_query_path(smb_mock_call *c, const uint8_t *params,
+                              size_t param_count)
+{
+    const smb_tr2_query *query = (const smb_tr2_query *)params;
+    smb_tr2_path_info   *info;
+    struct stat         st;
+    char                *path;
+    const char          *name;
+    size_t              name_len, param_size = sizeof(uint16_t);
+    int                 dir, res = -1;
+    
+    if (param_count < sizeof(smb_tr2_query))
+    {
+        c->status = NT_STATUS_INVALID_PARAMETER;
+        return 0;
+    }
+    if (query->interest != SMB_FIND2_QUERY_FILE_ALL_INFO)
+    {
+        c->status = NT_STATUS_NOT_IMPLEMENTED;
+        return 0;
+    }
+    
+    name_len = param_count - sizeof(smb_tr2_query);
+    if ((c->status = mock_path(query->path, name_len, &path)))
+        return 0;
+    if ((dir = mock_open_parent(c->srv, path, &name)) >= 0)
+    {
+        res = fstatat(dir, name, &st, AT_SYMLINK_NOFOLLOW);
+        close(dir);
+    }
+    free(path);
+    if (res == 0 && S_ISLNK(st.st_mode))
+    {
+        errno = ELOOP;
+        res   = -1;
+    }
+    if (res < 0)
+    {
+        c->status = mock_status(errno);
+        return 0;
+    }
+    
+    // The name is given back as it was asked
+    while (name_len >= 2 && query->path[name_len - 2] == 0
+           && query->path[name_len - 1] == 0)
+        name_len -= 2;
+    if (sizeof(smb_trans2_resp) + 4 + sizeof(smb_tr2_path_info) + name_len
+        > mock_answer_room(c))
+    {
+        c->status = NT_STATUS_BUFFER_OVERFLOW;
+        return 0;
+    }
+    
+    // The only parameter is the offset of an EA error
+    memset(mock_trans2_params(c), 0, param_size);
+    info = (smb_tr2_path_info *)mock_trans2_data(c, param_size);
+    memset(info, 0, sizeof(smb_tr2_path_info));
+    info->created     = mock_time(st.st_mtime);
+    info->accessed    = mock_time(st.st_atime);
+    info->written     = mock_time(st.st_mtime);
+    info->changed     = mock_time(st.st_ctime);
+    info->attr        = mock_attr(&st);
+    info->alloc_size  = (uint64_t)st.st_blocks * 512;
+    info->size        = st.st_size;
+    info->link_count  = (uint32_t)st.st_nlink;
+    info->is_dir      = S_ISDIR(st.st_mode);
+    info->name_len    = (uint32_t)name_len;
+    memcpy(info->name, query->path, name_len);
+    
+    return mock_trans2_answer(c, param_size, sizeof(smb_tr2_path_info) + name_len);
+}
+
+static size_t mock_set_file_info(smb_mock_call *c, const uint8_t *params,
+                                 size_t param_count, const uint8_t *data,
+                                 size_t data_count)
+{
+    const smb_tr2_set_file_info *info = (const smb_tr2_set_file_info *)params;
+    struct stat                 st;
+    uint64_t                    size;
+    int                         fd;
+    
+    if (param_count < sizeof(smb_tr2_set_file_info) || data_count < sizeof(size))
+    {
+        c->status = NT_STATUS_INVALID_PARAMETER;
+        return 0;
+    }
+    if ((fd = mock_file(c, info->fid)) < 0)
+    {
+        c->status = NT_STATUS_INVALID_HANDLE;
+        return 0;
+    }
+    memcpy(&size, data, sizeof(size));
+    
+    switch (info->interest)
+    {
+        case SMB_SET_FILE_END_OF_FILE_INFO:
+            break;
+        case SMB_SET_FILE_ALLOCATION_INFO:
+            // Nothing is reserved, but a smaller allocation cuts the file
+            if (fstat(fd, &st) < 0 || size >= (uint64_t)st.st_size)
+                size = UINT64_MAX;
+            break;
+        default:
+            c->status = NT_STATUS_NOT_IMPLEMENTED;
+            return 0;
+    }
+    if (size != UINT64_MAX && ftruncate(fd, (off_t)size) < 0)
+    {
+        c->status = mock_status(errno);
+        return 0;
+    }
+    
+    memset(mock_trans2_params(c), 0, sizeof(uint16_t));
+    
+    return mock_trans2_answer(c, sizeof(uint16_t), 0);
+}
+
+static size_t mock_trans2(smb_mock_call *c)
+{
+    const smb_trans2_req    *tr2;
+    const uint8_t           *params, *data;
+    size_t                  param_pos, data_pos;
+    
+    if ((tr2 = mock_request(c, sizeof(smb_trans2_req))) == NULL)
+        return 0;
+    
+    param_pos = tr2->param_offset - sizeof(smb_header);
+    data_pos  = tr2->data_offset - sizeof(smb_header);
+    if (tr2->setup_count < 1 || tr2->param_offset < sizeof(smb_header)
+        || param_pos + tr2->param_count > c->req_size
+        || (tr2->data_count > 0 && (tr2->data_offset < sizeof(smb_header)
+                                    || data_pos + tr2->data_count > c->req_size)))
+    {
+        c->status = NT_STATUS_INVALID_PARAMETER;
+        return 0;
+    }
+    params = c->req->payload + param_pos;
+    data   = c->req->payload + data_pos;
+    
+    switch (tr2->cmd)
+    {
+        case SMB_TR2_FIND_FIRST:
+            return mock_find_first(c, tr2, params, tr2->param_count);
+        case SMB_TR2_FIND_NEXT:
+            return mock_find_next(c, tr2, params, tr2->param_count);
+        case SMB_TR2_QUERY_PATH:
+            return mock_query_path(c, params, tr2->param_count);
+        case SMB_TR2_SET_FILE_INFO:
+            return mock_set_file_info(c, params, tr2->param_count,
+                                      data, tr2->data_count);
+        default:
+            c->status = NT_STATUS_NOT_IMPLEMENTED;
+            return 0;
+    }
+}
+
+// Processes the command at 'c->block' of the request, and builds its answer
+// at 'c->out'. Returns the size of the answer, 0 if it failed ('c->status').
+static size_t mock_command(smb_mock_call *c, uint8_t cmd)
+{
+    switch (cmd)
+    {
+        case SMB_CMD_NEGOTIATE:
+            return mock_negotiate(c);
+        case SMB_CMD_SETUP:
+            return mock_setup(c);
+        case SMB_CMD_TREE_CONNECT:
+            return mock_tree_connect(c);
+        case SMB_CMD_TREE_DISCONNECT:
+            return mock_answer_empty(c);
+        case SMB_CMD_MKDIR:
+            return mock_mkdir(c);
+        case SMB_CMD_RMDIR:
+            return mock_remove(c, true);
+        case SMB_CMD_RMFILE:
+            return mock_remove(c, false);
+        case SMB_CMD_CREATE:
+            return mock_create(c);
+        case SMB_CMD_READ:
+            return mock_read(c);
+        case SMB_CMD_WRITE:
+            return mock_write(c);
+        case SMB_CMD_CLOSE:
+            return mock_close(c);
+        case SMB_CMD_FLUSH:
+            return mock_flush(c);
+        case SMB_CMD_TRANS2:
+            return mock_trans2(c);
+        default:
+            c->status = NT_STATUS_NOT_IMPLEMENTED;
+            return 0;
+    }
+}
+
+static bool mock_is_andx(uint8_t cmd)
+{
+    return cmd == SMB_CMD_SETUP || cmd == SMB_CMD_TREE_CONNECT
+           || cmd == SMB_CMD_CREATE || cmd == SMB_CMD_READ
+           || cmd == SMB_CMD_WRITE || cmd == SMB_CMD_LOCKING;
+}
+
+@implementation smbMockServer
+#pragma mark - smbMockServerNew
+smb_mock_server *smb_mock_server_new(const char *root)
+{
+    smb_mock_server *srv;
+    
+    assert(root != NULL);
+    
+    srv = calloc(1, sizeof(smb_mock_server));
+    if (!srv)
+        return NULL;
+    
+    if ((srv->root = open(root, O_RDONLY | O_DIRECTORY)) < 0)
+    {
+        free(srv);
+        return NULL;
+    }
+    for (size_t i = 0; i < SMB_MOCK_SERVER_MAX_FILES; i++)
+        srv->files[i] = -1;
+    
+    return srv;
+}
+
+#pragma mark - smbMockServerDestroy
+void smb_mock_server_destroy(smb_mock_server *srv)
+{
+    if (srv == NULL)
+        return;
+    
+    for (size_t i = 0; i < SMB_MOCK_SERVER_MAX_FILES; i++)
+        if (srv->files[i] >= 0)
+            close(srv->files[i]);
+    for (size_t i = 0; i < SMB_MOCK_SERVER_MAX_SEARCHES; i++)
+        mock_search_close(&srv->searches[i]);
+    close(srv->root);
+    free(srv);
+}
+
+#pragma mark - smbMockServerProcess
+ssize_t smb_mock_server_process(smb_mock_server *srv, const void *req,
+                                size_t req_size, void *answer)
+{
+    static const uint8_t    magic[4] = { 0xff, 0x53, 0x4d, 0x42 };
+    const smb_locking_req   *lock;
+    const smb_session_req   *andx;
+    smb_session_resp        *prev = NULL;
+    smb_mock_call           c;
+    uint8_t                 cmd;
+    size_t                  size;
+    
+    assert(srv != NULL && req != NULL && answer != NULL);
+    
+    if (req_size < sizeof(smb_packet) + sizeof(smb_simple_struct)
+        || memcmp(((const smb_packet *)req)->header.magic, magic, sizeof(magic)))
+        return -1;
+    
+    memset(&c, 0, sizeof(c));
+    c.srv       = srv;
+    c.req       = req;
+    c.req_size  = req_size - sizeof(smb_header);
+    c.ans       = answer;
+    c.ans->header         = c.req->header;
+    c.ans->header.flags   = 0x98;
+    c.ans->header.flags2  = 0xc843;
+    cmd = c.req->header.command;
+    
+    // Nobody waits for the acknowledgement of an oplock break
+    lock = mock_request(&c, sizeof(smb_locking_req));
+    if (cmd == SMB_CMD_LOCKING && lock != NULL
+        && (lock->type_of_lock & SMB_LOCK_OPLOCK_RELEASE)
+        && lock->num_locks == 0 && lock->num_unlocks == 0)
+        return 0;
+    
+    // The AndX chain goes on until a command fails, its status is the one
+    // of the answer then
+    for (;;)
+    {
+        c.status = NT_STATUS_SUCCESS;
+        size = mock_command(&c, cmd);
+        if (c.status != NT_STATUS_SUCCESS)
+        {
+            if (prev == NULL)
+                size = mock_answer_empty(&c);
+            break;
+        }
+        if (prev != NULL)
+        {
+            prev->andx        = cmd;
+            prev->andx_offset = sizeof(smb_header) + c.out;
+        }
+        prev   = mock_is_andx(cmd) ? mock_answer(&c) : NULL;
+        c.out += size;
+        
+        andx = (const smb_session_req *)(c.req->payload + c.block);
+        if (prev == NULL || andx->andx == 0xff
+            || andx->andx_offset < sizeof(smb_header) + c.block + 1)
+        {
+            size = 0;
+            break;
+        }
+        cmd     = andx->andx;
+        c.block = andx->andx_offset - sizeof(smb_header);
+        
+        // Next answer on a 4 bytes boundary
+        while ((sizeof(smb_header) + c.out) % 4)
+            c.ans->payload[c.out++] = 0;
+    }
+    c.ans->header.status = c.status;
+    
+    return sizeof(smb_header) + c.out + size;
+}
+@end
+#endif
@@ -44,18 +44,59 @@ void smb_session_destroy(smb_session *s);
 void smb_session_set_creds(smb_session *s, const char *domain,
                                       const char *login, const char *password);
 
+#pragma mark - smbSessionSetDeferredClose
+/*!Enable or disable the deferred close of the files of this session
+ * When enabled, smb_fclose() and smb_fclose_many() send the CLOSE requests and return without waiting for the answers, which are received along with the answers of the next requests. A program opening and closing many files then doesn't pay a round trip per close. The server errors on close are lost, which smb_fclose() ignores anyway.
+ * No more CLOSE answers than the server allows requests in flight are left pending.
+ *\param s The session object
+ *\param enable true to defer the closes, false to wait for them again (the pending answers are received first)
+ */
+void smb_session_set_deferred_close(smb_session *s, bool enable);
+
+#pragma mark - smbSessionSetTimeouts
+/*!Set the deadlines of the network operations of this session
+ * Without them, a server that stops answering blocks the caller for as long as the system TCP timeouts (minutes). An operation past its deadline fails with #DSM_ERROR_TIMEOUT, and the session is then unusable: destroy it (or connect it again).
+ * Takes effect at once, and for the next smb_session_connect().
+ *\param s The session object
+ *\param connect_ms Deadline of the TCP connection to each port, in milliseconds (0 for the system one, the default)
+ *\param send_ms Deadline of the sending of a request, in milliseconds (0 for none, the default)
+ *\param recv_ms Deadline of the receiving of an answer, or of each part of it when it's read in parts, in milliseconds (0 for none, the default)
+ */
+void smb_session_set_timeouts(smb_session *s, unsigned connect_ms,
+                              unsigned send_ms, unsigned recv_ms);
+
+#pragma mark - smbSessionNetworkError
+/*!The DSM error code of the last network failure of this session
+ *\param s The session object
+ *\returns #DSM_ERROR_TIMEOUT if a deadline of smb_session_set_timeouts() passed, #DSM_ERROR_NETWORK otherwise
+ */
+int smb_session_network_error(smb_session *s);
+
 #pragma mark - smbSessionConnect
 /*!Establish a connection and negotiate a session protocol with a remote host
  * You have to provide both the ip and the name. This is a constraint of Netbios, which requires you to know its name before he accepts to speak with you.
  *\param s A session object.
  *\param hostname The ASCII netbios name, the name type will be coerced to <20> since libdsm is about reading files
  *\param ip The ip of the machine to connect to (in network byte order)
- *\param transport The type of transport used, it could be SMB_TRANSPORT_TCP or SMB_TRANSPORT_NBT (Netbios over TCP, ie legacy)
+ *\param transport The type of transport used, it could be SMB_TRANSPORT_TCP, SMB_TRANSPORT_NBT (Netbios over TCP, ie legacy) or SMB_TRANSPORT_URING (Direct-TCP through io_uring on Linux)
+ * Ports 445 and 139 are tried in parallel (see netbios_session_connect()). With SMB_TRANSPORT_NBT, the NetBIOS session is only requested if the host answers on 139 first.
  *\returns 0 on success or a DSM error code in case of error
  */
 int smb_session_connect(smb_session *s, const char *hostname,
                                     uint32_t ip, int transport);
 
+#ifdef DEBUG
+#pragma mark - smbSessionConnectLoopback
+/*!Same as smb_session_connect(), with an in-process server sharing a local directory instead of a remote host
+ * Nothing goes through the network (see smb_transport_loopback()), which makes it possible to test and benchmark the library alone. Login and connect to any share as usual afterwards, any credentials are accepted.
+ * Debug builds only: the Release configuration leaves the server out of the library.
+ *\param s A session object.
+ *\param root The local directory to share
+ *\returns 0 on success or a DSM error code in case of error
+ */
+int smb_session_connect_loopback(smb_session *s, const char *root);
+#endif
+
 #pragma mark - smbSessionLogin
 /*!Authenticate on the remote host with the provided credentials
  * Can be called if session state is SMB_STATE_DIALECT_OK. If successfull, session state transition to SMB_STATE_SESSION_OK Provides the credentials with smb_session_set_creds.
@@ -64,6 +105,20 @@ int smb_session_connect(smb_session *s, const char *hostname,
  */
 int smb_session_login(smb_session *s);
 
+#pragma mark - smbSessionOpenShare
+/*!Connect, login and connect to a share with as few round trips as possible
+ * Same as smb_session_connect(), smb_session_login() and smb_tree_connect() in a row, except the TREE_CONNECT is chained to the last SESSION_SETUP request. Provides the credentials with smb_session_set_creds() first.
+ *\param s A session object.
+ *\param hostname The ASCII netbios name of the host
+ *\param ip The ip of the machine to connect to (in network byte order)
+ *\param transport SMB_TRANSPORT_TCP, SMB_TRANSPORT_NBT or SMB_TRANSPORT_URING
+ *\param share The name of the share to connect to
+ *\param tid The tid of the share, for further operations on it
+ *\returns 0 on success or a DSM error code in case of error
+ */
+int smb_session_open_share(smb_session *s, const char *hostname, uint32_t ip,
+                           int transport, const char *share, smb_tid *tid);
+
 #pragma mark - smbSessionIsGuest
 /*!Am i logged in as Guest ?
  *\param s The session object
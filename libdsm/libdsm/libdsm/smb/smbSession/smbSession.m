@@ -16,7 +16,9 @@ static int smb_negotiate(smb_session *s);
 
 smb_session *smb_session_new()
 {
-    smb_session *s;
+    smb_session         *s;
+    pthread_mutexattr_t attr;
+    int                 res;
     
     s = calloc(1, sizeof(smb_session));
     if (!s)
@@ -38,6 +40,23 @@ smb_session *smb_session_new()
     // Until we know more, assume server supports everything.
     // s->c
     
+    // But don't assume it can handle more than one request at once.
+    s->srv.max_mpx        = 1;
+    s->srv.max_read       = SMB_IO_READ_MAX;
+    s->srv.max_write      = SMB_IO_WRITE_MAX;
+    
+    // Recursive: public calls taking it may use each other (smb_fopen() in
+    // smb_share_get_list() for example)
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    res = pthread_mutex_init(&s->io_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (res != 0)
+    {
+        free(s);
+        return NULL;
+    }
+    
     return s;
 }
 
@@ -64,6 +83,7 @@ void smb_session_destroy(smb_session *s)
     free(s->creds.domain);
     free(s->creds.login);
     free(s->creds.password);
+    pthread_mutex_destroy(&s->io_lock);
     free(s);
 }
 
@@ -95,6 +115,64 @@ void smb_session_set_creds(smb_session *s, const char *domain,
     }
 }
 
+#pragma mark - smbSessionSetDeferredClose
+void smb_session_set_deferred_close(smb_session *s, bool enable)
+{
+    assert(s != NULL);
+    
+    pthread_mutex_lock(&s->io_lock);
+    s->deferred_close = enable;
+    // Leaving the mode, don't leave answers behind
+    if (!enable && s->closes_pending > 0 && s->transport.session != NULL)
+        smb_session_drain_closes(s, 0);
+    pthread_mutex_unlock(&s->io_lock);
+}
+
+#pragma mark - smbSessionSetTimeouts
+void smb_session_set_timeouts(smb_session *s, unsigned connect_ms,
+                              unsigned send_ms, unsigned recv_ms)
+{
+    assert(s != NULL);
+    
+    pthread_mutex_lock(&s->io_lock);
+    s->connect_timeout = connect_ms;
+    s->send_timeout    = send_ms;
+    s->recv_timeout    = recv_ms;
+    if (s->transport.session != NULL)
+        s->transport.set_timeouts(s->transport.session, connect_ms,
+                                  send_ms, recv_ms);
+    pthread_mutex_unlock(&s->io_lock);
+}
+
+#pragma mark - smbSessionNetworkError
+int smb_session_network_error(smb_session *s)
+{
+    assert(s != NULL);
+    
+    if (s->transport.session != NULL
+        && s->transport.timed_out(s->transport.session))
+        return DSM_ERROR_TIMEOUT;
+    
+    return DSM_ERROR_NETWORK;
+}
+
+// Largest READ_ANDX/WRITE_ANDX payload, 'overhead' is the size of the
+// message around the data.
+static uint32_t smb_negotiate_max_io(smb_session *s, uint32_t cap,
+                                     size_t small, size_t overhead)
+{
+    size_t max;
+    
+    if (!(s->srv.caps & cap))
+        return small;
+    
+    max = s->transport.max_frame - sizeof(smb_packet) - overhead;
+    max = max < SMB_IO_LARGE_MAX ? max : SMB_IO_LARGE_MAX;
+    max &= ~(size_t)0x3ff;
+    
+    return max > small ? max : small;
+}
+
 static int smb_negotiate(smb_session *s)
 {
     const char          *dialects[] = SMB_DIALECTS;
@@ -120,24 +198,29 @@ static int smb_negotiate(smb_session *s)
     if (!smb_session_send_msg(s, msg))
     {
         smb_message_destroy(msg);
-        return DSM_ERROR_NETWORK;
+        return smb_session_network_error(s);
     }
     smb_message_destroy(msg);
     
     if (!smb_session_recv_msg(s, &answer))
-        return DSM_ERROR_NETWORK;
+        return smb_session_network_error(s);
     
     nego = (smb_nego_resp *)answer.packet->payload;
     if (!smb_session_check_nt_status(s, &answer))
         return DSM_ERROR_NT;
     if (nego->wct != 0x11)
-        return DSM_ERROR_NETWORK;
+        return smb_session_network_error(s);
     
     s->srv.dialect = nego->dialect_index;
     s->srv.security_mode = nego->security_mode;
     s->srv.caps = nego->caps;
     s->srv.ts = nego->ts;
     s->srv.session_key = nego->session_key;
+    s->srv.max_mpx = nego->max_mpx ? nego->max_mpx : 1;
+    s->srv.max_read = smb_negotiate_max_io(s, SMB_CAPS_LARGE_READX, SMB_IO_READ_MAX,
+                                           sizeof(smb_read_resp) + 1);
+    s->srv.max_write = smb_negotiate_max_io(s, SMB_CAPS_LARGE_WRITEX, SMB_IO_WRITE_MAX,
+                                            sizeof(smb_write_req));
     
     // Copy SPNEGO supported mechanisms  token for later usage (login_gss())
     if (smb_session_supports(s, SMB_SESSION_XSEC)) {
@@ -156,6 +239,7 @@ int smb_session_connect(smb_session *s, const char *name,
     
     if (s->transport.session != NULL)
         s->transport.destroy(s->transport.session);
+    s->closes_pending = 0;  // Those answers went with the connection
     
     switch (transport)
     {
@@ -165,22 +249,51 @@ int smb_session_connect(smb_session *s, const char *name,
         case SMB_TRANSPORT_NBT:
             smb_transport_nbt(&s->transport);
             break;
+        case SMB_TRANSPORT_URING:
+            smb_transport_uring(&s->transport);
+            break;
         default:
             return DSM_ERROR_GENERIC;
     }
     
     if ((s->transport.session = s->transport.new(SMB_DEFAULT_BUFSIZE)) == NULL)
         return DSM_ERROR_GENERIC;
+    s->transport.set_timeouts(s->transport.session, s->connect_timeout,
+                              s->send_timeout, s->recv_timeout);
     if (!s->transport.connect(ip, s->transport.session, name))
-        return DSM_ERROR_NETWORK;
+        return smb_session_network_error(s);
     
     memcpy(s->srv.name, name, strlen(name) + 1);
     
     return smb_negotiate(s);
 }
 
+#ifdef DEBUG
+#pragma mark - smbSessionConnectLoopback
+int smb_session_connect_loopback(smb_session *s, const char *root)
+{
+    assert(s != NULL && root != NULL);
+    
+    if (s->transport.session != NULL)
+        s->transport.destroy(s->transport.session);
+    s->closes_pending = 0;
+    
+    smb_transport_loopback(&s->transport);
+    if ((s->transport.session = s->transport.new(SMB_DEFAULT_BUFSIZE)) == NULL)
+        return DSM_ERROR_GENERIC;
+    // The server is started with the directory it shares
+    if (!s->transport.connect(0, s->transport.session, root))
+        return DSM_ERROR_GENERIC;
+    
+    strcpy(s->srv.name, SMB_LOOPBACK_NAME);
+    
+    return smb_negotiate(s);
+}
+#endif
+
 static int        smb_session_login_ntlm(smb_session *s, const char *domain,
-                                         const char *user, const char *password)
+                                         const char *user, const char *password,
+                                         const char *share, smb_tid *tid)
 {
     smb_message           answer;
     smb_message           *msg = NULL;
@@ -188,6 +301,7 @@ static int        smb_session_login_ntlm(smb_session *s, const char *domain,
     uint8_t               *ntlm2 = NULL;
     smb_ntlmh             hash_v2;
     uint64_t              user_challenge;
+    bool                  chained;
     
     assert(s != NULL);
     
@@ -224,25 +338,32 @@ static int        smb_session_login_ntlm(smb_session *s, const char *domain,
     req.mpx_count        = 16; // XXX ?
     req.vc_count         = 1;
     //req.session_key      = s->srv.session_key; // XXX Useless on the wire?
-    req.caps             = s->srv.caps; // XXX caps & our_caps_mask
+    req.caps             = s->srv.caps | SMB_CAPS_LARGE_READX | SMB_CAPS_LARGE_WRITEX; // XXX caps & our_caps_mask
     req.oem_pass_len = 16 + SMB_LM2_BLOB_SIZE;
     req.uni_pass_len = 0; //16 + blob_size; //SMB_NTLM2_BLOB_SIZE;
     req.payload_size = msg->cursor - sizeof(smb_session_req);
     SMB_MSG_INSERT_PKT(msg, 0, req);
     
+    // Saves a round trip when the caller wants a share right away
+    if (share != NULL) {
+        smb_message_chain(msg, 0, SMB_CMD_TREE_CONNECT);
+        smb_tree_connect_put_req(s, msg, share);
+    }
+    
     if (!smb_session_send_msg(s, msg)) {
         smb_message_destroy(msg);
         
-        return DSM_ERROR_NETWORK;
+        return smb_session_network_error(s);
     }
     smb_message_destroy(msg);
     
     if (smb_session_recv_msg(s, &answer) == 0) {
-        return DSM_ERROR_NETWORK;
+        return smb_session_network_error(s);
     }
     
     smb_session_resp *r = (smb_session_resp *)answer.packet->payload;
-    if (!smb_session_check_nt_status(s, &answer)) {
+    chained = share != NULL && smb_tree_connect_chained(s, &answer, tid);
+    if (!chained && !smb_session_check_nt_status(s, &answer)) {
         return DSM_ERROR_NT;
     }
     
@@ -264,27 +385,67 @@ int smb_session_supports(smb_session *s, int what)
     {
         case SMB_SESSION_XSEC:
             return s->srv.caps & SMB_CAPS_XSEC;
+        case SMB_SESSION_LARGE_READX:
+            return s->srv.caps & SMB_CAPS_LARGE_READX;
+        case SMB_SESSION_LARGE_WRITEX:
+            return s->srv.caps & SMB_CAPS_LARGE_WRITEX;
         default:
             return 0;
     }
 }
 
-#pragma mark - smbSessionLogin
-int smb_session_login(smb_session *s)
+// Logs in, and connects to 'share' in the same request if not NULL
+static int smb_session_login_share(smb_session *s, const char *share,
+                                   smb_tid *tid)
 {
-    assert(s != NULL);
+    int res;
     
     if (s->creds.domain == NULL
         || s->creds.login == NULL
         || s->creds.password == NULL)
         return DSM_ERROR_GENERIC;
     
+    // The chained TREE_CONNECT adds a share
+    pthread_mutex_lock(&s->io_lock);
     if (smb_session_supports(s, SMB_SESSION_XSEC))
-        return (smb_session_login_spnego(s, s->creds.domain, s->creds.login,
-                                         s->creds.password));
+        res = smb_session_login_spnego(s, s->creds.domain, s->creds.login,
+                                       s->creds.password, share, tid);
     else
-        return (smb_session_login_ntlm(s, s->creds.domain, s->creds.login,
-                                       s->creds.password));
+        res = smb_session_login_ntlm(s, s->creds.domain, s->creds.login,
+                                     s->creds.password, share, tid);
+    pthread_mutex_unlock(&s->io_lock);
+    
+    return res;
+}
+
+#pragma mark - smbSessionLogin
+int smb_session_login(smb_session *s)
+{
+    assert(s != NULL);
+    
+    return smb_session_login_share(s, NULL, NULL);
+}
+
+#pragma mark - smbSessionOpenShare
+int smb_session_open_share(smb_session *s, const char *hostname, uint32_t ip,
+                           int transport, const char *share, smb_tid *tid)
+{
+    int res;
+    
+    assert(s != NULL && hostname != NULL && share != NULL && tid != NULL);
+    
+    if ((res = smb_session_connect(s, hostname, ip, transport)) != DSM_SUCCESS)
+        return res;
+    
+    if ((res = smb_session_login_share(s, share, tid)) != DSM_SUCCESS)
+        return res;
+    
+    // The server didn't process the chained TREE_CONNECT (or it failed, and
+    // this gives the error).
+    if (*tid == 0)
+        return smb_tree_connect(s, share, tid);
+    
+    return DSM_SUCCESS;
 }
 
 #pragma mark - smbSessionIsGuest
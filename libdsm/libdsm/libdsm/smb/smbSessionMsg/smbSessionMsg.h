@@ -13,12 +13,65 @@
 @interface smbSessionMsg : NSObject
 #pragma mark - smbSessionSendMessage
 /*!Send a smb message for the provided smb_session
+ * The message is tagged with a fresh multiplex id, which can be read back from msg->packet->header.mux_id to match the response.
  */
 int smb_session_send_msg(smb_session *s, smb_message *msg);
 
+#pragma mark - smbSessionSendMessageData
+/*!Send a smb message followed by 'data_size' bytes of 'data', as a single packet.
+ * The data is sent from where it is, it doesn't need to be appended to the message first (think WRITE_ANDX payload).
+ */
+int smb_session_send_msg_data(smb_session *s, smb_message *msg,
+                              const void *data, size_t data_size);
+
 #pragma mark - smbSessionRecvMessage
 /*!msg->packet will be updated to point on received data. You don't own this memory. It'll be reused on next recv_msg
  */
 size_t smb_session_recv_msg(smb_session *s, smb_message *msg);
+
+#pragma mark - smbSessionRecvMessageHead
+/*!Same as smb_session_recv_msg(), but only the first 'head_size' bytes (SMB header included) of the message are received, msg->payload_size tells how much of it is available.
+ * The rest can then be received with smb_session_recv_msg_body(), for example straight into a user buffer. It is skipped otherwise on the next receive.
+ *\returns The full payload size of the message or 0 on error
+ */
+size_t smb_session_recv_msg_head(smb_session *s, smb_message *msg,
+                                 size_t head_size);
+
+#pragma mark - smbSessionDrainCloses
+/*!Receive the answers of the CLOSE requests sent without waiting, until no more than 'keep' are expected
+ * These answers are otherwise skipped by the next receives. Nothing else may be in flight, the caller holds the session io_lock.
+ *\param s The session object
+ *\param keep How many answers may stay pending
+ *\returns 0 on success or a DSM error code in case of error
+ */
+int smb_session_drain_closes(smb_session *s, size_t keep);
+
+#pragma mark - smbSessionRecvMessageBody
+/*!Receive up to 'size' more bytes of the message partially received by smb_session_recv_msg_head().
+ * If 'dst' is NULL, they are appended to msg (msg->packet may move), otherwise they are received directly into 'dst'.
+ *\returns The number of bytes received or -1 on error
+ */
+ssize_t smb_session_recv_msg_body(smb_session *s, smb_message *msg,
+                                  void *dst, size_t size);
+
+#pragma mark - smbSessionOplockRelease
+/*!Lower the oplock held on an open file and acknowledge the break to the server
+ * The read-ahead buffer is dropped if no oplock is left. The write-behind buffer MUST have been flushed before.
+ *\param s The session object
+ *\param file The file the server broke the oplock of
+ *\param level The new oplock level, #SMB_OPLOCK_LEVEL_II or #SMB_OPLOCK_NONE
+ */
+void smb_session_oplock_release(smb_session *s, smb_file *file, uint8_t level);
+
+#pragma mark - smbSessionOplockAck
+/*!Acknowledge an oplock break with a LOCKING_ANDX request, which has no response
+ *\param s The session object
+ *\param tid The tree id of the file
+ *\param fid The file id whose oplock was broken
+ *\param level The oplock level kept, #SMB_OPLOCK_LEVEL_II or #SMB_OPLOCK_NONE
+ *\returns 0 on success or a DSM error code in case of error
+ */
+int smb_session_oplock_ack(smb_session *s, smb_tid tid, smb_fid fid,
+                           uint8_t level);
 @end
 #endif
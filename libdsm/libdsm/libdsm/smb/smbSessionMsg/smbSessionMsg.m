@@ -13,11 +13,27 @@
 
 @implementation smbSessionMsg
 
+static uint16_t smb_session_next_mid(smb_session *s)
+{
+    // 0xffff is used by the server for unsolicited messages (oplock breaks)
+    if (++s->mid == 0xffff)
+        s->mid = 1;
+    
+    return s->mid;
+}
+
 #pragma mark - smbSessionSendMessage
 /*!Send a smb message for the provided smb_session
  */
 int smb_session_send_msg(smb_session *s, smb_message *msg) {
-    size_t        pkt_sz;
+    return smb_session_send_msg_data(s, msg, NULL, 0);
+}
+
+#pragma mark - smbSessionSendMessageData
+int smb_session_send_msg_data(smb_session *s, smb_message *msg,
+                              const void *data, size_t data_size) {
+    struct iovec  iov[2];
+    int           iovcnt = 1;
     
     assert(s != NULL);
     assert(s->transport.session != NULL);
@@ -27,15 +43,137 @@ int smb_session_send_msg(smb_session *s, smb_message *msg) {
     msg->packet->header.flags2  = 0xc843;
     // msg->packet->header.flags2  = 0xc043; // w/o extended security;
     msg->packet->header.uid = s->srv.uid;
+    msg->packet->header.mux_id = smb_session_next_mid(s);
     
-    s->transport.pkt_init(s->transport.session);
+    // The message and the data are given as is to the transport, which
+    // sends them along with its own header without copying them.
+    iov[0].iov_base = (void *)msg->packet;
+    iov[0].iov_len  = sizeof(smb_packet) + msg->cursor;
+    if (data != NULL && data_size > 0)
+    {
+        iov[1].iov_base = (void *)data;
+        iov[1].iov_len  = data_size;
+        iovcnt++;
+    }
     
-    pkt_sz = sizeof(smb_packet) + msg->cursor;
-    if (!s->transport.pkt_append(s->transport.session, (void *)msg->packet, pkt_sz))
+    if (!s->transport.sendv(s->transport.session, iov, iovcnt))
         return 0;
-    if (!s->transport.send(s->transport.session))
+    
+    return 1;
+}
+
+// Handles an oplock break sent by the server in the middle of our exchanges.
+// Nothing answers the acknowledgement, so it can be sent right away, unless
+// data of the file waits in its write-behind buffer: this has to be sent
+// before, which can't be done from here. smb_file does it later.
+static void smb_session_oplock_break(smb_session *s, smb_packet *packet)
+{
+    smb_locking_req *req = (smb_locking_req *)packet->payload;
+    smb_file        *file;
+    uint8_t         level;
+    
+    level = req->oplock_level ? SMB_OPLOCK_LEVEL_II : SMB_OPLOCK_NONE;
+    file  = smb_session_file_get(s, SMB_FD(packet->header.tid, req->fid));
+    
+    if (file == NULL)
+    {
+        // A cached handle can't be reused anymore, it is closed later
+        file = smb_session_file_cache_get(s, SMB_FD(packet->header.tid, req->fid));
+        if (file != NULL)
+            file->oplock = level;
+        smb_session_oplock_ack(s, packet->header.tid, req->fid, level);
+    }
+    else if (file->wb.len > 0)
+    {
+        if (!file->oplock_break)
+            s->oplock_breaks++;
+        file->oplock_break    = true;
+        file->oplock_break_to = level;
+    }
+    else
+        smb_session_oplock_release(s, file, level);
+}
+
+#pragma mark - smbSessionOplockRelease
+void smb_session_oplock_release(smb_session *s, smb_file *file, uint8_t level)
+{
+    assert(s != NULL && file != NULL);
+    
+    // Level II still allows to cache reads, nothing else
+    if (level == SMB_OPLOCK_NONE)
+        file->ra.len = 0;
+    file->oplock = level;
+    
+    if (file->oplock_break)
+    {
+        file->oplock_break = false;
+        s->oplock_breaks--;
+    }
+    
+    smb_session_oplock_ack(s, file->tid, file->fid, level);
+}
+
+#pragma mark - smbSessionOplockAck
+int smb_session_oplock_ack(smb_session *s, smb_tid tid, smb_fid fid,
+                           uint8_t level)
+{
+    smb_message     *msg;
+    smb_locking_req req;
+    int             res;
+    
+    assert(s != NULL);
+    
+    msg = smb_message_new(SMB_CMD_LOCKING);
+    if (!msg)
+        return DSM_ERROR_GENERIC;
+    
+    msg->packet->header.tid = tid;
+    
+    SMB_MSG_INIT_PKT_ANDX(req);
+    req.wct          = 8;
+    req.fid          = fid;
+    req.type_of_lock = SMB_LOCK_OPLOCK_RELEASE;
+    req.oplock_level = level == SMB_OPLOCK_LEVEL_II ? 1 : 0;
+    req.timeout      = 0;
+    req.num_unlocks  = 0;
+    req.num_locks    = 0;
+    req.bct          = 0;
+    SMB_MSG_PUT_PKT(msg, req);
+    
+    // The server doesn't answer this one, and waits for it: it must not stay
+    // in the transport until our next receive
+    res = smb_session_send_msg(s, msg)
+          && s->transport.flush(s->transport.session);
+    smb_message_destroy(msg);
+    
+    return res ? DSM_SUCCESS : smb_session_network_error(s);
+}
+
+// Consumes the frames nobody waits for: the oplock breaks sent by the server
+// and the answers of the CLOSEs that weren't waited for. Returns 1 if the
+// frame was one of them, 0 if it wasn't, -1 on error.
+static int smb_session_skip_frame(smb_session *s, void *data,
+                                  size_t payload_size, size_t received)
+{
+    smb_packet      *packet = data;
+    bool            oplock_break;
+    
+    oplock_break = packet->header.command == SMB_CMD_LOCKING
+                   && packet->header.mux_id == SMB_MID_UNSOLICITED;
+    if (!oplock_break
+        && (packet->header.command != SMB_CMD_CLOSE || s->closes_pending == 0))
         return 0;
     
+    if (payload_size > received
+        && s->transport.recv_body(s->transport.session, NULL,
+                                  payload_size - received, &data) < 0)
+        return -1;
+    
+    if (!oplock_break)
+        s->closes_pending--;
+    else if (payload_size >= sizeof(smb_header) + sizeof(smb_locking_req))
+        smb_session_oplock_break(s, (smb_packet *)data);
+    
     return 1;
 }
 
@@ -43,26 +181,94 @@ int smb_session_send_msg(smb_session *s, smb_message *msg) {
 /*!msg->packet will be updated to point on received data. You don't own this memory. It'll be reused on next recv_msg
  */
 size_t smb_session_recv_msg(smb_session *s, smb_message *msg)
+{
+    return smb_session_recv_msg_head(s, msg, SIZE_MAX);
+}
+
+#pragma mark - smbSessionRecvMessageHead
+size_t smb_session_recv_msg_head(smb_session *s, smb_message *msg,
+                                 size_t head_size)
 {
     void                      *data;
     ssize_t                   payload_size;
+    size_t                    received;
+    int                       skipped;
     
     assert(s != NULL && s->transport.session != NULL);
+    assert(head_size >= sizeof(smb_header));
     
-    payload_size = s->transport.recv(s->transport.session, &data);
-    if (payload_size <= 0)
-        return 0;
-    
-    if ((size_t)payload_size < sizeof(smb_header))
-        return 0;
-    
+    for (;;)
+    {
+        payload_size = s->transport.recv_head(s->transport.session, head_size, &data);
+        if (payload_size <= 0)
+            return 0;
+        
+        if ((size_t)payload_size < sizeof(smb_header))
+            return 0;
+        
+        received = (size_t)payload_size < head_size ? (size_t)payload_size : head_size;
+        
+        // Oplock breaks and late CLOSE answers can come at any time, they
+        // are not the answer we are waiting for.
+        skipped = smb_session_skip_frame(s, data, payload_size, received);
+        if (skipped < 0)
+            return 0;
+        if (!skipped)
+            break;
+    }
     if (msg != NULL)
     {
         msg->packet = (smb_packet *)data;
-        msg->payload_size = payload_size - sizeof(smb_header);
+        msg->payload_size = received - sizeof(smb_header);
         msg->cursor       = 0;
     }
     
     return payload_size - sizeof(smb_header);
 }
+
+#pragma mark - smbSessionDrainCloses
+int smb_session_drain_closes(smb_session *s, size_t keep)
+{
+    void                      *data;
+    ssize_t                   payload_size;
+    
+    assert(s != NULL && s->transport.session != NULL);
+    
+    while (s->closes_pending > keep)
+    {
+        payload_size = s->transport.recv_head(s->transport.session,
+                                              sizeof(smb_header), &data);
+        if (payload_size < (ssize_t)sizeof(smb_header))
+            return smb_session_network_error(s);
+        
+        // Nothing else is in flight, anything but a CLOSE answer or an
+        // oplock break is a protocol error.
+        if (smb_session_skip_frame(s, data, payload_size, sizeof(smb_header)) <= 0)
+            return smb_session_network_error(s);
+    }
+    
+    return DSM_SUCCESS;
+}
+
+#pragma mark - smbSessionRecvMessageBody
+ssize_t smb_session_recv_msg_body(smb_session *s, smb_message *msg,
+                                  void *dst, size_t size)
+{
+    void                      *data;
+    ssize_t                   res;
+    
+    assert(s != NULL && s->transport.session != NULL && msg != NULL);
+    
+    res = s->transport.recv_body(s->transport.session, dst, size, &data);
+    if (res < 0)
+        return -1;
+    
+    if (dst == NULL)
+    {
+        msg->packet = (smb_packet *)data;
+        msg->payload_size += res;
+    }
+    
+    return res;
+}
 @end
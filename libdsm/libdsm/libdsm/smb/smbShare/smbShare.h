@@ -52,6 +52,27 @@ void smb_share_list_destroy(smb_share_list list);
  */
 int smb_tree_connect(smb_session *s, const char *name, smb_tid *tid);
 
+#pragma mark - smbTreeConnectPutReq
+/*!Append a TREE_CONNECT_ANDX block for the share 'name' to a message
+ * Used to chain a tree connect to another command (see smb_message_chain()).
+ *\param s The session object
+ *\param msg The message being built
+ *\param name The share name
+ */
+void smb_tree_connect_put_req(smb_session *s, smb_message *msg,
+                              const char *name);
+
+#pragma mark - smbTreeConnectChained
+/*!Look for the answer of a chained TREE_CONNECT_ANDX in a response
+ * If the server went up to the tree connect and it succeeded, the share is registered like smb_tree_connect() does.
+ *\param s The session object
+ *\param resp_msg The received response of the whole chain
+ *\param tid Set to the tid of the share, or 0 if it wasn't connected
+ *\returns true if the response holds the TREE_CONNECT answer, which means the commands chained before succeeded, even if the header status is an error (the TREE_CONNECT one then)
+ */
+bool smb_tree_connect_chained(smb_session *s, smb_message *resp_msg,
+                              smb_tid *tid);
+
 #pragma mark - smbTreeDisconnect
 /*!Disconnect from a share
  * UNIMPLEMENTED
@@ -53,8 +53,10 @@ static ssize_t  smb_share_parse_enum(smb_message *msg, char ***list)
 }
 
 
-#pragma mark - smbShareGetList
-int             smb_share_get_list(smb_session *s, smb_share_list *list, size_t *pcount)
+// Connects to IPC$ and asks the srvsvc pipe for NetShareEnumAll. The caller
+// holds the session io_lock.
+static int smb_share_get_list_locked(smb_session *s, smb_share_list *list,
+                                     size_t *pcount)
 {
     smb_message           *req, resp;
     smb_trans_req         trans;
@@ -65,7 +67,6 @@ int             smb_share_get_list(smb_session *s, smb_share_list *list, size_t
     ssize_t               count;
     int                   ret;
     
-    assert(s != NULL && list != NULL);
     *list = NULL;
     
     if ((ret = smb_tree_connect(s, "IPC$", &ipc_tid)) != DSM_SUCCESS)
@@ -137,7 +138,7 @@ int             smb_share_get_list(smb_session *s, smb_share_list *list, size_t
     smb_message_destroy(req);
     if (!res)
     {
-        ret = DSM_ERROR_NETWORK;
+        ret = smb_session_network_error(s);
         goto error;
     }
     
@@ -145,7 +146,7 @@ int             smb_share_get_list(smb_session *s, smb_share_list *list, size_t
     res = smb_session_recv_msg(s, &resp);
     if (!res || resp.packet->payload[68])
     {
-        ret = DSM_ERROR_NETWORK;
+        ret = smb_session_network_error(s);
         goto error;
     }
     
@@ -226,14 +227,14 @@ int             smb_share_get_list(smb_session *s, smb_share_list *list, size_t
     smb_message_destroy(req);
     if (!res)
     {
-        ret = DSM_ERROR_NETWORK;
+        ret = smb_session_network_error(s);
         goto error;
     }
     
     // Is the server throwing pile of shit back at me ?
     res = smb_session_recv_msg(s, &resp);
     if (!res && (uint32_t)resp.packet->payload[resp.payload_size - 4]) {
-        ret = DSM_ERROR_NETWORK;
+        ret = smb_session_network_error(s);
         goto error;
     }
     
@@ -256,6 +257,21 @@ error:
     return ret;
 }
 
+#pragma mark - smbShareGetList
+int             smb_share_get_list(smb_session *s, smb_share_list *list, size_t *pcount)
+{
+    int                   ret;
+    
+    assert(s != NULL && list != NULL);
+    
+    // The answers are parsed in place, no other exchange may come in between
+    pthread_mutex_lock(&s->io_lock);
+    ret = smb_share_get_list_locked(s, list, pcount);
+    pthread_mutex_unlock(&s->io_lock);
+    
+    return ret;
+}
+
 #pragma mark - smbShareListCount
 size_t smb_share_list_count(smb_share_list list) {
     size_t res;
@@ -286,22 +302,15 @@ void smb_share_list_destroy(smb_share_list list)
     free(list);
 }
 
-#pragma mark - smbTreeConnect
-int smb_tree_connect(smb_session *s, const char *name, smb_tid *tid)
+#pragma mark - smbTreeConnectPutReq
+void smb_tree_connect_put_req(smb_session *s, smb_message *msg,
+                              const char *name)
 {
     smb_tree_connect_req  req;
-    smb_tree_connect_resp *resp;
-    smb_message            resp_msg;
-    smb_message           *req_msg;
-    smb_share             *share;
     size_t                 path_len, utf_path_len;
     char                  *path, *utf_path;
     
-    assert(s != NULL && name != NULL && tid != NULL);
-    
-    req_msg = smb_message_new(SMB_CMD_TREE_CONNECT);
-    if (!req_msg)
-        return DSM_ERROR_GENERIC;
+    assert(s != NULL && msg != NULL && name != NULL);
     
     // Build \\SERVER\Share path from name
     path_len  = strlen(name) + strlen(s->srv.name) + 4;
@@ -309,51 +318,106 @@ int smb_tree_connect(smb_session *s, const char *name, smb_tid *tid)
     snprintf(path, path_len, "\\\\%s\\%s", s->srv.name, name);
     utf_path_len = smb_to_utf16(path, strlen(path) + 1, &utf_path);
     
-    // Packet headers
-    req_msg->packet->header.tid   = 0xffff; // Behavior of libsmbclient
-    
-    smb_message_set_andx_members(req_msg);
-    
     // Packet payload
     SMB_MSG_INIT_PKT_ANDX(req);
     req.wct          = 4;
     req.flags        = 0x0c; // (??)
     req.passwd_len   = 1;    // Null byte
     req.bct = utf_path_len + 6 + 1;
-    SMB_MSG_PUT_PKT(req_msg, req);
+    SMB_MSG_PUT_PKT(msg, req);
     
-    smb_message_put8(req_msg, 0); // Ze null byte password;
-    smb_message_append(req_msg, utf_path, utf_path_len);
+    smb_message_put8(msg, 0); // Ze null byte password;
+    smb_message_append(msg, utf_path, utf_path_len);
     free(utf_path);
-    smb_message_append(req_msg, "?????", strlen("?????") + 1);
-    
-    if (!smb_session_send_msg(s, req_msg))
-    {
-        smb_message_destroy(req_msg);
-        return DSM_ERROR_NETWORK;
-    }
-    smb_message_destroy(req_msg);
+    smb_message_append(msg, "?????", strlen("?????") + 1);
+}
+
+// Registers the share answered by the TREE_CONNECT block at 'block'. Only
+// the fields its wct covers are read: a wct of 3 (older servers) stops after
+// opt_support, the access rights come with a wct of 7.
+static int smb_tree_connect_add(smb_session *s, smb_message *resp_msg,
+                                size_t block, smb_tid *tid)
+{
+    smb_tree_connect_resp *resp;
+    smb_share             *share;
+    bool                  rights;
     
-    if (!smb_session_recv_msg(s, &resp_msg))
+    if (block + 7 > resp_msg->payload_size // wct, AndX and opt_support
+        || resp_msg->packet->payload[block] < 3)
         return DSM_ERROR_NETWORK;
     
-    if (!smb_session_check_nt_status(s, &resp_msg))
-        return DSM_ERROR_NT;
-    
-    resp  = (smb_tree_connect_resp *)resp_msg.packet->payload;
-    share = calloc(1, sizeof(smb_share));
+    resp   = (smb_tree_connect_resp *)(resp_msg->packet->payload + block);
+    rights = block + sizeof(smb_tree_connect_resp) <= resp_msg->payload_size
+             && resp->wct >= 7;
+    share  = calloc(1, sizeof(smb_share));
     if (!share)
         return DSM_ERROR_GENERIC;
     
-    share->tid          = resp_msg.packet->header.tid;
+    share->tid          = resp_msg->packet->header.tid;
     share->opts         = resp->opt_support;
-    share->rights       = resp->max_rights;
-    share->guest_rights = resp->guest_rights;
+    share->rights       = rights ? resp->max_rights : 0;
+    share->guest_rights = rights ? resp->guest_rights : 0;
     
     smb_session_share_add(s, share);
     
     *tid = share->tid;
-    return 0;
+    return DSM_SUCCESS;
+}
+
+#pragma mark - smbTreeConnectChained
+bool smb_tree_connect_chained(smb_session *s, smb_message *resp_msg,
+                              smb_tid *tid)
+{
+    size_t                block = 0;
+    uint8_t               cmd;
+    
+    assert(s != NULL && resp_msg != NULL && tid != NULL);
+    
+    *tid = 0;
+    cmd  = resp_msg->packet->header.command;
+    while (cmd != SMB_CMD_TREE_CONNECT)
+        if (!smb_message_andx_next(resp_msg, &block, &cmd))
+            return false;
+    
+    // The chain went up to here, the status is the TREE_CONNECT one
+    if (resp_msg->packet->header.status == NT_STATUS_SUCCESS)
+        smb_tree_connect_add(s, resp_msg, block, tid);
+    
+    return true;
+}
+
+#pragma mark - smbTreeConnect
+int smb_tree_connect(smb_session *s, const char *name, smb_tid *tid)
+{
+    smb_message            resp_msg;
+    smb_message           *req_msg;
+    int                    res;
+    
+    assert(s != NULL && name != NULL && tid != NULL);
+    
+    req_msg = smb_message_new(SMB_CMD_TREE_CONNECT);
+    if (!req_msg)
+        return DSM_ERROR_GENERIC;
+    
+    // Packet headers
+    req_msg->packet->header.tid   = 0xffff; // Behavior of libsmbclient
+    
+    smb_message_set_andx_members(req_msg);
+    
+    smb_tree_connect_put_req(s, req_msg, name);
+    
+    pthread_mutex_lock(&s->io_lock);
+    res = smb_session_send_msg(s, req_msg);
+    smb_message_destroy(req_msg);
+    if (!res || !smb_session_recv_msg(s, &resp_msg))
+        res = smb_session_network_error(s);
+    else if (!smb_session_check_nt_status(s, &resp_msg))
+        res = DSM_ERROR_NT;
+    else
+        res = smb_tree_connect_add(s, &resp_msg, 0, tid);
+    pthread_mutex_unlock(&s->io_lock);
+    
+    return res;
 }
 
 #pragma mark - smbTreeDisconnect
@@ -363,6 +427,7 @@ int smb_tree_disconnect(smb_session *s, smb_tid tid)
     smb_tree_disconnect_resp *resp;
     smb_message              *req_msg;
     smb_message               resp_msg;
+    int                       res;
     
     assert(s != NULL);
     
@@ -378,22 +443,26 @@ int smb_tree_disconnect(smb_session *s, smb_tid tid)
     req.bct = 0; // Must be 0
     SMB_MSG_PUT_PKT(req_msg, req);
     
-    if (!smb_session_send_msg(s, req_msg))
+    pthread_mutex_lock(&s->io_lock);
+    // The server closes the cached handles of the share itself
+    smb_session_file_cache_drop(s, tid);
+    
+    res = smb_session_send_msg(s, req_msg);
+    smb_message_destroy(req_msg);
+    if (!res || !smb_session_recv_msg(s, &resp_msg))
+        res = smb_session_network_error(s);
+    else if (!smb_session_check_nt_status(s, &resp_msg))
+        res = DSM_ERROR_NT;
+    else
     {
-        smb_message_destroy(req_msg);
-        return DSM_ERROR_NETWORK;
+        resp  = (smb_tree_disconnect_resp *)resp_msg.packet->payload;
+        if ((resp->wct != 0) || (resp->bct != 0))
+            res = smb_session_network_error(s);
+        else
+            res = DSM_SUCCESS;
     }
-    smb_message_destroy(req_msg);
-    
-    if (!smb_session_recv_msg(s, &resp_msg))
-        return DSM_ERROR_NETWORK;
-    if (!smb_session_check_nt_status(s, &resp_msg))
-        return DSM_ERROR_NT;
-    
-    resp  = (smb_tree_disconnect_resp *)resp_msg.packet->payload;
-    if ((resp->wct != 0) || (resp->bct != 0))
-        return DSM_ERROR_NETWORK;
+    pthread_mutex_unlock(&s->io_lock);
     
-    return DSM_SUCCESS;
+    return res;
 }
 @end
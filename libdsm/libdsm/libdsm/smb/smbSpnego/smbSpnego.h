@@ -11,7 +11,11 @@
 
 @interface smbSpnego : NSObject
 #pragma mark - smbSessionLoginSpnego
+/*!Login with SPNEGO/NTLMSSP
+ * If 'share' isn't NULL, a TREE_CONNECT to it is chained to the last SESSION_SETUP, and 'tid' is set to its tid (0 if it couldn't be connected).
+ */
 int smb_session_login_spnego(smb_session *s, const char *domain,
-                                         const char *user, const char *password);
+                                         const char *user, const char *password,
+                                         const char *share, smb_tid *tid);
 @end
 #endif
@@ -105,7 +105,7 @@ static int negotiate(smb_session *s, const char *domain)
     req.max_buffer       = SMB_SESSION_MAX_BUFFER;
     req.mpx_count        = 16;
     req.vc_count         = 1;
-    req.caps             = s->srv.caps;
+    req.caps             = s->srv.caps | SMB_CAPS_LARGE_READX | SMB_CAPS_LARGE_WRITEX;
     req.session_key      = s->srv.session_key;
     req.xsec_blob_size = der_size;
     req.payload_size   = msg->cursor - sizeof(smb_session_xsec_req);
@@ -116,7 +116,7 @@ static int negotiate(smb_session *s, const char *domain)
     if (!smb_session_send_msg(s, msg))
     {
         smb_message_destroy(msg);
-        return DSM_ERROR_NETWORK;
+        return smb_session_network_error(s);
     }
     
     smb_message_destroy(msg);
@@ -142,7 +142,7 @@ static int      challenge(smb_session *s)
     
     if (smb_session_recv_msg(s, &msg) == 0)
     {
-        return DSM_ERROR_NETWORK;
+        return smb_session_network_error(s);
     }
     
     if (msg.packet->header.status != NT_STATUS_MORE_PROCESSING_REQUIRED)
@@ -188,7 +188,7 @@ static int      challenge(smb_session *s)
 }
 
 static int      auth(smb_session *s, const char *domain, const char *user,
-                     const char *password)
+                     const char *password, const char *share, smb_tid *tid)
 {
     smb_message           *msg = NULL, resp;
     smb_session_xsec_req  req;
@@ -247,25 +247,33 @@ static int      auth(smb_session *s, const char *domain, const char *user,
     req.max_buffer       = SMB_SESSION_MAX_BUFFER;
     req.mpx_count        = 16; // XXX ?
     req.vc_count         = 1;
-    req.caps             = s->srv.caps; // XXX caps & our_caps_mask
+    req.caps             = s->srv.caps | SMB_CAPS_LARGE_READX | SMB_CAPS_LARGE_WRITEX; // XXX caps & our_caps_mask
     req.session_key      = s->srv.session_key;
     req.xsec_blob_size = der_size;
     req.payload_size   = msg->cursor - sizeof(smb_session_xsec_req);
     SMB_MSG_INSERT_PKT(msg, 0, req);
     
+    // The last SESSION_SETUP can carry the TREE_CONNECT
+    if (share != NULL)
+    {
+        smb_message_chain(msg, 0, SMB_CMD_TREE_CONNECT);
+        smb_tree_connect_put_req(s, msg, share);
+    }
+    
     asn1_delete_structure(&token);
     
     if (!smb_session_send_msg(s, msg))
     {
         smb_message_destroy(msg);
-        return DSM_ERROR_NETWORK;
+        return smb_session_network_error(s);
     }
     smb_message_destroy(msg);
     
     if (smb_session_recv_msg(s, &resp) == 0)
-        return DSM_ERROR_NETWORK;
+        return smb_session_network_error(s);
     
-    if (!smb_session_check_nt_status(s, &resp))
+    if ((share == NULL || !smb_tree_connect_chained(s, &resp, tid))
+        && !smb_session_check_nt_status(s, &resp))
         return DSM_ERROR_NT;
     else
     {
@@ -286,7 +294,8 @@ error:
 }
 #pragma mark - smbSessionLoginSpnego
 int smb_session_login_spnego(smb_session *s, const char *domain,
-                                         const char *user, const char *password)
+                                         const char *user, const char *password,
+                                         const char *share, smb_tid *tid)
 {
     int res;
     assert(s != NULL && domain != NULL && user != NULL && password != NULL);
@@ -302,7 +311,7 @@ int smb_session_login_spnego(smb_session *s, const char *domain,
     if ((res = challenge(s)) != DSM_SUCCESS)
         goto error;
     
-    res = auth(s, domain, user, password);
+    res = auth(s, domain, user, password, share, tid);
     
     clean_asn1(s);
     
@@ -45,6 +45,20 @@ smb_stat_list smb_find(smb_session *s, smb_tid tid, const char *pattern);
  */
 smb_stat smb_fstat(smb_session *s, smb_tid tid, const char *path);
 
+#pragma mark - smbSetFileInfo
+/*!Set an information of an open file with a TRANS2 SET_FILE_INFORMATION request
+ * This is the raw request: it isn't serialized with the other I/O of the session, see smb_ftruncate() and smb_fallocate() for the safe wrappers.
+ *\param s The session object
+ *\param tid The tree id of the share the file is in
+ *\param fid The SMB file id of the open file
+ *\param interest The information level (e.g. SMB_SET_FILE_END_OF_FILE_INFO)
+ *\param data The information structure of this level
+ *\param size The size of data
+ *\returns 0 on success or a DSM error code in case of error
+ */
+int smb_set_file_info(smb_session *s, smb_tid tid, smb_fid fid,
+                      uint16_t interest, const void *data, size_t size);
+
 #pragma mark - smbStatFd
 /*!Get the status of an open file from it's file descriptor
  * The file status will be those at the time of open
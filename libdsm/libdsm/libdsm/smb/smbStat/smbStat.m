@@ -299,8 +299,10 @@ static void smb_find_next_parse(smb_message *msg, smb_file **files_p)
     return;
 }
 
-#pragma mark - smbFind
-smb_file  *smb_find(smb_session *s, smb_tid tid, const char *pattern)
+// FIND_FIRST then FIND_NEXT until the end of the search. The caller holds
+// the session io_lock.
+static smb_file *smb_find_locked(smb_session *s, smb_tid tid,
+                                 const char *pattern)
 {
     smb_file                  *files = NULL;
     smb_message               *msg;
@@ -312,8 +314,6 @@ smb_file  *smb_find(smb_session *s, smb_tid tid, const char *pattern)
     uint16_t                  resume_key;
     uint16_t                  error_offset;
     
-    assert(s != NULL && pattern != NULL);
-    
     // Send FIND_FIRST request
     msg = smb_trans2_find_first(s,tid,pattern);
     if (msg)
@@ -378,6 +378,20 @@ smb_file  *smb_find(smb_session *s, smb_tid tid, const char *pattern)
     return files;
 }
 
+#pragma mark - smbFind
+smb_file  *smb_find(smb_session *s, smb_tid tid, const char *pattern)
+{
+    smb_file                  *files;
+    
+    assert(s != NULL && pattern != NULL);
+    
+    pthread_mutex_lock(&s->io_lock);
+    files = smb_find_locked(s, tid, pattern);
+    pthread_mutex_unlock(&s->io_lock);
+    
+    return files;
+}
+
 #pragma mark - smbFStat
 smb_file  *smb_fstat(smb_session *s, smb_tid tid, const char *path)
 {
@@ -434,16 +448,15 @@ smb_file  *smb_fstat(smb_session *s, smb_tid tid, const char *path)
     while (padding--)
         smb_message_put8(msg, 0);
     
+    // The reply is read from the transport buffer, which is ours until the
+    // lock is released
+    pthread_mutex_lock(&s->io_lock);
     res = smb_session_send_msg(s, msg);
     smb_message_destroy(msg);
-    if (!res)
-    {
-        return NULL;
-    }
-    
-    if (!smb_session_recv_msg(s, &reply)
+    if (!res || !smb_session_recv_msg(s, &reply)
         || !smb_session_check_nt_status(s, &reply))
     {
+        pthread_mutex_unlock(&s->io_lock);
         return NULL;
     }
     
@@ -451,7 +464,10 @@ smb_file  *smb_fstat(smb_session *s, smb_tid tid, const char *path)
     info      = (smb_tr2_path_info *)(tr2_resp->payload + 4); //+4 is padding
     file      = calloc(1, sizeof(smb_file));
     if (!file)
+    {
+        pthread_mutex_unlock(&s->io_lock);
         return NULL;
+    }
     
     file->name_len  = smb_from_utf16((const char *)info->name, info->name_len,
                                      &file->name);
@@ -465,16 +481,87 @@ smb_file  *smb_fstat(smb_session *s, smb_tid tid, const char *path)
     file->size        = info->size;
     file->attr        = info->attr;
     file->is_dir      = info->is_dir;
+    pthread_mutex_unlock(&s->io_lock);
     
     return file;
 }
 
+#pragma mark - smbSetFileInfo
+int smb_set_file_info(smb_session *s, smb_tid tid, smb_fid fid,
+                      uint16_t interest, const void *data, size_t size)
+{
+    smb_message           *msg, reply;
+    smb_trans2_req        tr2;
+    smb_tr2_set_file_info info;
+    size_t                offset, padding;
+    int                   res;
+    
+    assert(s != NULL && (data != NULL || size == 0));
+    
+    // The parameters follow the request, the data is aligned on 4 bytes
+    offset  = sizeof(smb_header) + sizeof(smb_trans2_req);
+    offset += sizeof(smb_tr2_set_file_info);
+    padding = (4 - offset % 4) % 4;
+    offset += padding;
+    
+    msg = smb_message_new(SMB_CMD_TRANS2);
+    if (!msg)
+        return DSM_ERROR_GENERIC;
+    msg->packet->header.tid = tid;
+    
+    SMB_MSG_INIT_PKT(tr2);
+    tr2.wct                = 15;
+    tr2.total_param_count  = sizeof(smb_tr2_set_file_info);
+    tr2.total_data_count   = (uint16_t)size;
+    tr2.param_count        = tr2.total_param_count;
+    tr2.data_count         = tr2.total_data_count;
+    tr2.max_param_count    = 2; // The response only holds an EA error offset
+    tr2.max_data_count     = 0;
+    tr2.param_offset       = sizeof(smb_header) + sizeof(smb_trans2_req);
+    tr2.data_offset        = (uint16_t)offset;
+    tr2.setup_count        = 1;
+    tr2.cmd                = SMB_TR2_SET_FILE_INFO;
+    tr2.bct                = (uint16_t)(sizeof(tr2.padding)
+                                        + sizeof(smb_tr2_set_file_info)
+                                        + padding + size);
+    SMB_MSG_PUT_PKT(msg, tr2);
+    
+    SMB_MSG_INIT_PKT(info);
+    info.fid        = fid;
+    info.interest   = interest;
+    SMB_MSG_PUT_PKT(msg, info);
+    
+    while (padding--)
+        smb_message_put8(msg, 0);
+    if (size)
+        smb_message_append(msg, data, size);
+    
+    pthread_mutex_lock(&s->io_lock);
+    res = smb_session_send_msg(s, msg);
+    smb_message_destroy(msg);
+    if (!res || !smb_session_recv_msg(s, &reply))
+        res = smb_session_network_error(s);
+    else if (!smb_session_check_nt_status(s, &reply))
+        res = DSM_ERROR_NT;
+    else
+        res = DSM_SUCCESS;
+    pthread_mutex_unlock(&s->io_lock);
+    
+    return res;
+}
+
 #pragma mark - smbStatFd
 smb_stat smb_stat_fd(smb_session *s, smb_fd fd)
 {
+    smb_stat    st;
+    
     assert(s != NULL && fd);
     
-    return smb_session_file_get(s, fd);
+    pthread_mutex_lock(&s->io_lock);
+    st = smb_session_file_get(s, fd);
+    pthread_mutex_unlock(&s->io_lock);
+    
+    return st;
 }
 
 #pragma mark - smbStatDestroy
@@ -0,0 +1,115 @@
+//
+//  smbTransfer.h
+//  test
+//
+//  Created by trekvn on 4/13/17.
+//  Copyright © 2017 trekvn. All rights reserved.
+//
+#ifdef __OBJC__
+#import <Foundation/Foundation.h>
+#import "smbHeader.h"
+
+@interface smbTransfer : NSObject
+
+#pragma mark - smbTransferOptsInit
+/*!Fill an smb_transfer_opts with the defaults
+ * The whole file from offset 0, three buffers of #SMB_TRANSFER_BUFFER_SIZE bytes, destination preallocated, local page cache used, holes skipped, no progress callback.
+ *\param opts The options to initialize
+ */
+void smb_transfer_opts_init(smb_transfer_opts *opts);
+
+#pragma mark - smbDownloadToFd
+/*!Copy an open SMB file to a local file descriptor
+ * A thread reads the SMB file while the calling thread writes to 'local_fd', through a ring of two or three buffers, so the network and the local disk work at the same time instead of taking turns like an smb_fread()/write() loop.
+ * Data is read and written at the same offset on both sides (opts->offset), the seek offsets aren't used nor moved. 'local_fd' must be open for writing and support pwrite().
+ * With opts->preallocate, the local space is reserved before the copy (fallocate() or F_PREALLOCATE), which avoids fragmentation. With opts->direct, the local page cache is bypassed (O_DIRECT or F_NOCACHE) if the system and file system allow it.
+ With opts->sparse, when the SMB file has less allocated space than its size and the local range is past the local end of file, only the allocated ranges listed by the server are transferred and the holes are kept as holes.
+ If opts->callbacks is set, its pf_on_progress is called from the calling thread each time a buffer has been written, with the throughput and the estimated time left. Returning false from it stops the transfer.
+ *\param s The session object
+ *\param fd The SMB file descriptor, open for reading
+ *\param local_fd The local file descriptor
+ *\param opts The transfer options, or NULL for the defaults (see smb_transfer_opts_init())
+ *\param done Set to the number of bytes copied from opts->offset, less than the range size at the end of the SMB file or on error. Can be NULL
+ *\returns 0 on success, #DSM_ERROR_CANCELED if the progress callback stopped it, or another DSM error code in case of error
+ */
+int smb_download_to_fd(smb_session *s, smb_fd fd, int local_fd,
+                       const smb_transfer_opts *opts, uint64_t *done);
+
+#pragma mark - smbUploadFromFd
+/*!Copy a local file descriptor to an open SMB file
+ * Same as smb_download_to_fd() the other way around: a thread reads 'local_fd' while the calling thread writes the SMB file. 'local_fd' must be open for reading and support pread().
+ With opts->preallocate, when the size of the range is known, the server space up to its end is reserved once with smb_fallocate() before the copy.
+ With opts->sparse, when 'local_fd' is a regular file with holes, blocks of #SMB_TRANSFER_ZERO_BLOCK zeros aren't sent: the SMB file is made sparse and these ranges are zeroed by the server (or just skipped past its end of file).
+ *\param s The session object
+ *\param fd The SMB file descriptor, open for writing
+ *\param local_fd The local file descriptor
+ *\param opts The transfer options, or NULL for the defaults (see smb_transfer_opts_init())
+ *\param done Set to the number of bytes copied from opts->offset, less than the range size at the end of the local file or on error. Can be NULL
+ *\returns 0 on success, #DSM_ERROR_CANCELED if the progress callback stopped it, or another DSM error code in case of error
+ */
+int smb_upload_from_fd(smb_session *s, smb_fd fd, int local_fd,
+                       const smb_transfer_opts *opts, uint64_t *done);
+
+#pragma mark - smbDownloadResumable
+/*!Download a file to a local path, resuming an interrupted download
+ * The progress is saved every #SMB_TRANSFER_CHECKPOINT_INTERVAL bytes (and when the transfer stops) in the small file 'checkpoint', along with the size and modification time of the SMB file. The local data is committed to disk before each save.
+ * When the checkpoint matches the SMB file, the download restarts where the checkpoint says, otherwise (no checkpoint, or the SMB file changed) from the start. The checkpoint is removed once the download is complete.
+ * opts->offset and opts->length are ignored, the other options are those of smb_download_to_fd().
+ *\param s The session object
+ *\param tid The tid of the share the file is in, obtained via smb_tree_connect()
+ *\param path The path of the SMB file
+ *\param local_path The path of the local file, created if needed
+ *\param checkpoint The path of the checkpoint file
+ *\param opts The transfer options, or NULL for the defaults (see smb_transfer_opts_init())
+ *\returns 0 once the file is complete, #DSM_ERROR_CANCELED if the progress callback stopped it, or another DSM error code in case of error. The download can be resumed in both cases.
+ */
+int smb_download_resumable(smb_session *s, smb_tid tid, const char *path,
+                           const char *local_path, const char *checkpoint,
+                           const smb_transfer_opts *opts);
+
+#pragma mark - smbUploadResumable
+/*!Upload a local file, resuming an interrupted upload
+ * Same as smb_download_resumable() the other way around: the checkpoint records the size and modification time of the local file, and the SMB file is flushed before each save. The SMB file is kept when resuming, it is created or truncated otherwise.
+ *\param s The session object
+ *\param tid The tid of the share the file is in, obtained via smb_tree_connect()
+ *\param local_path The path of the local file
+ *\param path The path of the SMB file
+ *\param checkpoint The path of the checkpoint file
+ *\param opts The transfer options, or NULL for the defaults (see smb_transfer_opts_init())
+ *\returns 0 once the file is complete, #DSM_ERROR_CANCELED if the progress callback stopped it, or another DSM error code in case of error. The upload can be resumed in both cases.
+ */
+int smb_upload_resumable(smb_session *s, smb_tid tid, const char *local_path,
+                         const char *path, const char *checkpoint,
+                         const smb_transfer_opts *opts);
+
+#pragma mark - smbDownloadStriped
+/*!Download a file with several sessions at once
+ * A single TCP connection seldom fills the link to a fast server. This opens 'streams' independent sessions to the server (connect, login and tree connect), each one opening 'path', and they read disjoint ranges of the file in parallel into 'local_fd'.
+ * Each session starts with its own share of the file and takes ranges of #SMB_TRANSFER_STRIPE_SIZE bytes from it. A session done with its share steals the second half of what is left of the largest other share, so slow connections don't hold the whole transfer back. A session that can't connect leaves its share to the others.
+ * The local file is preallocated once if opts->preallocate is set. opts->offset and opts->length are ignored, the progress callback gets the progress of the whole file.
+ *\param target The server, credentials and share
+ *\param path The path of the SMB file
+ *\param local_fd The local file descriptor, open for writing
+ *\param streams The number of sessions, at most #SMB_TRANSFER_STREAMS_MAX (and no more than the file has stripes)
+ *\param opts The transfer options of each session, or NULL for the defaults (see smb_transfer_opts_init())
+ *\returns 0 once the whole file is copied, #DSM_ERROR_CANCELED if the progress callback stopped it, or another DSM error code in case of error
+ */
+int smb_download_striped(const smb_stripe_target *target, const char *path,
+                         int local_fd, size_t streams,
+                         const smb_transfer_opts *opts);
+
+#pragma mark - smbUploadStriped
+/*!Upload a file with several sessions at once
+ * Same as smb_download_striped() the other way around. The first session creates (or truncates) the SMB file, with all its space allocated if opts->preallocate is set, the others open it and write their ranges in parallel.
+ *\param target The server, credentials and share
+ *\param local_fd The local file descriptor of a regular file, open for reading
+ *\param path The path of the SMB file
+ *\param streams The number of sessions, at most #SMB_TRANSFER_STREAMS_MAX (and no more than the file has stripes)
+ *\param opts The transfer options of each session, or NULL for the defaults (see smb_transfer_opts_init())
+ *\returns 0 once the whole file is copied, #DSM_ERROR_CANCELED if the progress callback stopped it, or another DSM error code in case of error
+ */
+int smb_upload_striped(const smb_stripe_target *target, int local_fd,
+                       const char *path, size_t streams,
+                       const smb_transfer_opts *opts);
+@end
+#endif
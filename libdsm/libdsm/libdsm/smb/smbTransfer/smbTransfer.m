@@ -0,0 +1,1236 @@
+//
+//  smbTransfer.m
+//  test
+//
+//  Created by trekvn on 4/13/17.
+//  Copyright © 2017 trekvn. All rights reserved.
+//
+
+// fallocate() and FALLOC_FL_KEEP_SIZE
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#import <fcntl.h>
+#import <inttypes.h>
+#import <stdio.h>
+#import <time.h>
+#import <unistd.h>
+#import <sys/stat.h>
+#import "smbTransfer.h"
+
+#define SMB_TRANSFER_CHECKPOINT_MAGIC   "libdsm transfer checkpoint\n"
+
+typedef struct smb_transfer smb_transfer;
+
+// Content of a checkpoint file: the identity of the source, and how far the
+// destination is known to be right.
+typedef struct
+{
+    uint64_t            size;
+    uint64_t            mtime;
+    uint64_t            offset;
+} smb_transfer_checkpoint;
+
+// Moves one buffer between 'buf' and a file, returns the number of bytes
+// moved (less than 'size' at the end of the source) or -1 on error.
+typedef ssize_t (*smb_transfer_fn)(smb_transfer *t, void *buf, size_t size,
+                                   off_t offset);
+
+// One buffer of the ring shared by the producer and consumer threads
+typedef struct
+{
+    uint8_t             *data;
+    off_t               offset;         // File offset of data[0]
+    size_t              len;            // Number of valid bytes
+    bool                full;           // Filled by the producer, not consumed yet
+} smb_transfer_buf;
+
+struct smb_transfer
+{
+    smb_session         *s;
+    smb_fd              fd;
+    int                 local_fd;
+    int                 local_flags;    // To restore after O_DIRECT
+    bool                direct;         // Local page cache bypassed by us
+    smb_transfer_fn     produce;        // Runs in the producer thread
+    smb_transfer_fn     consume;        // Runs in the calling thread
+    smb_transfer_buf    bufs[SMB_TRANSFER_BUFFERS_MAX];
+    size_t              count;          // Number of buffers used
+    size_t              size;           // Size of each buffer
+    off_t               offset;         // Start of the range
+    uint64_t            length;         // Size of the range, UINT64_MAX if unknown
+    smb_file_range      *ranges;        // Parts of the range to move, in order
+    size_t              range_count;
+    smb_file_range      whole;          // The only part of dense transfers
+    bool                shared_fd;      // Other ranges are written to local_fd at once
+    off_t               reached;        // Where the producer stopped
+    off_t               consumed;       // End of the last data consumed
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    bool                eof;            // The producer is done
+    bool                failed;         // One side failed, stop both
+    bool                canceled;       // By the progress callback
+    const smb_transfer_callbacks *callbacks;
+    uint64_t            total;          // Size of the file, for the progress
+    double              rate;           // Smoothed throughput, bytes/s
+    struct timespec     last_time;      // Of the previous progress report
+    off_t               last_done;
+    const char          *checkpoint;    // Path of the checkpoint file, or NULL
+    smb_transfer_checkpoint ckpt;
+};
+
+static void smb_transfer_set_direct(smb_transfer *t, bool on)
+{
+#if defined(O_DIRECT)
+    if (fcntl(t->local_fd, F_SETFL, on ? t->local_flags | O_DIRECT
+              : t->local_flags) != -1)
+        t->direct = on;
+#elif defined(F_NOCACHE)
+    if (fcntl(t->local_fd, F_NOCACHE, on ? 1 : 0) != -1)
+        t->direct = on;
+#else
+    (void)t;
+    (void)on;
+#endif
+}
+
+static void smb_transfer_preallocate(int fd, off_t offset, uint64_t length)
+{
+#if defined(__linux__)
+    // Keep the size, a partial copy must not look complete
+    fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, length);
+#elif defined(F_PREALLOCATE)
+    fstore_t    store;
+    struct stat st;
+    
+    if (fstat(fd, &st) == -1 || (uint64_t)st.st_size >= offset + length)
+        return;
+    memset(&store, 0, sizeof(store));
+    store.fst_flags   = F_ALLOCATECONTIG;
+    store.fst_posmode = F_PEOFPOSMODE;
+    store.fst_length  = offset + length - st.st_size;
+    if (fcntl(fd, F_PREALLOCATE, &store) == -1)
+    {
+        // Fragmented is still better than nothing
+        store.fst_flags = F_ALLOCATEALL;
+        fcntl(fd, F_PREALLOCATE, &store);
+    }
+#else
+    (void)fd;
+    (void)offset;
+    (void)length;
+#endif
+}
+
+static void smb_transfer_advise(smb_transfer *t)
+{
+#if defined(POSIX_FADV_SEQUENTIAL)
+    posix_fadvise(t->local_fd, t->offset,
+                  t->length == UINT64_MAX ? 0 : (off_t)t->length,
+                  POSIX_FADV_SEQUENTIAL);
+#elif defined(F_RDAHEAD)
+    fcntl(t->local_fd, F_RDAHEAD, 1);
+#else
+    (void)t;
+#endif
+}
+
+static ssize_t smb_transfer_local_read(smb_transfer *t, void *buf, size_t size,
+                                       off_t offset)
+{
+    size_t      done = 0;
+    ssize_t     res;
+    
+    while (done < size)
+    {
+        res = pread(t->local_fd, (uint8_t *)buf + done, size - done, offset + done);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res < 0 && errno == EINVAL && t->direct)
+        {
+            // Unaligned tail, O_DIRECT can't do it
+            smb_transfer_set_direct(t, false);
+            continue;
+        }
+        if (res < 0)
+            return -1;
+        if (res == 0)
+            break;
+        done += res;
+    }
+    
+    return done;
+}
+
+static ssize_t smb_transfer_local_write(smb_transfer *t, void *buf, size_t size,
+                                        off_t offset)
+{
+    size_t      done = 0;
+    ssize_t     res;
+    
+    while (done < size)
+    {
+        res = pwrite(t->local_fd, (uint8_t *)buf + done, size - done, offset + done);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res < 0 && errno == EINVAL && t->direct)
+        {
+            smb_transfer_set_direct(t, false);
+            continue;
+        }
+        if (res <= 0)
+            return done > 0 ? (ssize_t)done : -1;
+        done += res;
+    }
+    
+    return done;
+}
+
+static ssize_t smb_transfer_remote_read(smb_transfer *t, void *buf, size_t size,
+                                        off_t offset)
+{
+    return smb_pread(t->s, t->fd, buf, size, offset);
+}
+
+static ssize_t smb_transfer_remote_write(smb_transfer *t, void *buf, size_t size,
+                                         off_t offset)
+{
+    return smb_pwrite(t->s, t->fd, buf, size, offset);
+}
+
+static bool smb_transfer_is_zero(const uint8_t *data, size_t size)
+{
+    return size == 0 || (data[0] == 0 && memcmp(data, data + 1, size - 1) == 0);
+}
+
+// Size of the zero detection block at 'offset', blocks are aligned on the
+// file offset.
+static size_t smb_transfer_block(off_t offset, size_t left)
+{
+    size_t      len = SMB_TRANSFER_ZERO_BLOCK - offset % SMB_TRANSFER_ZERO_BLOCK;
+    
+    return len < left ? len : left;
+}
+
+static bool smb_transfer_zero_block(smb_transfer *t, const uint8_t *data,
+                                    size_t len, off_t offset)
+{
+    // The last block is always written, zeroing doesn't extend files
+    return offset + (off_t)len < t->offset + (off_t)t->length
+           && smb_transfer_is_zero(data, len);
+}
+
+// Same as smb_transfer_remote_write(), but the blocks full of zeros are
+// zeroed by the server (or skipped past its end of file) instead of sent.
+static ssize_t smb_transfer_remote_write_sparse(smb_transfer *t, void *buf,
+                                                size_t size, off_t offset)
+{
+    uint8_t     *data = buf;
+    size_t      pos = 0, start, len;
+    bool        zero;
+    ssize_t     res;
+    
+    while (pos < size)
+    {
+        // Find the run of blocks of the same kind
+        start = pos;
+        len   = smb_transfer_block(offset + pos, size - pos);
+        zero  = smb_transfer_zero_block(t, data + pos, len, offset + pos);
+        do
+        {
+            pos += len;
+            len  = smb_transfer_block(offset + pos, size - pos);
+        } while (pos < size
+                 && smb_transfer_zero_block(t, data + pos, len, offset + pos) == zero);
+        
+        len = pos - start;
+        if (!zero)
+        {
+            res = smb_pwrite(t->s, t->fd, data + start, len, offset + start);
+            if (res != (ssize_t)len)
+                return start + (res > 0 ? res : 0);
+        }
+        else if ((uint64_t)(offset + start) < smb_stat_get(smb_stat_fd(t->s, t->fd), SMB_STAT_SIZE)
+                 && smb_file_zero(t->s, t->fd, offset + start, len) != DSM_SUCCESS)
+            return start;
+    }
+    
+    return size;
+}
+
+// Lists the allocated parts of the remote range, NULL if the server can't
+// tell.
+static smb_file_range *smb_transfer_remote_ranges(smb_transfer *t, size_t *count)
+{
+    smb_file_range      *ranges = NULL, *tmp;
+    smb_file_range      *r;
+    off_t               pos = t->offset, end = t->offset + t->length;
+    ssize_t             res;
+    
+    *count = 0;
+    while (pos < end)
+    {
+        tmp = realloc(ranges, (*count + SMB_ALLOC_RANGES_MAX) * sizeof(smb_file_range));
+        if (tmp == NULL)
+            goto error;
+        ranges = tmp;
+        
+        res = smb_file_allocated_ranges(t->s, t->fd, pos, end - pos,
+                                        ranges + *count, SMB_ALLOC_RANGES_MAX);
+        if (res < 0)
+            goto error;
+        if (res == 0)
+            break;
+        
+        for (r = ranges + *count; r < ranges + *count + res; r++)
+        {
+            // Clip what the server rounded to its clusters
+            if ((off_t)r->offset < pos)
+            {
+                r->length = r->offset + r->length > (uint64_t)pos
+                            ? r->offset + r->length - pos : 0;
+                r->offset = pos;
+            }
+            if (r->offset + r->length > (uint64_t)end)
+                r->length = r->offset < (uint64_t)end ? end - r->offset : 0;
+        }
+        r--;
+        pos     = r->offset + r->length > (uint64_t)pos
+                  ? (off_t)(r->offset + r->length) : (off_t)end;
+        *count += res;
+        if (res < SMB_ALLOC_RANGES_MAX)
+            break;
+    }
+    
+    return ranges;
+    
+error:
+    free(ranges);
+    *count = 0;
+    return NULL;
+}
+
+static bool smb_transfer_checkpoint_read(const char *path,
+                                         smb_transfer_checkpoint *ckpt)
+{
+    FILE        *f;
+    int         res;
+    
+    if ((f = fopen(path, "r")) == NULL)
+        return false;
+    res = fscanf(f, SMB_TRANSFER_CHECKPOINT_MAGIC "size %" SCNu64 "\nmtime %"
+                 SCNu64 "\noffset %" SCNu64, &ckpt->size, &ckpt->mtime,
+                 &ckpt->offset);
+    fclose(f);
+    
+    return res == 3;
+}
+
+// Replaces the checkpoint file at once, it never holds a partial content.
+static int smb_transfer_checkpoint_write(const char *path,
+                                         const smb_transfer_checkpoint *ckpt)
+{
+    char        tmp[1024];
+    FILE        *f;
+    bool        ok;
+    
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+        return -1;
+    if ((f = fopen(tmp, "w")) == NULL)
+        return -1;
+    
+    ok = fprintf(f, SMB_TRANSFER_CHECKPOINT_MAGIC "size %" PRIu64 "\nmtime %"
+                 PRIu64 "\noffset %" PRIu64 "\n", ckpt->size, ckpt->mtime,
+                 ckpt->offset) > 0;
+    ok = fflush(f) == 0 && ok;
+    ok = fsync(fileno(f)) == 0 && ok;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp, path) == -1)
+    {
+        unlink(tmp);
+        return -1;
+    }
+    
+    return 0;
+}
+
+// Records that the destination is right up to t->consumed. The data has to
+// be committed first, the checkpoint must never be ahead of it.
+static void smb_transfer_checkpoint_save(smb_transfer *t)
+{
+    if (t->consume == smb_transfer_local_write)
+    {
+        if (fsync(t->local_fd) == -1)
+            return;
+    }
+    else if (smb_fflush(t->s, t->fd) != DSM_SUCCESS)
+        return;
+    
+    t->ckpt.offset = t->consumed;
+    smb_transfer_checkpoint_write(t->checkpoint, &t->ckpt);
+}
+
+// Called after each buffer: updates the throughput estimate, saves a
+// checkpoint once in a while and tells the caller. Returns false if the
+// transfer has to stop.
+static bool smb_transfer_report(smb_transfer *t)
+{
+    smb_transfer_progress   progress;
+    struct timespec         now;
+    double                  elapsed, rate;
+    
+    if (t->checkpoint != NULL
+        && t->consumed - (off_t)t->ckpt.offset >= SMB_TRANSFER_CHECKPOINT_INTERVAL)
+        smb_transfer_checkpoint_save(t);
+    
+    if (t->callbacks == NULL || t->callbacks->pf_on_progress == NULL)
+        return true;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - t->last_time.tv_sec)
+              + (now.tv_nsec - t->last_time.tv_nsec) / 1e9;
+    if (elapsed > 0)
+    {
+        // Smoothed, a scheduler shouldn't chase every hiccup
+        rate    = (t->consumed - t->last_done) / elapsed;
+        t->rate = t->rate > 0 ? t->rate * 0.75 + rate * 0.25 : rate;
+        t->last_time = now;
+        t->last_done = t->consumed;
+    }
+    
+    progress.done  = t->consumed;
+    progress.total = t->total;
+    progress.rate  = t->rate;
+    if (t->rate > 0 && t->total >= progress.done)
+        progress.eta = (t->total - progress.done) / t->rate;
+    else
+        progress.eta = -1;
+    
+    if (!t->callbacks->pf_on_progress(t->callbacks->p_opaque, &progress))
+    {
+        t->canceled = true;
+        return false;
+    }
+    
+    return true;
+}
+
+// Fills the buffers in order, waiting for the consumer to release them.
+static void *smb_transfer_producer(void *arg)
+{
+    smb_transfer        *t = arg;
+    smb_transfer_buf    *buf;
+    off_t               offset;
+    uint64_t            left;
+    size_t              i = 0, r, want;
+    ssize_t             res;
+    bool                stop = false;
+    
+    for (r = 0; r < t->range_count && !stop; r++)
+    {
+        offset = t->ranges[r].offset;
+        left   = t->ranges[r].length;
+        while (left > 0)
+        {
+            buf = &t->bufs[i];
+            pthread_mutex_lock(&t->lock);
+            while (buf->full && !t->failed)
+                pthread_cond_wait(&t->cond, &t->lock);
+            stop = t->failed;
+            pthread_mutex_unlock(&t->lock);
+            if (stop)
+                break;
+            
+            want = left < t->size ? (size_t)left : t->size;
+            res  = t->produce(t, buf->data, want, offset);
+            
+            pthread_mutex_lock(&t->lock);
+            if (res < 0)
+                t->failed = true;
+            else if (res > 0)
+            {
+                buf->offset = offset;
+                buf->len    = res;
+                buf->full   = true;
+            }
+            pthread_cond_broadcast(&t->cond);
+            pthread_mutex_unlock(&t->lock);
+            
+            // A short read may hide an error, only the next one tells
+            if (res <= 0)
+            {
+                // End of the source, or error
+                t->reached = offset;
+                stop = true;
+                break;
+            }
+            offset += res;
+            left   -= res;
+            i       = (i + 1) % t->count;
+        }
+    }
+    // The holes after the last part are part of the copy
+    if (!stop)
+        t->reached = t->offset + t->length;
+    
+    pthread_mutex_lock(&t->lock);
+    t->eof = true;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+    
+    return NULL;
+}
+
+// Empties the buffers in order
+static void smb_transfer_consumer(smb_transfer *t)
+{
+    smb_transfer_buf    *buf;
+    size_t              i = 0;
+    ssize_t             res;
+    bool                stop, ok;
+    
+    for (;;)
+    {
+        buf = &t->bufs[i];
+        pthread_mutex_lock(&t->lock);
+        while (!buf->full && !t->eof && !t->failed)
+            pthread_cond_wait(&t->cond, &t->lock);
+        // What was produced before a failure is still good
+        stop = !buf->full;
+        pthread_mutex_unlock(&t->lock);
+        if (stop)
+            break;
+        
+        res = t->consume(t, buf->data, buf->len, buf->offset);
+        t->consumed = buf->offset + (res > 0 ? res : 0);
+        ok = res == (ssize_t)buf->len && smb_transfer_report(t);
+        
+        pthread_mutex_lock(&t->lock);
+        if (!ok)
+            t->failed = true;
+        buf->full = false;
+        stop = t->failed;
+        pthread_cond_broadcast(&t->cond);
+        pthread_mutex_unlock(&t->lock);
+        
+        if (stop)
+            break;
+        i = (i + 1) % t->count;
+    }
+}
+
+// Sets 'done' to how far from t->offset the destination is right, returns
+// 0 unless a side failed or the transfer was canceled.
+static int smb_transfer_run(smb_transfer *t, const smb_transfer_opts *opts,
+                            uint64_t *done)
+{
+    pthread_t           producer;
+    size_t              i;
+    off_t               end;
+    int                 res = DSM_SUCCESS;
+    
+    if (t->ranges == NULL)
+    {
+        t->whole.offset = t->offset;
+        t->whole.length = t->length;
+        t->ranges       = &t->whole;
+        t->range_count  = 1;
+    }
+    t->reached   = t->offset;
+    t->consumed  = t->offset;
+    t->last_done = t->offset;
+    clock_gettime(CLOCK_MONOTONIC, &t->last_time);
+    
+    t->count = opts->buffers < 2 ? 2 : opts->buffers;
+    t->count = t->count > SMB_TRANSFER_BUFFERS_MAX ? SMB_TRANSFER_BUFFERS_MAX : t->count;
+    // Whole pages, as O_DIRECT wants
+    t->size  = (opts->buffer_size + SMB_TRANSFER_ALIGN - 1) & ~(size_t)(SMB_TRANSFER_ALIGN - 1);
+    t->size  = t->size ? t->size : SMB_TRANSFER_ALIGN;
+    
+    for (i = 0; i < t->count; i++)
+        if (posix_memalign((void **)&t->bufs[i].data, SMB_TRANSFER_ALIGN, t->size) != 0)
+        {
+            t->bufs[i].data = NULL;
+            res = DSM_ERROR_GENERIC;
+            goto end;
+        }
+    
+    t->local_flags = fcntl(t->local_fd, F_GETFL);
+    if (opts->direct && t->local_flags != -1 && t->offset % SMB_TRANSFER_ALIGN == 0)
+        smb_transfer_set_direct(t, true);
+    smb_transfer_advise(t);
+    
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->cond, NULL);
+    if (pthread_create(&producer, NULL, smb_transfer_producer, t) == 0)
+    {
+        smb_transfer_consumer(t);
+        pthread_join(producer, NULL);
+    }
+    else
+        t->failed = true;
+    pthread_cond_destroy(&t->cond);
+    pthread_mutex_destroy(&t->lock);
+    
+    if (t->direct)
+        smb_transfer_set_direct(t, false);
+    
+end:
+    for (i = 0; i < t->count; i++)
+        free(t->bufs[i].data);
+    
+    if (res == DSM_SUCCESS && t->failed)
+        res = t->canceled ? DSM_ERROR_CANCELED : smb_session_network_error(t->s);
+    end   = res != DSM_SUCCESS ? t->consumed : t->reached;
+    *done = (uint64_t)(end - t->offset);
+    
+    return res;
+}
+
+// Copies the SMB file t->fd to t->local_fd, t->s, t->fd and t->local_fd
+// being set.
+static int smb_transfer_download(smb_transfer *t, const smb_transfer_opts *opts,
+                                 uint64_t *done)
+{
+    smb_stat            st;
+    struct stat         local_st;
+    uint64_t            size;
+    int                 res;
+    bool                sparse;
+    
+    *done = 0;
+    if ((st = smb_stat_fd(t->s, t->fd)) == NULL)
+        return DSM_ERROR_GENERIC;
+    
+    t->produce   = smb_transfer_remote_read;
+    t->consume   = smb_transfer_local_write;
+    t->offset    = opts->offset;
+    t->callbacks = opts->callbacks;
+    
+    // What is left to read from the offset
+    size = smb_stat_get(st, SMB_STAT_SIZE);
+    sparse = opts->sparse && smb_stat_get(st, SMB_STAT_ALLOC_SIZE) < size;
+    t->total = size;
+    size = size > (uint64_t)opts->offset ? size - opts->offset : 0;
+    t->length = opts->length && opts->length < size ? opts->length : size;
+    
+    // Only fetch the allocated parts of files with holes, if the server can
+    // list them. The local holes are left unwritten, so there must be no
+    // local data to overwrite there.
+    if (sparse && t->length > 0 && fstat(t->local_fd, &local_st) == 0
+        && local_st.st_size <= t->offset)
+        t->ranges = smb_transfer_remote_ranges(t, &t->range_count);
+    
+    if (opts->preallocate && t->length > 0 && t->ranges == NULL)
+        smb_transfer_preallocate(t->local_fd, t->offset, t->length);
+    
+    res = smb_transfer_run(t, opts, done);
+    
+    // A hole at the end still has to be there. With other ranges written
+    // meanwhile, this could cut theirs: the caller sets the size once done.
+    if (t->ranges != &t->whole && !t->shared_fd && *done > 0
+        && fstat(t->local_fd, &local_st) == 0
+        && (uint64_t)local_st.st_size < (uint64_t)t->offset + *done)
+        ftruncate(t->local_fd, t->offset + (off_t)*done);
+    if (t->ranges != &t->whole)
+        free(t->ranges);
+    t->ranges = NULL;
+    
+    return res;
+}
+
+// Copies t->local_fd to the SMB file t->fd, t->s, t->fd and t->local_fd
+// being set.
+static int smb_transfer_upload(smb_transfer *t, const smb_transfer_opts *opts,
+                               uint64_t *done)
+{
+    struct stat         st;
+    smb_stat            st_remote;
+    
+    t->produce   = smb_transfer_local_read;
+    t->consume   = smb_transfer_remote_write;
+    t->offset    = opts->offset;
+    t->callbacks = opts->callbacks;
+    
+    if (fstat(t->local_fd, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        t->total  = st.st_size;
+        t->length = st.st_size > opts->offset ? st.st_size - opts->offset : 0;
+        t->length = opts->length && opts->length < t->length ? opts->length : t->length;
+        // A source with holes is worth scanning for zeros
+        if (opts->sparse && (uint64_t)st.st_blocks * 512 < (uint64_t)st.st_size)
+        {
+            smb_file_set_sparse(t->s, t->fd);
+            t->consume = smb_transfer_remote_write_sparse;
+        }
+    }
+    else
+        t->length = opts->length ? opts->length : UINT64_MAX;
+    
+    // Reserve the server space once rather than write after write. Only
+    // ever grow it: an allocation below the end of file truncates.
+    if (opts->preallocate && t->length > 0 && t->length != UINT64_MAX
+        && (st_remote = smb_stat_fd(t->s, t->fd)) != NULL
+        && t->offset + t->length > smb_stat_get(st_remote, SMB_STAT_SIZE)
+        && t->offset + t->length > smb_stat_get(st_remote, SMB_STAT_ALLOC_SIZE))
+        smb_fallocate(t->s, t->fd, t->offset + t->length);
+    
+    return smb_transfer_run(t, opts, done);
+}
+
+// Ends a resumable transfer: the checkpoint goes away once the copy is
+// complete, otherwise it is brought up to date.
+static int smb_transfer_job_end(smb_transfer *t, int res, uint64_t done)
+{
+    if (res == DSM_SUCCESS && (uint64_t)t->offset + done == t->ckpt.size)
+    {
+        unlink(t->checkpoint);
+        return DSM_SUCCESS;
+    }
+    
+    if (t->consumed > (off_t)t->ckpt.offset)
+        smb_transfer_checkpoint_save(t);
+    
+    // A source that ended early changed under us
+    return res != DSM_SUCCESS ? res : smb_session_network_error(t->s);
+}
+
+typedef struct smb_stripe_job smb_stripe_job;
+
+// One session of a striped transfer and its share of the file
+typedef struct
+{
+    smb_stripe_job      *job;
+    smb_session         *s;
+    smb_fd              fd;
+    off_t               next;           // Start of what is left of its share
+    off_t               end;            // End of its share, lowered by thieves
+    off_t               last;           // Progress reported in the current range
+    smb_transfer_callbacks callbacks;   // Reports to the job
+    pthread_t           thread;
+    bool                running;        // 'thread' has to be joined
+} smb_stripe;
+
+struct smb_stripe_job
+{
+    const smb_stripe_target *target;
+    const char          *path;
+    int                 local_fd;
+    bool                upload;
+    smb_transfer_opts   opts;           // Of each range
+    const smb_transfer_callbacks *callbacks; // Of the caller
+    smb_stripe          stripes[SMB_TRANSFER_STREAMS_MAX];
+    size_t              count;
+    uint64_t            size;
+    uint64_t            done;
+    struct timespec     start;
+    pthread_mutex_t     lock;           // Protects all of the above once running
+    bool                failed;
+    bool                canceled;
+};
+
+static int smb_stripe_connect(smb_stripe *st)
+{
+    const smb_stripe_target *target = st->job->target;
+    smb_fopen_opts          fopts;
+    smb_tid                 tid;
+    int                     res;
+    
+    if ((st->s = smb_session_new()) == NULL)
+        return DSM_ERROR_GENERIC;
+    
+    smb_session_set_creds(st->s, target->domain, target->login, target->password);
+    res = smb_session_open_share(st->s, target->hostname, target->ip,
+                                 target->transport, target->share, &tid);
+    if (res == DSM_SUCCESS && st->job->upload)
+    {
+        // The first session created the file
+        smb_fopen_opts_init(&fopts, SMB_MOD_RW);
+        fopts.disposition = SMB_DISPOSITION_FILE_OPEN;
+        res = smb_fopen_ex(st->s, tid, st->job->path, SMB_MOD_RW, &fopts, &st->fd);
+    }
+    else if (res == DSM_SUCCESS)
+        res = smb_fopen(st->s, tid, st->job->path, SMB_MOD_RO, &st->fd);
+    
+    if (res != DSM_SUCCESS)
+    {
+        smb_session_destroy(st->s);
+        st->s = NULL;
+    }
+    
+    return res;
+}
+
+// Hands the next range to a session: from its own share first, then from
+// the share with the most left, whose second half it steals.
+static bool smb_stripe_take(smb_stripe *st, off_t *offset, uint64_t *length)
+{
+    smb_stripe_job      *job = st->job;
+    smb_stripe          *victim = NULL;
+    off_t               left, mid;
+    size_t              i;
+    bool                res = false;
+    
+    pthread_mutex_lock(&job->lock);
+    if (!job->failed && !job->canceled)
+    {
+        if (st->next >= st->end)
+        {
+            for (i = 0, left = 0; i < job->count; i++)
+                if (job->stripes[i].end - job->stripes[i].next > left)
+                {
+                    victim = &job->stripes[i];
+                    left   = victim->end - victim->next;
+                }
+            if (victim != NULL)
+            {
+                // Whole stripes, the victim may be in the middle of one
+                mid = victim->next;
+                if (left > SMB_TRANSFER_STRIPE_SIZE)
+                    mid += (left / 2 + SMB_TRANSFER_STRIPE_SIZE - 1)
+                           / SMB_TRANSFER_STRIPE_SIZE * SMB_TRANSFER_STRIPE_SIZE;
+                st->next     = mid;
+                st->end      = victim->end;
+                victim->end  = mid;
+            }
+        }
+        if (st->next < st->end)
+        {
+            *offset   = st->next;
+            *length   = st->end - st->next < SMB_TRANSFER_STRIPE_SIZE
+                        ? st->end - st->next : SMB_TRANSFER_STRIPE_SIZE;
+            st->next += *length;
+            st->last  = *offset;
+            res       = true;
+        }
+    }
+    pthread_mutex_unlock(&job->lock);
+    
+    return res;
+}
+
+// Progress of one range, turned into the progress of the whole job. Stops
+// the range when another session failed.
+static bool smb_stripe_progress(void *p_opaque, const smb_transfer_progress *progress)
+{
+    smb_stripe              *st = p_opaque;
+    smb_stripe_job          *job = st->job;
+    smb_transfer_progress   total;
+    struct timespec         now;
+    double                  elapsed;
+    bool                    res;
+    
+    pthread_mutex_lock(&job->lock);
+    job->done += progress->done - st->last;
+    st->last   = progress->done;
+    
+    if (job->callbacks != NULL && job->callbacks->pf_on_progress != NULL
+        && !job->canceled)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (now.tv_sec - job->start.tv_sec)
+                  + (now.tv_nsec - job->start.tv_nsec) / 1e9;
+        total.done  = job->done;
+        total.total = job->size;
+        total.rate  = elapsed > 0 ? job->done / elapsed : 0;
+        total.eta   = total.rate > 0 ? (job->size - job->done) / total.rate : -1;
+        if (!job->callbacks->pf_on_progress(job->callbacks->p_opaque, &total))
+            job->canceled = true;
+    }
+    res = !job->failed && !job->canceled;
+    pthread_mutex_unlock(&job->lock);
+    
+    return res;
+}
+
+static void *smb_stripe_run(void *arg)
+{
+    smb_stripe          *st = arg;
+    smb_stripe_job      *job = st->job;
+    smb_transfer_opts   opts = job->opts;
+    smb_transfer        t;
+    uint64_t            done;
+    int                 res;
+    
+    // A session that can't connect just leaves its share to the others
+    if (st->s == NULL && smb_stripe_connect(st) != DSM_SUCCESS)
+        return NULL;
+    
+    st->callbacks.p_opaque       = st;
+    st->callbacks.pf_on_progress = smb_stripe_progress;
+    opts.callbacks               = &st->callbacks;
+    
+    while (smb_stripe_take(st, &opts.offset, &opts.length))
+    {
+        memset(&t, 0, sizeof(t));
+        t.s         = st->s;
+        t.fd        = st->fd;
+        t.local_fd  = job->local_fd;
+        t.shared_fd = true;
+        if (job->upload)
+            res = smb_transfer_upload(&t, &opts, &done);
+        else
+            res = smb_transfer_download(&t, &opts, &done);
+        
+        if (res != DSM_SUCCESS || done != opts.length)
+        {
+            pthread_mutex_lock(&job->lock);
+            if (!job->canceled)
+                job->failed = true;
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+    }
+    
+    smb_fclose(st->s, st->fd);
+    smb_session_destroy(st->s);
+    st->s = NULL;
+    
+    return NULL;
+}
+
+// Splits the file between the sessions and runs them, the first one being
+// already connected and running in the calling thread.
+static int smb_stripe_job_run(smb_stripe_job *job, size_t streams)
+{
+    uint64_t            share, stripes;
+    size_t              i;
+    int                 res = DSM_SUCCESS;
+    
+    stripes    = (job->size + SMB_TRANSFER_STRIPE_SIZE - 1) / SMB_TRANSFER_STRIPE_SIZE;
+    job->count = streams < SMB_TRANSFER_STREAMS_MAX ? streams : SMB_TRANSFER_STREAMS_MAX;
+    job->count = job->count < stripes ? job->count : stripes;
+    job->count = job->count ? job->count : 1;
+    share      = (stripes + job->count - 1) / job->count * SMB_TRANSFER_STRIPE_SIZE;
+    
+    for (i = 0; i < job->count; i++)
+    {
+        job->stripes[i].job  = job;
+        job->stripes[i].next = i * share < job->size ? i * share : job->size;
+        job->stripes[i].end  = (i + 1) * share < job->size ? (i + 1) * share : job->size;
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    pthread_mutex_init(&job->lock, NULL);
+    for (i = 1; i < job->count; i++)
+        job->stripes[i].running = pthread_create(&job->stripes[i].thread, NULL,
+                                                 smb_stripe_run, &job->stripes[i]) == 0;
+    smb_stripe_run(&job->stripes[0]);
+    for (i = 1; i < job->count; i++)
+        if (job->stripes[i].running)
+            pthread_join(job->stripes[i].thread, NULL);
+    pthread_mutex_destroy(&job->lock);
+    
+    if (job->canceled)
+        return DSM_ERROR_CANCELED;
+    for (i = 0; i < job->count; i++)
+        if (job->stripes[i].next < job->stripes[i].end)
+            res = DSM_ERROR_NETWORK;
+    
+    return job->failed ? DSM_ERROR_NETWORK : res;
+}
+
+@implementation smbTransfer
+
+#pragma mark - smbTransferOptsInit
+void smb_transfer_opts_init(smb_transfer_opts *opts)
+{
+    assert(opts != NULL);
+    
+    memset(opts, 0, sizeof(*opts));
+    opts->buffer_size   = SMB_TRANSFER_BUFFER_SIZE;
+    opts->buffers       = SMB_TRANSFER_BUFFERS_MAX;
+    opts->preallocate   = true;
+    opts->sparse        = true;
+}
+
+#pragma mark - smbDownloadToFd
+int smb_download_to_fd(smb_session *s, smb_fd fd, int local_fd,
+                       const smb_transfer_opts *opts, uint64_t *done)
+{
+    smb_transfer_opts   defaults;
+    smb_transfer        t;
+    uint64_t            copied;
+    int                 res;
+    
+    assert(s != NULL && local_fd >= 0);
+    
+    if (opts == NULL)
+    {
+        smb_transfer_opts_init(&defaults);
+        opts = &defaults;
+    }
+    
+    memset(&t, 0, sizeof(t));
+    t.s         = s;
+    t.fd        = fd;
+    t.local_fd  = local_fd;
+    
+    res = smb_transfer_download(&t, opts, &copied);
+    if (done != NULL)
+        *done = copied;
+    
+    return res;
+}
+
+#pragma mark - smbUploadFromFd
+int smb_upload_from_fd(smb_session *s, smb_fd fd, int local_fd,
+                       const smb_transfer_opts *opts, uint64_t *done)
+{
+    smb_transfer_opts   defaults;
+    smb_transfer        t;
+    uint64_t            copied;
+    int                 res;
+    
+    assert(s != NULL && local_fd >= 0);
+    
+    if (opts == NULL)
+    {
+        smb_transfer_opts_init(&defaults);
+        opts = &defaults;
+    }
+    
+    memset(&t, 0, sizeof(t));
+    t.s         = s;
+    t.fd        = fd;
+    t.local_fd  = local_fd;
+    
+    res = smb_transfer_upload(&t, opts, &copied);
+    if (done != NULL)
+        *done = copied;
+    
+    return res;
+}
+
+#pragma mark - smbDownloadResumable
+int smb_download_resumable(smb_session *s, smb_tid tid, const char *path,
+                           const char *local_path, const char *checkpoint,
+                           const smb_transfer_opts *opts)
+{
+    smb_transfer_opts       o;
+    smb_transfer_checkpoint saved;
+    smb_transfer            t;
+    smb_stat                st;
+    struct stat             local_st;
+    uint64_t                done;
+    int                     err;
+    
+    assert(s != NULL && path != NULL && local_path != NULL && checkpoint != NULL);
+    
+    if (opts != NULL)
+        o = *opts;
+    else
+        smb_transfer_opts_init(&o);
+    
+    memset(&t, 0, sizeof(t));
+    t.s          = s;
+    t.checkpoint = checkpoint;
+    
+    if ((err = smb_fopen(s, tid, path, SMB_MOD_RO, &t.fd)) != DSM_SUCCESS)
+        return err;
+    if ((st = smb_stat_fd(s, t.fd)) == NULL
+        || (t.local_fd = open(local_path, O_WRONLY | O_CREAT, 0644)) == -1)
+    {
+        smb_fclose(s, t.fd);
+        return DSM_ERROR_GENERIC;
+    }
+    
+    // Resume only if the remote file is still the one of the checkpoint
+    t.ckpt.size  = smb_stat_get(st, SMB_STAT_SIZE);
+    t.ckpt.mtime = smb_stat_get(st, SMB_STAT_MTIME);
+    if (smb_transfer_checkpoint_read(checkpoint, &saved)
+        && saved.size == t.ckpt.size && saved.mtime == t.ckpt.mtime
+        && saved.offset <= saved.size)
+        t.ckpt.offset = saved.offset;
+    
+    // Whatever is past the checkpoint wasn't acknowledged
+    if (fstat(t.local_fd, &local_st) == 0 && (uint64_t)local_st.st_size > t.ckpt.offset)
+        ftruncate(t.local_fd, t.ckpt.offset);
+    
+    o.offset = t.ckpt.offset;
+    o.length = 0;
+    err = smb_transfer_download(&t, &o, &done);
+    err = smb_transfer_job_end(&t, err, done);
+    if (err == DSM_SUCCESS && fsync(t.local_fd) == -1)
+        err = DSM_ERROR_GENERIC;
+    close(t.local_fd);
+    smb_fclose(s, t.fd);
+    
+    return err;
+}
+
+#pragma mark - smbUploadResumable
+int smb_upload_resumable(smb_session *s, smb_tid tid, const char *local_path,
+                         const char *path, const char *checkpoint,
+                         const smb_transfer_opts *opts)
+{
+    smb_transfer_opts       o;
+    smb_transfer_checkpoint saved;
+    smb_transfer            t;
+    smb_fopen_opts          fopts;
+    smb_stat                st;
+    struct stat             local_st;
+    uint64_t                size, done;
+    int                     err;
+    
+    assert(s != NULL && path != NULL && local_path != NULL && checkpoint != NULL);
+    
+    if (opts != NULL)
+        o = *opts;
+    else
+        smb_transfer_opts_init(&o);
+    
+    memset(&t, 0, sizeof(t));
+    t.s          = s;
+    t.checkpoint = checkpoint;
+    
+    if ((t.local_fd = open(local_path, O_RDONLY)) == -1)
+        return DSM_ERROR_GENERIC;
+    if (fstat(t.local_fd, &local_st) == -1)
+    {
+        close(t.local_fd);
+        return DSM_ERROR_GENERIC;
+    }
+    
+    // Resume only if the local file is still the one of the checkpoint
+    t.ckpt.size  = local_st.st_size;
+    t.ckpt.mtime = local_st.st_mtime;
+    if (smb_transfer_checkpoint_read(checkpoint, &saved)
+        && saved.size == t.ckpt.size && saved.mtime == t.ckpt.mtime
+        && saved.offset <= saved.size)
+        t.ckpt.offset = saved.offset;
+    
+    // Keep what was uploaded when resuming, start afresh otherwise
+    smb_fopen_opts_init(&fopts, SMB_MOD_RW);
+    if (t.ckpt.offset > 0)
+        fopts.disposition = SMB_DISPOSITION_FILE_OPEN_IF;
+    fopts.alloc_size = t.ckpt.size;
+    if ((err = smb_fopen_ex(s, tid, path, SMB_MOD_RW, &fopts, &t.fd)) != DSM_SUCCESS)
+    {
+        close(t.local_fd);
+        return err;
+    }
+    
+    // The server may have lost what it hadn't committed
+    if ((st = smb_stat_fd(s, t.fd)) != NULL
+        && (size = smb_stat_get(st, SMB_STAT_SIZE)) < t.ckpt.offset)
+        t.ckpt.offset = size;
+    
+    o.offset = t.ckpt.offset;
+    o.length = 0;
+    err = smb_transfer_upload(&t, &o, &done);
+    err = smb_transfer_job_end(&t, err, done);
+    if (smb_fclose(s, t.fd) != DSM_SUCCESS && err == DSM_SUCCESS)
+        err = DSM_ERROR_NT;
+    close(t.local_fd);
+    
+    return err;
+}
+
+#pragma mark - smbDownloadStriped
+int smb_download_striped(const smb_stripe_target *target, const char *path,
+                         int local_fd, size_t streams,
+                         const smb_transfer_opts *opts)
+{
+    smb_stripe_job      job;
+    smb_stripe          *first = &job.stripes[0];
+    smb_stat            st;
+    struct stat         local_st;
+    int                 res;
+    
+    assert(target != NULL && path != NULL && local_fd >= 0);
+    
+    memset(&job, 0, sizeof(job));
+    if (opts != NULL)
+        job.opts = *opts;
+    else
+        smb_transfer_opts_init(&job.opts);
+    job.target    = target;
+    job.path      = path;
+    job.local_fd  = local_fd;
+    job.callbacks = job.opts.callbacks;
+    first->job    = &job;
+    
+    // The first session finds the size, the others connect in their thread
+    if ((res = smb_stripe_connect(first)) != DSM_SUCCESS)
+        return res;
+    if ((st = smb_stat_fd(first->s, first->fd)) == NULL)
+    {
+        smb_fclose(first->s, first->fd);
+        smb_session_destroy(first->s);
+        return DSM_ERROR_GENERIC;
+    }
+    job.size = smb_stat_get(st, SMB_STAT_SIZE);
+    
+    // Once for the whole file, the ranges come in any order
+    if (job.opts.preallocate && job.size > 0)
+        smb_transfer_preallocate(local_fd, 0, job.size);
+    job.opts.preallocate = false;
+    
+    // The ranges leave their trailing holes unwritten, the file gets its
+    // size once they are all done
+    res = smb_stripe_job_run(&job, streams);
+    if (res == DSM_SUCCESS && fstat(local_fd, &local_st) == 0
+        && (uint64_t)local_st.st_size < job.size)
+        ftruncate(local_fd, job.size);
+    
+    return res;
+}
+
+#pragma mark - smbUploadStriped
+int smb_upload_striped(const smb_stripe_target *target, int local_fd,
+                       const char *path, size_t streams,
+                       const smb_transfer_opts *opts)
+{
+    smb_stripe_job      job;
+    smb_stripe          *first = &job.stripes[0];
+    smb_fopen_opts      fopts;
+    struct stat         st;
+    smb_tid             tid;
+    int                 res;
+    
+    assert(target != NULL && path != NULL && local_fd >= 0);
+    
+    if (fstat(local_fd, &st) == -1 || !S_ISREG(st.st_mode))
+        return DSM_ERROR_GENERIC;
+    
+    memset(&job, 0, sizeof(job));
+    if (opts != NULL)
+        job.opts = *opts;
+    else
+        smb_transfer_opts_init(&job.opts);
+    job.target    = target;
+    job.path      = path;
+    job.local_fd  = local_fd;
+    job.upload    = true;
+    job.callbacks = job.opts.callbacks;
+    job.size      = st.st_size;
+    first->job    = &job;
+    
+    // The first session creates the file with all its space allocated, the
+    // others open it in their thread.
+    if ((first->s = smb_session_new()) == NULL)
+        return DSM_ERROR_GENERIC;
+    smb_session_set_creds(first->s, target->domain, target->login, target->password);
+    res = smb_session_open_share(first->s, target->hostname, target->ip,
+                                 target->transport, target->share, &tid);
+    if (res == DSM_SUCCESS)
+    {
+        smb_fopen_opts_init(&fopts, SMB_MOD_RW);
+        if (job.opts.preallocate)
+            fopts.alloc_size = job.size;
+        res = smb_fopen_ex(first->s, tid, path, SMB_MOD_RW, &fopts, &first->fd);
+    }
+    // The ranges mustn't reserve space on their own: their view of the end
+    // of file is stale, and a smaller allocation would cut the others' data.
+    job.opts.preallocate = false;
+    if (res != DSM_SUCCESS)
+    {
+        smb_session_destroy(first->s);
+        return res;
+    }
+    
+    return smb_stripe_job_run(&job, streams);
+}
+@end
@@ -19,5 +19,19 @@ void smb_transport_nbt(smb_transport *tr);
 /*!Fill the smb_transport structure with the fun pointers for using DirectTCP transport
  */
 void smb_transport_tcp(smb_transport *tr);
+
+#pragma mark - smbTransportUring
+/*!Fill the smb_transport structure with the fun pointers for using DirectTCP transport through io_uring
+ * Messages are sent in batches with the next receive (or flush), see netbios_session_use_uring(). Same as smb_transport_tcp() where io_uring is not available.
+ */
+void smb_transport_uring(smb_transport *tr);
+
+#ifdef DEBUG
+#pragma mark - smbTransportLoopback
+/*!Fill the smb_transport structure with the fun pointers for using the in-process transport
+ * The requests go to an embedded server sharing a local directory (see smb_session_connect_loopback()), without network. For tests and benchmarks, in Debug builds.
+ */
+void smb_transport_loopback(smb_transport *tr);
+#endif
 @end
 #endif
@@ -18,12 +18,23 @@ int transport_connect_nbt(uint32_t ip, netbios_session *s, const char *name) {
     return netbios_session_connect(ip, s, name, 0);
 }
 
+int transport_connect_uring(uint32_t ip, netbios_session *s, const char *name) {
+    if (!netbios_session_connect(ip, s, name, 1)) {
+        return 0;
+    }
+    // Without io_uring, the socket calls do the job
+    netbios_session_use_uring(s);
+    return 1;
+}
+
 #pragma mark - smbTransportNBT
 /*!Fill the smb_transport structure with the fun pointers for using NBT transport
  */
 void smb_transport_nbt(smb_transport *tr) {
     assert(tr != NULL);
     
+    tr->max_frame = NETBIOS_SESSION_MAX_PAYLOAD;
+    
     // Sorry for the dirty cast.
     tr->new = (void *)netbios_session_new;
     tr->connect = (void *)transport_connect_nbt;
@@ -31,7 +42,13 @@ void smb_transport_nbt(smb_transport *tr) {
     tr->pkt_init = (void *)netbios_session_packet_init;
     tr->pkt_append = (void *)netbios_session_packet_append;
     tr->send = (void *)netbios_session_packet_send;
+    tr->sendv = (void *)netbios_session_packet_sendv;
     tr->recv = (void *)netbios_session_packet_recv;
+    tr->recv_head = (void *)netbios_session_packet_recv_head;
+    tr->recv_body = (void *)netbios_session_packet_recv_body;
+    tr->set_timeouts = (void *)netbios_session_set_timeouts;
+    tr->timed_out = (void *)netbios_session_timed_out;
+    tr->flush = (void *)netbios_session_flush;
 }
 
 #pragma mark - smb_transport_tcp
@@ -40,13 +57,56 @@ void smb_transport_nbt(smb_transport *tr) {
 void smb_transport_tcp(smb_transport *tr) {
     assert(tr != NULL);
     
+    tr->max_frame = NETBIOS_DIRECT_MAX_PAYLOAD;
+    
     tr->new = (void *)netbios_session_new;
     tr->connect = (void *)transport_connect_tcp;
     tr->destroy = (void *)netbios_session_destroy;
     tr->pkt_init = (void *)netbios_session_packet_init;
     tr->pkt_append = (void *)netbios_session_packet_append;
     tr->send = (void *)netbios_session_packet_send;
+    tr->sendv = (void *)netbios_session_packet_sendv;
     tr->recv = (void *)netbios_session_packet_recv;
+    tr->recv_head = (void *)netbios_session_packet_recv_head;
+    tr->recv_body = (void *)netbios_session_packet_recv_body;
+    tr->set_timeouts = (void *)netbios_session_set_timeouts;
+    tr->timed_out = (void *)netbios_session_timed_out;
+    tr->flush = (void *)netbios_session_flush;
+}
+
+#pragma mark - smbTransportUring
+/*!Fill the smb_transport structure with the fun pointers for using DirectTCP transport through io_uring
+ */
+void smb_transport_uring(smb_transport *tr) {
+    assert(tr != NULL);
+    
+    smb_transport_tcp(tr);
+    tr->connect = (void *)transport_connect_uring;
+}
+
+#ifdef DEBUG
+#pragma mark - smbTransportLoopback
+/*!Fill the smb_transport structure with the fun pointers for using the in-process transport
+ */
+void smb_transport_loopback(smb_transport *tr) {
+    assert(tr != NULL);
+    
+    tr->max_frame = SMB_LOOPBACK_MAX_PAYLOAD;
+    
+    tr->new = (void *)smb_loopback_new;
+    tr->connect = (void *)smb_loopback_connect;
+    tr->destroy = (void *)smb_loopback_destroy;
+    tr->pkt_init = (void *)smb_loopback_packet_init;
+    tr->pkt_append = (void *)smb_loopback_packet_append;
+    tr->send = (void *)smb_loopback_packet_send;
+    tr->sendv = (void *)smb_loopback_packet_sendv;
+    tr->recv = (void *)smb_loopback_packet_recv;
+    tr->recv_head = (void *)smb_loopback_packet_recv_head;
+    tr->recv_body = (void *)smb_loopback_packet_recv_body;
+    tr->set_timeouts = (void *)smb_loopback_set_timeouts;
+    tr->timed_out = (void *)smb_loopback_timed_out;
+    tr->flush = (void *)smb_loopback_flush;
 }
+#endif
 
 @end